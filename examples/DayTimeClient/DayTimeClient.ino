@@ -16,7 +16,7 @@ EtherSia_ENC28J60 ether;
 TCPClient tcp(ether);
 
 void setup() {
-    MACAddress macAddress("6e:e7:2f:4c:64:78");
+    static constexpr MACAddress macAddress = "6e:e7:2f:4c:64:78"_mac;
 
     // Setup serial port
     Serial.begin(57600);
@@ -28,6 +28,9 @@ void setup() {
         Serial.println("Failed to configure Ethernet");
     }
 
+    // Wait for stateless auto-configuration to get a global address
+    ether.waitForAddress();
+
     if (tcp.setRemoteAddress("time.ethersia.aelius.com", 13)) {
         Serial.print("Remote address: ");
         tcp.remoteAddress().println();
@@ -34,7 +34,7 @@ EtherSia_ENC28J60 ether;
 
 /** Define TCP socket to send messages from */
 TCPClient tcp(ether);
-MACAddress macAddress("6e:e7:2f:4c:64:92");
+constexpr MACAddress macAddress = "6e:e7:2f:4c:64:92"_mac;
 
 /** interface initilization */
 void interfaceConfig(){
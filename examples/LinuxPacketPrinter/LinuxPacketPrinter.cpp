@@ -31,7 +31,7 @@ EtherSia_LinuxSocket ether("eth0");
  */
 int main()
 {
-    MACAddress macAddress("5e:73:f9:8a:cf:ba");
+    static constexpr MACAddress macAddress = "5e:73:f9:8a:cf:ba"_mac;
 
     Serial.println("[EtherSia LinuxPacketPrinter]");
     Serial.print("Our MAC is: ");
@@ -23,7 +23,7 @@ HTTPServer http(ether);
 
 
 void setup() {
-    MACAddress macAddress("9e:b3:19:c7:1b:10");
+    static constexpr MACAddress macAddress = "9e:b3:19:c7:1b:10"_mac;
 
     // Setup serial port
     Serial.begin(115200);
@@ -35,6 +35,9 @@ void setup() {
         Serial.println("Failed to configure Ethernet");
     }
 
+    // Wait for stateless auto-configuration to get a global address
+    ether.waitForAddress();
+
     Serial.print("Our link-local address is: ");
     ether.linkLocalAddress().println();
     Serial.print("Our global address is: ");
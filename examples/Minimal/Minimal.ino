@@ -17,7 +17,7 @@
 EtherSia_ENC28J60 ether;
 
 void setup() {
-    MACAddress macAddress("3e:ad:93:36:7d:9d");
+    static constexpr MACAddress macAddress = "3e:ad:93:36:7d:9d"_mac;
 
     // Setup serial port for debugging
     Serial.begin(38400);
@@ -28,6 +28,9 @@ void setup() {
         Serial.println("Failed to configure Ethernet");
     }
 
+    // Wait for stateless auto-configuration to get a global address
+    ether.waitForAddress();
+
     Serial.print("Global address: ");
     ether.globalAddress().println();
 }
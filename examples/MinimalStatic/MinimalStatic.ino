@@ -17,7 +17,7 @@
 EtherSia_ENC28J60 ether;
 
 void setup() {
-    MACAddress macAddress("e6:a6:57:21:ec:d1");
+    static constexpr MACAddress macAddress = "e6:a6:57:21:ec:d1"_mac;
 
     // Setup serial port for debugging
     Serial.begin(57600);
@@ -61,6 +61,9 @@ void setup() {
         Serial.println("Failed to configure Ethernet");
     }
 
+    // Wait for stateless auto-configuration to get a global address
+    ether.waitForAddress();
+
     if (udp.setRemoteAddress("2001:41c8:51:7cf::6", 1234)) {
         Serial.print("Remote address: ");
         udp.remoteAddress().println();
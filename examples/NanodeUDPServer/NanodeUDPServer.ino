@@ -66,6 +66,9 @@ void setup() {
         Serial.println("Failed to configure Ethernet");
     }
 
+    // Wait for stateless auto-configuration to get a global address
+    ether.waitForAddress();
+
     Serial.print("Our link-local address is: ");
     ether.linkLocalAddress().println();
     Serial.print("Our global address is: ");
@@ -15,7 +15,7 @@
 EtherSia_ENC28J60 ether(10);
 
 void setup() {
-    MACAddress macAddress("e2:d7:66:39:6b:5e");
+    static constexpr MACAddress macAddress = "e2:d7:66:39:6b:5e"_mac;
 
     // Setup serial port for debugging
     Serial.begin(38400);
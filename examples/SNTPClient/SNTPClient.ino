@@ -33,7 +33,7 @@ const uint32_t DEFAULT_POLLING_INTERVAL = 15;
 
 
 void setup() {
-    MACAddress macAddress("76:73:19:ba:b8:19");
+    static constexpr MACAddress macAddress = "76:73:19:ba:b8:19"_mac;
 
     // Setup serial port
     Serial.begin(115200);
@@ -45,6 +45,9 @@ void setup() {
         Serial.println("Failed to configure Ethernet");
     }
 
+    // Wait for stateless auto-configuration to get a global address
+    ether.waitForAddress();
+
     Serial.print("Our global address is: ");
     ether.globalAddress().println();
 
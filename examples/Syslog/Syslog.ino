@@ -23,10 +23,11 @@ Syslog syslog(ether);
 
 
 void setup() {
-    MACAddress macAddress("0a:2c:8c:ba:66:2d");
+    static constexpr MACAddress macAddress = "0a:2c:8c:ba:66:2d"_mac;
 
     // Start Ethernet
     ether.begin(macAddress);
+    ether.waitForAddress();
 
     // Set the address of the syslog server
     syslog.setRemoteAddress("logger.example.com");
@@ -34,7 +34,7 @@ EtherSia_ENC28J60 ether(10);
 CustomTFTPServer tftp(ether);
 
 void setup() {
-    MACAddress macAddress("62:84:98:22:09:2c");
+    static constexpr MACAddress macAddress = "62:84:98:22:09:2c"_mac;
 
     // Setup serial port
     Serial.begin(57600);
@@ -48,6 +48,9 @@ void setup() {
         Serial.println("Failed to configure Ethernet");
     }
 
+    // Wait for stateless auto-configuration to get a global address
+    ether.waitForAddress();
+
     Serial.print("Our link-local address is: ");
     ether.linkLocalAddress().println();
     Serial.print("Our global address is: ");
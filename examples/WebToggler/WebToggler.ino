@@ -79,7 +79,7 @@ const char PROGMEM label4[] = "Output 4";  ///< Label on HTML page for Output 4
 /** Called once at the start */
 void setup()
 {
-    MACAddress macAddress("d6:9c:e1:1c:0b:32");
+    static constexpr MACAddress macAddress = "d6:9c:e1:1c:0b:32"_mac;
 
     Serial.begin(115200);
     Serial.println(F("[EtherSia WebToggler]"));
@@ -101,6 +101,9 @@ void setup()
         Serial.println("Failed to configure Ethernet");
     }
 
+    // Wait for stateless auto-configuration to get a global address
+    ether.waitForAddress();
+
     Serial.print(F("Our address is: "));
     ether.globalAddress().println();
 
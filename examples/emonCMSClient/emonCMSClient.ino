@@ -36,7 +36,9 @@ EtherSia_ENC28J60 ether;
 
 /** Define TCP socket to send messages from */
 TCPClient tcp(ether);
-MACAddress macAddress("6e:e7:2f:4c:64:92");
+/** MAC address used if there is no 1-wire serial number to make one from */
+constexpr MACAddress defaultMacAddress = "6e:e7:2f:4c:64:92"_mac;
+MACAddress macAddress = defaultMacAddress;
 
 /** interface initilization */
 void interfaceConfig(){
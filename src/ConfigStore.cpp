@@ -0,0 +1,137 @@
+#include "EtherSia.h"
+#include "util.h"
+
+#ifdef __AVR__
+#include <avr/eeprom.h>
+#endif
+
+#ifndef ARDUINO
+#include <stdio.h>
+#endif
+
+
+boolean EtherSia::saveConfig()
+{
+    struct ethersia_config config;
+
+    if (_configStore == NULL) {
+        return false;
+    }
+
+    config.version = ETHERSIA_CONFIG_VERSION;
+    config.localMac = _localMac;
+    config.globalAddress = _globalAddress;
+    config.routerMac = _routerMac;
+    config.dnsServerAddress = _dnsServerAddress;
+    config.flags = 0;
+    if (_dnsServerLifetime) {
+        config.flags |= ETHERSIA_CONFIG_FLAG_DNS_FROM_RA;
+    }
+    config.checksum = chksum(0, (uint8_t*)&config, sizeof(config) - sizeof(config.checksum));
+
+    return _configStore->write(&config, sizeof(config));
+}
+
+boolean EtherSia::restoreConfig()
+{
+    struct ethersia_config config;
+
+    if (_configStore == NULL || !_configStore->read(&config, sizeof(config))) {
+        return false;
+    }
+
+    // Check that the saved configuration is valid and is for us
+    if (config.version != ETHERSIA_CONFIG_VERSION ||
+            config.checksum != chksum(0, (uint8_t*)&config, sizeof(config) - sizeof(config.checksum)) ||
+            config.localMac != _localMac) {
+        return false;
+    }
+
+    // Restored entries only last a short time, unless a Router Advertisement confirms them
+    if (_globalAddress.isZero() && !config.globalAddress.isZero()) {
+        _globalAddress = config.globalAddress;
+        _addressGeneration++;
+        _prefixes[0].prefix = config.globalAddress;
+        _prefixes[0].prefix.maskPrefix(64);
+        _prefixes[0].length = 64;
+        _prefixes[0].flags = ND_PREFIX_FLAG_ON_LINK | ND_PREFIX_FLAG_AUTONOMOUS;
+        _prefixes[0].validLifetime = ETHERSIA_RESTORED_LIFETIME;
+        _prefixes[0].preferredLifetime = ETHERSIA_RESTORED_LIFETIME;
+    }
+
+    if (config.routerMac != MACAddress()) {
+        _routerMac = config.routerMac;
+        _routers[0].mac = config.routerMac;
+        _routers[0].preference = 0;
+        _routers[0].lifetime = ETHERSIA_RESTORED_LIFETIME;
+    }
+
+    _dnsServerAddress = config.dnsServerAddress;
+    if (config.flags & ETHERSIA_CONFIG_FLAG_DNS_FROM_RA) {
+        _dnsServerLifetime = ETHERSIA_RESTORED_LIFETIME;
+    } else {
+        _dnsServerLifetime = 0;
+    }
+
+    return true;
+}
+
+
+#ifdef __AVR__
+
+EtherSia_EEPROMStore::EtherSia_EEPROMStore(uint16_t address)
+{
+    _address = address;
+}
+
+boolean EtherSia_EEPROMStore::read(void *data, uint16_t len)
+{
+    eeprom_read_block(data, (const void*)_address, len);
+    return true;
+}
+
+boolean EtherSia_EEPROMStore::write(const void *data, uint16_t len)
+{
+    eeprom_update_block(data, (void*)_address, len);
+    return true;
+}
+
+#endif
+
+
+#ifndef ARDUINO
+
+EtherSia_FileStore::EtherSia_FileStore(const char *path)
+{
+    _path = path;
+}
+
+boolean EtherSia_FileStore::read(void *data, uint16_t len)
+{
+    FILE *file = fopen(_path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    size_t result = fread(data, 1, len, file);
+    fclose(file);
+
+    return result == len;
+}
+
+boolean EtherSia_FileStore::write(const void *data, uint16_t len)
+{
+    FILE *file = fopen(_path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+
+    size_t result = fwrite(data, 1, len, file);
+    if (fclose(file) != 0) {
+        return false;
+    }
+
+    return result == len;
+}
+
+#endif
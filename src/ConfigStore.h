@@ -0,0 +1,112 @@
+/**
+ * Header file for saving and restoring the network configuration
+ * @file ConfigStore.h
+ */
+
+#ifndef CONFIGSTORE_H
+#define CONFIGSTORE_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "MACAddress.h"
+#include "IPv6Address.h"
+
+/** Version number of the ethersia_config structure - increase when it changes */
+#define ETHERSIA_CONFIG_VERSION        (1)
+
+/** Lifetime (in seconds) of a restored prefix and router, until a Router Advertisement confirms them */
+#define ETHERSIA_RESTORED_LIFETIME     (30)
+
+/** The DNS server address in the configuration was learned from a Router Advertisement */
+#define ETHERSIA_CONFIG_FLAG_DNS_FROM_RA  (0x01)
+
+
+/**
+ * Snapshot of the network configuration, that can be saved and restored
+ * @private
+ */
+struct ethersia_config {
+    uint8_t version;                ///< ETHERSIA_CONFIG_VERSION
+    MACAddress localMac;            ///< The configuration is only valid for this MAC address
+    IPv6Address globalAddress;      ///< Our global address
+    MACAddress routerMac;           ///< The MAC address of the default router
+    IPv6Address dnsServerAddress;   ///< The address of the DNS server
+    uint8_t flags;                  ///< ETHERSIA_CONFIG_FLAG_ values
+    uint16_t checksum;              ///< Checksum of all the fields above
+} __attribute__((__packed__));
+
+
+/**
+ * Abstract base class for somewhere to save and restore the network configuration
+ *
+ * Give an instance of a sub-class to EtherSia::setConfigStore() before calling begin().
+ */
+class EtherSia_ConfigStore {
+public:
+    /**
+     * Read the saved configuration
+     *
+     * @param data The buffer to read into
+     * @param len The number of bytes to read
+     * @return true if the bytes were read successfully
+     */
+    virtual boolean read(void *data, uint16_t len) = 0;
+
+    /**
+     * Save the configuration
+     *
+     * @param data The bytes to save
+     * @param len The number of bytes to save
+     * @return true if the bytes were saved successfully
+     */
+    virtual boolean write(const void *data, uint16_t len) = 0;
+};
+
+
+#ifdef __AVR__
+/**
+ * Save and restore the network configuration to the AVR's internal EEPROM
+ *
+ * Only bytes that have changed are written, to avoid wearing out the EEPROM.
+ */
+class EtherSia_EEPROMStore : public EtherSia_ConfigStore {
+public:
+    /**
+     * Constructor
+     * @param address the offset in the EEPROM to store the configuration at
+     */
+    EtherSia_EEPROMStore(uint16_t address = 0);
+
+    virtual boolean read(void *data, uint16_t len);
+    virtual boolean write(const void *data, uint16_t len);
+
+protected:
+    uint16_t _address;
+};
+#endif
+
+
+#ifndef ARDUINO
+/**
+ * Save and restore the network configuration to a file
+ *
+ * @note this is probably only useful for testing and development of EtherSia.
+ */
+class EtherSia_FileStore : public EtherSia_ConfigStore {
+public:
+    /**
+     * Constructor
+     * @param path the path of the file to store the configuration in
+     */
+    EtherSia_FileStore(const char *path);
+
+    virtual boolean read(void *data, uint16_t len);
+    virtual boolean write(const void *data, uint16_t len);
+
+protected:
+    const char *_path;
+};
+#endif
+
+#endif /* CONFIGSTORE_H */
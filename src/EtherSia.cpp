@@ -3,70 +3,161 @@
 #include "util.h"
 
 // https://developers.google.com/speed/public-dns/
-static const uint8_t googlePublicDnsAddress[16] PROGMEM = {
-    0x20, 0x01, 0x48, 0x60, 0x48, 0x60, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x88, 0x88
-};
+static constexpr IPv6Address googlePublicDnsAddress PROGMEM = "2001:4860:4860::8888"_ip6;
 
 EtherSia::EtherSia()
 {
     // Use Google Public DNS by default
-    memcpy_P(_dnsServerAddress, googlePublicDnsAddress, sizeof(googlePublicDnsAddress));
+    resetDnsServerAddress();
 
     // Use stateless auto-configuration by default
     _autoConfigurationEnabled = true;
+    _addressState = ADDRESS_STATE_TENTATIVE;
+    _addressCallback = NULL;
+    _configStore = NULL;
+    _destinationType = 0;
+    _addressGeneration = 0;
+    _mldReportPending = false;
+    _mldStateReport = false;
+    _pingRemaining = 0;
+    _pingWaiting = false;
+    _pingResolving = false;
+    _pingIdentifier = 0;
+    _lookupHostname = NULL;
+    _lookupFound = false;
+    memset(&_pingStatistics, 0, sizeof(_pingStatistics));
+
+    // Router, prefix and route lists start off empty
+    for (uint8_t i = 0; i < ETHERSIA_MAX_ROUTERS; i++) {
+        _routers[i].lifetime = 0;
+    }
+    for (uint8_t i = 0; i < ETHERSIA_MAX_PREFIXES; i++) {
+        _prefixes[i].validLifetime = 0;
+    }
+    for (uint8_t i = 0; i < ETHERSIA_MAX_ROUTES; i++) {
+        _routes[i].lifetime = 0;
+    }
+    for (uint8_t i = 0; i < ETHERSIA_MAX_RECEIVE_QUEUES; i++) {
+        _receiveQueues[i] = NULL;
+    }
+    for (uint8_t i = 0; i < ETHERSIA_PMTU_CACHE_SIZE; i++) {
+        _pmtuCache[i].lifetime = 0;
+    }
+#if ETHERSIA_REASSEMBLY_SLOTS > 0
+    for (uint8_t i = 0; i < ETHERSIA_REASSEMBLY_SLOTS; i++) {
+        _reassembly[i].received = 0;
+    }
+#endif
+    _fragmentId = 0;
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_TIMERS; i++) {
+        _timers[i].callback = NULL;
+    }
+    for (uint8_t i = 0; i < ETHERSIA_MAX_MULTICAST_GROUPS; i++) {
+        _multicastGroups[i].users = 0;
+        _multicastGroups[i].reports = 0;
+    }
+
+    // No ports are in use yet
+    memset(_portsInUse, 0, sizeof(_portsInUse));
+    memset(_recentPorts, 0, sizeof(_recentPorts));
+    _recentPortNext = 0;
+
+    setRateLimit(ICMP6_RATE_ERROR, ICMP6_ERROR_RATE_BURST, ICMP6_ERROR_RATE_INTERVAL);
+    setRateLimit(ICMP6_RATE_ECHO, ICMP6_ECHO_RATE_BURST, ICMP6_ECHO_RATE_INTERVAL);
+}
+
+void EtherSia::resetDnsServerAddress()
+{
+    memcpy_P(_dnsServerAddress, &googlePublicDnsAddress, sizeof(googlePublicDnsAddress));
+    _dnsServerLifetime = 0;
 }
 
 
 boolean EtherSia::begin()
 {
-    boolean success = true;
-
     // Calculate our link local address
     _linkLocalAddress.setLinkLocalPrefix();
     _linkLocalAddress.setEui64(_localMac);
+    _addressGeneration++;
 
-    // Delay a 'random' amount to stop multiple nodes acting at the same time
-    delay(_localMac[5] ^ 0x55);
+    // Start counting down router and prefix lifetimes from now
+    _lifetimeLastCheck = millis();
 
-    // Allow some extra time to let the Ethernet controller to get ready
-    delay(500);
+    // Use the configuration from last time, while it is revalidated in the background
+    restoreConfig();
 
-    // Send link local Neighbour Solicitation for Duplicate Address Detection
-    IPv6Address zero;
-    icmp6SendNS(_linkLocalAddress, zero);
+    // Make sure that different nodes pick different random delays
+    randomSeed(micros() ^ ((uint16_t)_localMac[4] << 8) ^ _localMac[5]);
+
+    // Start from a random Fragment Identification, so that it can't be predicted (RFC7739)
+    _fragmentId = random();
+
+    // Delay Duplicate Address Detection by a random amount,
+    // to stop multiple nodes acting at the same time
+    _addressState = ADDRESS_STATE_TENTATIVE;
+    _solicitationCount = 0;
+    _nextSolicitation = millis() + random(0, ROUTER_SOLICITATION_DELAY);
+    _mldReportPending = false;
+    _mldStateReport = false;
+
+    // Auto-configuration continues in the background, from receivePacket()
+    return true;
+}
 
-    // Perform stateless auto-configuration if enabled
-    if (_autoConfigurationEnabled) {
-        success = icmp6AutoConfigure();
+void EtherSia::setAddressState(uint8_t state)
+{
+    if (_addressState != state) {
+        _addressState = state;
+        if (state == ADDRESS_STATE_GLOBAL) {
+            saveConfig();
+        }
+        if (state == ADDRESS_STATE_LINK_LOCAL || state == ADDRESS_STATE_GLOBAL) {
+            // Let MLD snooping switches know about our Solicited-Node multicast groups
+            mldScheduleReport(MLD_UNSOLICITED_REPORT_INTERVAL, true);
+        }
+        if (_addressCallback) {
+            _addressCallback(state);
+        }
     }
+}
 
-    // Now there has been a little bit of randomness in network activity
-    randomSeed(micros());
+boolean EtherSia::waitForAddress()
+{
+    while (_addressState == ADDRESS_STATE_TENTATIVE ||
+            (_addressState == ADDRESS_STATE_LINK_LOCAL && _autoConfigurationEnabled)) {
+        receivePacket();
+    }
 
-    return success;
+    return _addressState == ADDRESS_STATE_GLOBAL;
 }
 
 uint8_t EtherSia::isOurAddress(const IPv6Address &address)
 {
-    if (address == _linkLocalAddress) {
-        return ADDRESS_TYPE_LINK_LOCAL;
+    // Only compare against the addresses that are the same kind as this one
+    if (address.isMulticast()) {
+        if (address.isLinkLocalAllNodes() ||
+                address.isSolicitedNodeMulticastAddress(_linkLocalAddress) ||
+                address.isSolicitedNodeMulticastAddress(_globalAddress) ||
+                isGroupMember(address)) {
+            return ADDRESS_TYPE_MULTICAST;
+        }
+    } else if (address.isLinkLocal()) {
+        if (address == _linkLocalAddress) {
+            return ADDRESS_TYPE_LINK_LOCAL;
+        }
     } else if (address == _globalAddress) {
         return ADDRESS_TYPE_GLOBAL;
-    } else if (address.isLinkLocalAllNodes() ||
-               address.isSolicitedNodeMulticastAddress(_linkLocalAddress) ||
-               address.isSolicitedNodeMulticastAddress(_globalAddress)) {
-        return ADDRESS_TYPE_MULTICAST;
-    } else {
-        return 0;
     }
+
+    return 0;
 }
 
 uint8_t EtherSia::inOurSubnet(const IPv6Address &address)
 {
     if (address.isLinkLocal()) {
         return ADDRESS_TYPE_LINK_LOCAL;
-    } else if (address.inSameSubnet(_globalAddress)) {
+    } else if (onLinkPrefixLength(address) >= 0) {
         return ADDRESS_TYPE_GLOBAL;
     } else {
         // Address is in a different subnet
@@ -109,15 +200,42 @@ boolean EtherSia::checkEthernetAddresses(IPv6Packet &packet) {
 
 uint16_t EtherSia::receivePacket()
 {
-    uint16_t len = readFrame(_buffer, sizeof(_buffer));
+    timerCheck();
+    icmp6CheckLifetimes();
+    icmp6AutoConfigure();
+    mldCheckReport();
+    pingCheck();
+    lookupCheck();
+
+    // Frames are limited to ETHERSIA_MAX_PACKET_SIZE, the rest of the buffer is for reassembly
+    uint16_t len = readFrame(_buffer, ETHERSIA_MAX_PACKET_SIZE);
 
     if (len) {
         IPv6Packet& packet = (IPv6Packet&)_ptr;
-        if (!packet.isValid() || !checkEthernetAddresses(packet)) {
+        if (len < ETHER_HEADER_LEN + IP6_HEADER_LEN || packet.length() > len ||
+                !packet.isValid() || !checkEthernetAddresses(packet)) {
+            _bufferContainsReceived = false;
+            return 0;
+        }
+
+        // Skip over any extension headers once, so that the upper-layer
+        // header is always straight after the IPv6 header
+        if (!packet.removeExtensionHeaders()) {
             _bufferContainsReceived = false;
             return 0;
         }
 
+        if (packet.protocol() == IP6_PROTO_FRAGMENT) {
+            // Wait until the whole packet has arrived, then check its checksum
+            if (!ip6Reassemble() || packet.calculateChecksum() != 0) {
+                _bufferContainsReceived = false;
+                return 0;
+            }
+            len = packet.length();
+        }
+
+        // Classify the destination once, rather than every time it is checked
+        _destinationType = isOurAddress(packet.destination());
         _bufferContainsReceived = true;
 
         if (packet.protocol() == IP6_PROTO_ICMP6) {
@@ -126,6 +244,25 @@ uint16_t EtherSia::receivePacket()
                 // Packet has already been handled, don't return it
                 return 0;
             }
+        } else if (packet.protocol() == IP6_PROTO_UDP && _destinationType) {
+            if (lookupProcessReply()) {
+                // The reply to startLookup() isn't for any socket
+                _bufferContainsReceived = false;
+                return 0;
+            }
+
+            boolean queued = false;
+            for (uint8_t i = 0; i < ETHERSIA_MAX_RECEIVE_QUEUES; i++) {
+                if (_receiveQueues[i] && _receiveQueues[i]->queuePacket()) {
+                    queued = true;
+                }
+            }
+
+            if (queued) {
+                // The socket will take the packet out of its queue when it is ready
+                _bufferContainsReceived = false;
+                return 0;
+            }
         }
     } else {
         // We didn't receive anything
@@ -136,6 +273,43 @@ uint16_t EtherSia::receivePacket()
     return len;
 }
 
+void EtherSia::markBufferReceived()
+{
+    IPv6Packet& packet = (IPv6Packet&)_ptr;
+
+    _destinationType = isOurAddress(packet.destination());
+    _bufferContainsReceived = true;
+}
+
+boolean EtherSia::addReceiveQueue(UDPSocket *socket)
+{
+    UDPSocket **entry = NULL;
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_RECEIVE_QUEUES; i++) {
+        if (_receiveQueues[i] == socket) {
+            return true;
+        } else if (entry == NULL && _receiveQueues[i] == NULL) {
+            entry = &_receiveQueues[i];
+        }
+    }
+
+    if (entry == NULL) {
+        return false;
+    }
+
+    *entry = socket;
+    return true;
+}
+
+void EtherSia::removeReceiveQueue(UDPSocket *socket)
+{
+    for (uint8_t i = 0; i < ETHERSIA_MAX_RECEIVE_QUEUES; i++) {
+        if (_receiveQueues[i] == socket) {
+            _receiveQueues[i] = NULL;
+        }
+    }
+}
+
 void EtherSia::rejectPacket()
 {
     IPv6Packet& packet = (IPv6Packet&)_ptr;
@@ -184,10 +358,17 @@ void EtherSia::prepareReply()
 {
     IPv6Packet& packet = (IPv6Packet&)_ptr;
     IPv6Address *replySourceAddress;
+    uint8_t destinationType;
+
+    if (_bufferContainsReceived) {
+        destinationType = _destinationType;
+    } else {
+        destinationType = isOurAddress(packet.destination());
+    }
 
     _bufferContainsReceived = false;
 
-    if (isOurAddress(packet.destination()) == ADDRESS_TYPE_GLOBAL) {
+    if (destinationType == ADDRESS_TYPE_GLOBAL) {
         replySourceAddress = &_globalAddress;
     } else {
         replySourceAddress = &_linkLocalAddress;
@@ -211,6 +392,18 @@ void EtherSia::send()
     sendFrame(_buffer, packet.length());
 }
 
+uint16_t EtherSia::tcpMaxSegmentSize(const IPv6Address &destination)
+{
+    uint16_t mss = pathMtu(destination) - IP6_HEADER_LEN - TCP_MINIMUM_HEADER_LEN;
+
+    // Don't offer to receive more than fits in the packet buffer
+    if (mss > TCP_WINDOW_SIZE) {
+        mss = TCP_WINDOW_SIZE;
+    }
+
+    return mss;
+}
+
 void EtherSia::tcpSendRSTReply()
 {
     IPv6Packet& packet = (IPv6Packet&)_ptr;
@@ -16,6 +16,7 @@
 #include "IPv6Packet.h"
 #include "Socket.h"
 #include "UDPSocket.h"
+#include "ConfigStore.h"
 
 /**
  * The maximum size (in bytes) of packet that can be received / sent
@@ -25,14 +26,23 @@
  *
  * The value is used to size the buffer that is used for both
  * sending and receiving packets, so it should be bigger than the
- * biggest packet you want to send or receive.
+ * biggest packet you want to send or receive. Packets that arrive
+ * in fragments can be bigger, see ETHERSIA_REASSEMBLY_SIZE.
  */
+#ifndef ETHERSIA_MAX_PACKET_SIZE
 #define ETHERSIA_MAX_PACKET_SIZE       600
+#endif
+
 
 
+/** Maximum random delay before sending the first Duplicate Address Detection and Router Solicitation packets */
+#define ROUTER_SOLICITATION_DELAY        (1000)
 
-/** How often to send Router Solicitation (RS) packets */
-#define ROUTER_SOLICITATION_TIMEOUT      (3000)
+/** How long to wait for a reply to the first Router Solicitation (RS) packet - this doubles after each attempt */
+#define ROUTER_SOLICITATION_TIMEOUT      (3000UL)
+
+/** The longest time to wait between Router Solicitation (RS) packets */
+#define ROUTER_SOLICITATION_MAX_TIMEOUT  (60000UL)
 
 /** How many times to send Router Solicitation (RS) packets */
 #define ROUTER_SOLICITATION_ATTEMPTS     (4)
@@ -43,6 +53,257 @@
 /** How many times to send Neighbour Solicitation (NS) packets */
 #define NEIGHBOUR_SOLICITATION_ATTEMPTS  (5)
 
+/** How long to wait for a reply to a Duplicate Address Detection (DAD) packet */
+#define DUPLICATE_ADDRESS_TIMEOUT        (1000)
+
+/** The maximum number of default routers to remember from Router Advertisements */
+#define ETHERSIA_MAX_ROUTERS             (2)
+
+/** The maximum number of on-link prefixes to remember from Router Advertisements */
+#define ETHERSIA_MAX_PREFIXES            (2)
+
+/** The maximum number of routes to more specific prefixes (static or from Route Information options) */
+#define ETHERSIA_MAX_ROUTES              (2)
+
+/** The number of destinations to remember a reduced Path MTU for */
+#define ETHERSIA_PMTU_CACHE_SIZE         (2)
+
+/** How long (in seconds) to remember a Path MTU learned from a Packet Too Big message */
+#define ETHERSIA_PMTU_TIMEOUT            (600)
+
+/**
+ * The number of packets that can be reassembled from fragments at the same time
+ *
+ * Each slot needs about 1.5KB of RAM, and the packet buffer is enlarged
+ * to hold a reassembled packet, so fragment reassembly is disabled by default on AVR.
+ */
+#ifndef ETHERSIA_REASSEMBLY_SLOTS
+#ifdef __AVR__
+#define ETHERSIA_REASSEMBLY_SLOTS        (0)
+#else
+#define ETHERSIA_REASSEMBLY_SLOTS        (1)
+#endif
+#endif
+
+/** How long (in milliseconds) to wait for all the fragments of a packet to arrive (RFC8200 4.5) */
+#define ETHERSIA_REASSEMBLY_TIMEOUT      (60000)
+
+/**
+ * The largest IPv6 payload that can be reassembled from fragments
+ *
+ * This doesn't depend on ETHERSIA_MAX_PACKET_SIZE, because fragmented packets are
+ * usually bigger than a single frame. The default is the 1500 byte packet
+ * (including the IPv6 header) that RFC8200 section 4.5 requires to be reassembled.
+ */
+#ifndef ETHERSIA_REASSEMBLY_SIZE
+#define ETHERSIA_REASSEMBLY_SIZE         (1500 - IP6_HEADER_LEN)
+#endif
+
+/** The size of the packet buffer: big enough for a received frame and for a reassembled packet */
+#if ETHERSIA_REASSEMBLY_SLOTS > 0 && ETHERSIA_MAX_PACKET_SIZE < ETHER_HEADER_LEN + IP6_HEADER_LEN + ETHERSIA_REASSEMBLY_SIZE
+#define ETHERSIA_BUFFER_SIZE             (ETHER_HEADER_LEN + IP6_HEADER_LEN + ETHERSIA_REASSEMBLY_SIZE)
+#else
+#define ETHERSIA_BUFFER_SIZE             ETHERSIA_MAX_PACKET_SIZE
+#endif
+
+/** The maximum number of UDP sockets that can have a receive queue, see UDPSocket::setReceiveQueue() */
+#define ETHERSIA_MAX_RECEIVE_QUEUES      (2)
+
+/** The first port number that allocatePort() gives out to sockets without a fixed local port */
+#ifndef ETHERSIA_EPHEMERAL_PORT_FIRST
+#define ETHERSIA_EPHEMERAL_PORT_FIRST    (20000)
+#endif
+
+/**
+ * The number of port numbers that allocatePort() chooses from
+ *
+ * One bit of RAM is used to track each port, so the range is smaller on AVR.
+ */
+#ifndef ETHERSIA_EPHEMERAL_PORT_COUNT
+#ifdef __AVR__
+#define ETHERSIA_EPHEMERAL_PORT_COUNT    (256)
+#else
+#define ETHERSIA_EPHEMERAL_PORT_COUNT    (10000)
+#endif
+#endif
+
+/** The number of recently released port numbers that allocatePort() avoids giving out again */
+#ifndef ETHERSIA_RECENT_PORTS
+#define ETHERSIA_RECENT_PORTS            (4)
+#endif
+
+/** The maximum number of multicast groups that can be joined using joinGroup() */
+#define ETHERSIA_MAX_MULTICAST_GROUPS    (4)
+
+/** Maximum random delay before sending an unsolicited MLD Report, after our addresses change */
+#define MLD_UNSOLICITED_REPORT_INTERVAL  (1000)
+
+/** The number of times a MLD State Change Report is sent, when joining or leaving a group (RFC3810 9.1) */
+#define MLD_ROBUSTNESS_VARIABLE          (2)
+
+/** Maximum number of ICMPv6 error messages that can be sent in a burst */
+#define ICMP6_ERROR_RATE_BURST           (10)
+
+/** How often (in milliseconds) another ICMPv6 error message is allowed */
+#define ICMP6_ERROR_RATE_INTERVAL        (100)
+
+/** Maximum number of ICMPv6 echo replies that can be sent in a burst */
+#define ICMP6_ECHO_RATE_BURST            (10)
+
+/** How often (in milliseconds) another ICMPv6 echo reply is allowed */
+#define ICMP6_ECHO_RATE_INTERVAL         (50)
+
+/** How often (in milliseconds) ping() sends an Echo Request - a request is lost if there is no reply before the next one */
+#define ETHERSIA_PING_INTERVAL           (1000)
+
+/** The maximum number of timers that can be set using setTimer() */
+#define ETHERSIA_MAX_TIMERS              (4)
+
+/** The longest time (in milliseconds) that nextDeadline() returns, even if there is nothing to do */
+#define ETHERSIA_POLL_MAX_SLEEP          (60000)
+
+/** A prefix or DNS server lifetime that never expires */
+#define ND_INFINITE_LIFETIME             (0xFFFFFFFFUL)
+
+
+/** The stages of address auto-configuration, as returned by EtherSia::addressState() */
+enum EtherSiaAddressState {
+    ADDRESS_STATE_TENTATIVE = 0,  /**< Duplicate Address Detection of the link-local address is in progress */
+    ADDRESS_STATE_LINK_LOCAL,     /**< The link-local address is ready, waiting for a Router Advertisement */
+    ADDRESS_STATE_GLOBAL,         /**< A global address is ready */
+    ADDRESS_STATE_NO_ROUTER,      /**< No Router Advertisement was received in reply to our Router Solicitations */
+    ADDRESS_STATE_DUPLICATE       /**< Another node is using our link-local address */
+};
+
+/** Classes of ICMPv6 message that are rate limited separately, see EtherSia::setRateLimit() */
+enum EtherSiaRateLimitClass {
+    ICMP6_RATE_ERROR = 0,   /**< Destination Unreachable and Parameter Problem messages */
+    ICMP6_RATE_ECHO,        /**< Echo Replies */
+    ICMP6_RATE_CLASSES      /**< The number of rate limit classes */
+};
+
+/**
+ * Structure for storing the state of a token bucket rate limiter
+ * @private
+ */
+struct icmp6_rate_limit {
+    uint8_t tokens;             ///< The number of messages that can be sent now
+    uint8_t burst;              ///< The maximum number of tokens
+    uint16_t interval;          ///< Milliseconds between new tokens (0 = unlimited)
+    unsigned long lastRefill;   ///< The time (in milliseconds) that tokens were last added
+    uint16_t suppressed;        ///< The number of messages that were not sent
+};
+
+/**
+ * Round-trip time statistics gathered by EtherSia::ping()
+ */
+struct ping_statistics {
+    uint8_t transmitted;        ///< The number of Echo Requests sent
+    uint8_t received;           ///< The number of matching Echo Replies received
+    uint8_t loss;               ///< The percentage of Echo Requests that were not answered
+    uint16_t minimum;           ///< The shortest round-trip time (in milliseconds)
+    uint16_t maximum;           ///< The longest round-trip time (in milliseconds)
+    uint16_t average;           ///< The mean round-trip time (in milliseconds)
+    uint16_t jitter;            ///< The mean difference between consecutive round-trip times (in milliseconds)
+};
+
+/**
+ * Structure for storing the Path MTU to a destination, learned from a Packet Too Big message
+ * @private
+ */
+struct pmtu_entry {
+    IPv6Address destination;    ///< The destination address
+    uint16_t mtu;               ///< The Path MTU to the destination
+    uint16_t lifetime;          ///< Seconds until the entry expires (0 = unused entry)
+};
+
+/**
+ * Structure for storing the fragments of a packet while it is being reassembled
+ * @private
+ */
+struct ip6_reassembly_slot {
+    IPv6Address source;         ///< The source address of the fragments
+    IPv6Address destination;    ///< The destination address of the fragments
+    uint32_t identification;    ///< The Identification field of the fragments (network byte order)
+    unsigned long expires;      ///< The time (in milliseconds) to give up waiting for the rest of the fragments
+    uint16_t received;          ///< The number of bytes received so far (0 = unused slot)
+    uint16_t totalLength;       ///< The length of the reassembled payload (0 = last fragment not received yet)
+    uint8_t protocol;           ///< The Next Header field of the first fragment
+    uint8_t blocks[(ETHERSIA_REASSEMBLY_SIZE + 63) / 64];  ///< Bitmap of the 8-byte blocks received so far
+    uint8_t data[ETHERSIA_REASSEMBLY_SIZE];  ///< The fragmentable part of the packet
+};
+
+/**
+ * Structure for storing a default router learned from a Router Advertisement
+ * @private
+ */
+struct nd_router_entry {
+    MACAddress mac;         ///< The Ethernet address of the router
+    int8_t preference;      ///< Default Router Preference (-1 = low, 0 = medium, 1 = high)
+    uint16_t lifetime;      ///< Seconds until the router expires (0 = unused entry)
+};
+
+/** Prefix flag: addresses in the prefix are on the local link */
+#define ND_PREFIX_FLAG_ON_LINK           (0x80)
+
+/** Prefix flag: the prefix can be used for stateless address auto-configuration */
+#define ND_PREFIX_FLAG_AUTONOMOUS        (0x40)
+
+/**
+ * Structure for storing a prefix learned from a Router Advertisement
+ * @private
+ */
+struct nd_prefix_entry {
+    IPv6Address prefix;         ///< The prefix, with the bits after the prefix length cleared
+    uint8_t length;             ///< The length of the prefix in bits
+    uint8_t flags;              ///< ND_PREFIX_FLAG_ON_LINK and ND_PREFIX_FLAG_AUTONOMOUS
+    uint32_t validLifetime;     ///< Seconds until the prefix becomes invalid (0 = unused entry)
+    uint32_t preferredLifetime; ///< Seconds until addresses in the prefix are deprecated
+};
+
+/**
+ * Structure for storing a route to a prefix via a router on the local link
+ *
+ * The route table is kept sorted with the longest prefix first,
+ * so the first matching entry is always the longest match.
+ * @private
+ */
+struct nd_route_entry {
+    IPv6Address prefix;         ///< The destination prefix, with the bits after the prefix length cleared
+    uint8_t length;             ///< The length of the prefix in bits
+    int8_t preference;          ///< Route Preference (-1 = low, 0 = medium, 1 = high)
+    MACAddress mac;             ///< The Ethernet address of the next-hop router
+    uint32_t lifetime;          ///< Seconds until the route expires (0 = unused entry)
+};
+
+
+/**
+ * A function that is called by EtherSia::poll() when a timer expires
+ *
+ * @param context The pointer that was passed to EtherSia::setTimer()
+ */
+typedef void (*EtherSiaTimerCallback)(void *context);
+
+/**
+ * Structure for storing a timer set using EtherSia::setTimer()
+ * @private
+ */
+struct ethersia_timer {
+    EtherSiaTimerCallback callback;  ///< The function to call (NULL = unused entry)
+    void *context;                   ///< The pointer to pass to the function
+    unsigned long deadline;          ///< The time (in milliseconds) when the timer expires
+};
+
+/**
+ * Structure for storing a multicast group joined using EtherSia::joinGroup()
+ * @private
+ */
+struct ethersia_multicast_group {
+    IPv6Address address;             ///< The multicast address of the group (:: = unused entry)
+    uint8_t users;                   ///< The number of joins not yet matched by a leave (0 while a leave is still being reported)
+    uint8_t reports;                 ///< The number of State Change Reports still to send for the group
+};
+
 
 /**
  * Main class for sending and receiving IPv6 messages using the ENC28J60 Ethernet controller
@@ -59,15 +320,72 @@ public:
     /**
      * Configure the Ethernet interface and get things ready
      *
-     * If auto-configuration has not been disabled, then
-     * stateless auto-configuration will start - attempting to
-     * get an IP address and Router address using IGMPv6.
+     * This returns straight away, with the link-local address ready to use.
+     * Duplicate Address Detection, and stateless auto-configuration (if it
+     * has not been disabled) then carry on in the background, each time
+     * receivePacket() is called. Use addressState(), onAddressChange() or
+     * waitForAddress() to find out when a global address has been configured.
      *
      * @return Returns true if setting up the Ethernet interface was successful
      */
     /*virtual*/ boolean begin();
     // FIXME: virtual is disabled because it seems to trigger Arduino/issues/3972
 
+    /**
+     * Set where to save and restore the network configuration
+     *
+     * If set before begin() is called, the global address, router and
+     * DNS server saved last time are restored straight away, so packets can
+     * be sent without waiting for auto-configuration. The restored router
+     * and prefix expire after ETHERSIA_RESTORED_LIFETIME seconds, unless a
+     * Router Advertisement confirms them.
+     *
+     * The configuration is saved automatically when a global address
+     * is ready, or can be saved using saveConfig().
+     *
+     * @param store The place to save the configuration, or NULL to disable saving
+     */
+    inline void setConfigStore(EtherSia_ConfigStore *store) {
+        _configStore = store;
+    }
+
+    /**
+     * Save the current network configuration to the configuration store
+     *
+     * @return true if the configuration was saved successfully
+     */
+    boolean saveConfig();
+
+    /**
+     * Get the current stage of address auto-configuration
+     *
+     * @return one of the EtherSiaAddressState values
+     */
+    inline uint8_t addressState() {
+        return _addressState;
+    }
+
+    /**
+     * Set a function to be called when the stage of address auto-configuration changes
+     *
+     * The function is passed the new EtherSiaAddressState.
+     *
+     * @param callback The function to call, or NULL to remove it
+     */
+    inline void onAddressChange(void (*callback)(uint8_t state)) {
+        _addressCallback = callback;
+    }
+
+    /**
+     * Wait for address auto-configuration to finish
+     *
+     * Packets received while waiting are processed, but otherwise discarded.
+     * This can be useful in setup(), if a global address is needed straight away.
+     *
+     * @return true if a global address has been configured
+     */
+    boolean waitForAddress();
+
     /**
      * Disable stateless auto-configuration (SLAAC)
      *
@@ -101,6 +419,7 @@ public:
      */
     inline void setGlobalAddress(IPv6Address &address) {
         _globalAddress = address;
+        _addressGeneration++;
     }
 
     /**
@@ -114,6 +433,7 @@ public:
      */
     inline void setGlobalAddress(const char* address) {
         _globalAddress.fromString(address);
+        _addressGeneration++;
     }
 
     /**
@@ -128,6 +448,17 @@ public:
         return _globalAddress;
     }
 
+    /**
+     * Get a number that changes every time one of our addresses changes
+     *
+     * This allows values that are calculated from our addresses to be cached.
+     *
+     * @return the address generation number
+     */
+    inline uint8_t addressGeneration() {
+        return _addressGeneration;
+    }
+
     /**
      * Get the link-local address of the Ethernet Interface
      * This is generated automatically from the MAC address.
@@ -145,7 +476,9 @@ public:
      * packets that need to be sent outside of the subnet.
      *
      * Typically this is set during the stateless auto-configuration process
-     * when you call begin().
+     * when you call begin(). If more than one router is advertising, the one
+     * with the highest preference is used. If the router's lifetime expires,
+     * a backup router is used instead, or the router MAC address is zeroed.
      *
      * @return The MAC address of the router
      */
@@ -188,6 +521,119 @@ public:
      */
     boolean setRouter(IPv6Address &address);
 
+    /**
+     * Start listening to an IPv6 multicast group
+     *
+     * A MLDv2 Report is sent, so that switches with MLD snooping
+     * forward traffic for the group to us.
+     * Joining a group again counts another user of it, so the group is
+     * only left once leaveGroup() has been called for every join.
+     *
+     * @param group The multicast address of the group to join
+     * @return true if the group was joined, false if the address isn't multicast or the group table is full
+     */
+    boolean joinGroup(const IPv6Address &group);
+
+    /**
+     * Start listening to an IPv6 multicast group
+     *
+     * @param group The multicast address of the group to join, as a C string
+     * @return true if the group was joined, false if the address isn't multicast or the group table is full
+     */
+    boolean joinGroup(const char *group);
+
+    /**
+     * Stop listening to an IPv6 multicast group, that was joined using joinGroup()
+     *
+     * Nothing is reported until the last user of the group leaves it.
+     * The link-local all-nodes group (ff02::1) is never left.
+     *
+     * @param group The multicast address of the group to leave
+     * @return true if the group was left, false if we weren't a member of the group
+     */
+    boolean leaveGroup(const IPv6Address &group);
+
+    /**
+     * Stop listening to an IPv6 multicast group, that was joined using joinGroup()
+     *
+     * @param group The multicast address of the group to leave, as a C string
+     * @return true if the group was left, false if we weren't a member of the group
+     */
+    boolean leaveGroup(const char *group);
+
+    /**
+     * Check if we are listening to a multicast group
+     *
+     * @param group The multicast address to check
+     * @return true if we are a member of the group
+     */
+    boolean isGroupMember(const IPv6Address &group);
+
+    /**
+     * Start sending ICMPv6 Echo Requests to a host, to measure the round-trip time
+     *
+     * This method doesn't wait for the replies: an Echo Request is sent every
+     * ETHERSIA_PING_INTERVAL milliseconds from receivePacket(), and the
+     * statistics are updated as the Echo Replies arrive.
+     * Starting a new ping clears the statistics of the previous one.
+     *
+     * If the host is on our subnet, Neighbour Solicitations are sent first, also from
+     * receivePacket(). If the host doesn't answer them, the ping finishes without
+     * sending any Echo Requests and the loss is 100%.
+     *
+     * @param address The IPv6 address of the host to ping
+     * @param count The number of Echo Requests to send
+     * @param size The number of bytes of data to send in each Echo Request
+     * @return true if the first Echo Request will be sent
+     */
+    boolean ping(const IPv6Address &address, uint8_t count=4, uint16_t size=32);
+
+    /**
+     * Start sending ICMPv6 Echo Requests to a host, to measure the round-trip time
+     *
+     * @param address The IPv6 address of the host to ping (as a string)
+     * @param count The number of Echo Requests to send
+     * @param size The number of bytes of data to send in each Echo Request
+     * @return true if the first Echo Request will be sent
+     */
+    boolean ping(const char *address, uint8_t count=4, uint16_t size=32);
+
+    /**
+     * Check if ping() is still sending Echo Requests or waiting for a reply
+     *
+     * @return true if the ping has not finished yet
+     */
+    boolean pingInProgress();
+
+    /**
+     * Get the round-trip time statistics of the current or last ping()
+     *
+     * @return A reference to the statistics
+     */
+    inline const struct ping_statistics& pingStatistics()
+    {
+        return _pingStatistics;
+    }
+
+    /**
+     * Get the largest IPv6 packet that can be sent to a destination
+     *
+     * This is the smaller of the space in the packet buffer and any
+     * Path MTU learned from an ICMPv6 Packet Too Big message (RFC8201).
+     *
+     * @param destination The IPv6 address of the destination
+     * @return The Path MTU in bytes (including the IPv6 header)
+     */
+    uint16_t pathMtu(const IPv6Address &destination);
+
+    /**
+     * Get the TCP Maximum Segment Size to use with a destination
+     *
+     * @param destination The IPv6 address of the destination
+     * @return The MSS in bytes
+     */
+    uint16_t tcpMaxSegmentSize(const IPv6Address &destination);
+
     /**
      * Check to see if an IPv6 address belongs to this Ethernet interface
      *
@@ -199,12 +645,58 @@ public:
     /**
      * Check if an address is in the same subnet as us
      *
+     * Global addresses are on-link if they match one of the on-link prefixes
+     * from a Router Advertisement, whatever its length. If no prefixes are known
+     * (for example the global address was set manually), a /64 subnet is assumed.
+     *
      * @param address the IPv6Addrss to check
      * @return the type of address IPv6AddressType or 0 if it is not in the same subnet
-     * @note assumes that the subnet mask is /64
      */
     uint8_t inOurSubnet(const IPv6Address &address);
 
+    /**
+     * Work out the Ethernet address of the next hop towards a destination
+     *
+     * The longest matching prefix is used: destinations on the local link are
+     * resolved using Neighbour Discovery, destinations matching a route are sent
+     * to that route's router, and anything else is sent to the default router.
+     *
+     * @param destination the IPv6 address to send to
+     * @return A pointer to the MAC address, or NULL if Neighbour Discovery failed
+     */
+    MACAddress* nextHop(IPv6Address &destination);
+
+    /**
+     * Add a static route to a prefix via a router on the local link
+     *
+     * Neighbour discovery is used to resolve the router to a MAC address.
+     *
+     * @param prefix The destination prefix, as a C string
+     * @param prefixLength The length of the prefix in bits
+     * @param router The IPv6 address of the router, as C string
+     * @return true if the route was added, false if the router could not be found or the route table is full
+     */
+    boolean addRoute(const char *prefix, uint8_t prefixLength, const char *router);
+
+    /**
+     * Add a static route to a prefix via a router on the local link
+     *
+     * @param prefix The destination prefix
+     * @param prefixLength The length of the prefix in bits
+     * @param routerMac The MAC address of the router
+     * @return true if the route was added, false if the route table is full
+     */
+    boolean addRoute(const IPv6Address &prefix, uint8_t prefixLength, const MACAddress &routerMac);
+
+    /**
+     * Remove all routes to a prefix
+     *
+     * @param prefix The destination prefix
+     * @param prefixLength The length of the prefix in bits
+     * @return true if a route was removed
+     */
+    boolean removeRoute(const IPv6Address &prefix, uint8_t prefixLength);
+
     /**
      * Set the IPv6 address DNS server to use for hostname lookups
      *
@@ -212,6 +704,7 @@ public:
      */
     inline void setDnsServerAddress(IPv6Address &address) {
         _dnsServerAddress = address;
+        _dnsServerLifetime = 0;
     }
 
     /**
@@ -231,6 +724,53 @@ public:
      */
     uint16_t receivePacket();
 
+    /**
+     * Do everything that is due, without blocking, and receive at most one packet
+     *
+     * This calls the functions of expired timers, sends any auto-configuration,
+     * MLD, ping and DNS packets that are due and then checks for a received packet.
+     * Use nextDeadline() to find out how long it is safe to sleep for
+     * (or wait for a packet to arrive) before calling poll() again.
+     *
+     * @note receivePacket() does the same thing, this name is just clearer in an event loop
+     * @return The length of the packet, or 0 if no packet was received
+     */
+    inline uint16_t poll() {
+        return receivePacket();
+    }
+
+    /**
+     * Get the time until poll() next has something to do, apart from receiving packets
+     *
+     * This takes into account timers set using setTimer(), address auto-configuration,
+     * MLD Reports, ping(), startLookup() and the expiry of routers, prefixes and routes.
+     *
+     * @return The time in milliseconds (0 if something is already due), at most ETHERSIA_POLL_MAX_SLEEP
+     */
+    unsigned long nextDeadline();
+
+    /**
+     * Call a function from poll() after a delay
+     *
+     * The timer only fires once. If a timer with the same function and context
+     * has already been set, its deadline is changed instead. A timer function may
+     * call setTimer() again, to run periodically.
+     *
+     * @param callback The function to call
+     * @param context A pointer to pass to the function (for example the object that set the timer)
+     * @param delay The time to wait (in milliseconds)
+     * @return true if successful, false if ETHERSIA_MAX_TIMERS timers are already set
+     */
+    boolean setTimer(EtherSiaTimerCallback callback, void *context, unsigned long delay);
+
+    /**
+     * Stop a timer set using setTimer() from firing
+     *
+     * @param callback The function that was passed to setTimer()
+     * @param context The pointer that was passed to setTimer()
+     */
+    void cancelTimer(EtherSiaTimerCallback callback, void *context);
+
     /**
      * Check the received packet, and reply with a rejection packet.
      *
@@ -258,6 +798,68 @@ public:
         return _bufferContainsReceived;
     }
 
+    /**
+     * Get the type of our address that the received packet in the buffer was sent to
+     *
+     * This is worked out once by receivePacket(), so it is quicker than
+     * calling isOurAddress() on the packet's destination address.
+     *
+     * @note Only valid while bufferContainsReceived() returns true
+     * @return the type of address IPv6AddressType or 0 if it is not our address
+     */
+    inline uint8_t packetDestinationType() {
+        return _destinationType;
+    }
+
+    /**
+     * Mark the packet buffer as holding a received packet
+     *
+     * @note This is used by UDPSocket::havePacket(), after copying a packet out of a receive queue
+     */
+    void markBufferReceived();
+
+    /**
+     * Start copying received packets into a socket's receive queue
+     *
+     * @note This is used by UDPSocket::setReceiveQueue(), you don't need to call it
+     * @param socket The socket with the queue
+     * @return true if successful, false if ETHERSIA_MAX_RECEIVE_QUEUES sockets already have queues
+     */
+    boolean addReceiveQueue(UDPSocket *socket);
+
+    /**
+     * Stop copying received packets into a socket's receive queue
+     *
+     * @param socket The socket with the queue
+     */
+    void removeReceiveQueue(UDPSocket *socket);
+
+    /**
+     * Allocate an unused local port number for a socket
+     *
+     * A random port is chosen from the range starting at ETHERSIA_EPHEMERAL_PORT_FIRST,
+     * skipping ports that are in use and the last ETHERSIA_RECENT_PORTS released ports (RFC6056).
+     *
+     * @note This is used by Socket::setRemoteAddress() and TCPClient::connect(), you don't need to call it
+     * @return the port number, or 0 if every port is in use
+     */
+    uint16_t allocatePort();
+
+    /**
+     * Mark a fixed local port number as in use, so that allocatePort() won't give it out
+     *
+     * @param port The port number (ports outside of the ephemeral range are ignored)
+     * @return false if the port was already in use
+     */
+    boolean reservePort(uint16_t port);
+
+    /**
+     * Release a port number that was returned by allocatePort() or reservePort()
+     *
+     * @param port The port number (ports outside of the ephemeral range are ignored)
+     */
+    void releasePort(uint16_t port);
+
     /**
      * Get a reference to the packet buffer (the last packet sent or received).
      *
@@ -278,6 +880,27 @@ public:
      */
     void send();
 
+    /**
+     * Send an upper-layer packet that is too big for the Path MTU, as a series of fragments
+     *
+     * The IPv6 header in the packet buffer should already have been
+     * prepared using prepareSend() or prepareReply().
+     * The payload is made up of the upper-layer header followed by the data,
+     * and each fragment is sent with a Fragment header (RFC8200 4.5).
+     *
+     * The data may be in the packet buffer, for example to send back the payload
+     * of a received packet, as long as there is room after it for the Fragment
+     * header and the upper-layer header. Otherwise false is returned.
+     *
+     * @param protocol The protocol number of the upper-layer header
+     * @param header A pointer to the upper-layer header (including the checksum)
+     * @param headerLen The length of the upper-layer header
+     * @param data A pointer to the data that follows the upper-layer header
+     * @param dataLen The length of the data
+     * @return true if the fragments were sent
+     */
+    boolean sendFragments(uint8_t protocol, const uint8_t *header, uint16_t headerLen, const uint8_t *data, uint16_t dataLen);
+
     /**
      * Get the packet buffer ready to send a packet
      *
@@ -310,7 +933,8 @@ public:
      * while this method is running.
      *
      * It is recommended that this method is called within setup(),
-     * to avoid packets being lost within loop().
+     * to avoid packets being lost within loop(). Use startLookup()
+     * to look up a hostname without blocking.
      *
      * @note You probably don't need to call this function directly.
      * @param hostname The hostname to look up
@@ -318,6 +942,34 @@ public:
      */
     IPv6Address* lookupHostname(const char* hostname);
 
+    /**
+     * Start looking up a hostname using DNS, without waiting for the reply
+     *
+     * The DNS requests (and a Neighbour Solicitation, if the DNS server is on-link)
+     * are sent and retried by receivePacket(), which also picks up the reply.
+     * Starting a new lookup stops the one that is in progress.
+     *
+     * @param hostname The hostname to look up (must stay valid until the lookup has finished)
+     * @return true if the lookup was started, false if there is no free local port
+     */
+    boolean startLookup(const char* hostname);
+
+    /**
+     * Check if startLookup() is still waiting for a DNS reply
+     *
+     * @return true if the lookup has not finished yet
+     */
+    inline boolean lookupInProgress() {
+        return _lookupHostname != NULL;
+    }
+
+    /**
+     * Get the result of the last startLookup()
+     *
+     * @return A pointer to the IPv6 address, or NULL if the lookup failed or hasn't finished
+     */
+    IPv6Address* lookupResult();
+
     /**
      * Perform Neighbour Discovery for an IPv6 address on the local subnet
      *
@@ -352,6 +1004,28 @@ public:
      */
     void tcpSendRSTReply();
 
+    /**
+     * Configure the token bucket rate limiting of a class of ICMPv6 messages (RFC4443 2.4)
+     *
+     * Up to burst messages can be sent straight away, after which
+     * one message is allowed every interval milliseconds.
+     *
+     * @param messageClass The class of message (ICMP6_RATE_ERROR or ICMP6_RATE_ECHO)
+     * @param burst The maximum number of messages that can be sent in a burst (0 to send none)
+     * @param interval The time between messages in milliseconds (0 for no rate limit)
+     */
+    void setRateLimit(uint8_t messageClass, uint8_t burst, uint16_t interval);
+
+    /**
+     * Get the number of ICMPv6 messages that were not sent because of rate limiting
+     *
+     * @param messageClass The class of message (ICMP6_RATE_ERROR or ICMP6_RATE_ECHO)
+     * @return The number of suppressed messages (stops counting at 65535)
+     */
+    inline uint16_t suppressedCount(uint8_t messageClass) {
+        return _rateLimit[messageClass].suppressed;
+    }
+
     /**
      * Send an Ethernet frame
      * @param data a pointer to the data to send
@@ -360,6 +1034,14 @@ public:
      */
     virtual uint16_t sendFrame(const uint8_t *data, uint16_t datalen) = 0;
 
+    /**
+     * Make sure that any frames queued by sendFrame() are sent now
+     *
+     * Drivers that queue up frames and send them in batches should override this.
+     * The default does nothing, as sendFrame() has already sent the frame.
+     */
+    virtual void flush() {}
+
     /**
      * Read an Ethernet frame
      * @param buffer a pointer to a buffer to write the packet to
@@ -377,18 +1059,182 @@ protected:
     /** The MAC address of this Ethernet controller */
     MACAddress _localMac;
 
+    /** Incremented every time the link-local or global address changes */
+    uint8_t _addressGeneration;
+
     /** The MAC Address of the router to send packets outside of this subnet */
     MACAddress _routerMac;
 
+    /** Default routers learned from Router Advertisements */
+    struct nd_router_entry _routers[ETHERSIA_MAX_ROUTERS];
+
+    /** On-link prefixes learned from Router Advertisements */
+    struct nd_prefix_entry _prefixes[ETHERSIA_MAX_PREFIXES];
+
+    /** Routes to more specific prefixes, longest prefix first */
+    struct nd_route_entry _routes[ETHERSIA_MAX_ROUTES];
+
+    /** UDP sockets that received packets are queued for */
+    UDPSocket *_receiveQueues[ETHERSIA_MAX_RECEIVE_QUEUES];
+
+    /** Seconds until the DNS server learned from a Router Advertisement expires (0 = doesn't expire) */
+    uint32_t _dnsServerLifetime;
+
+    /** The time (in milliseconds) when the router, prefix and DNS lifetimes were last updated */
+    unsigned long _lifetimeLastCheck;
+
+    /** Path MTUs learned from Packet Too Big messages */
+    struct pmtu_entry _pmtuCache[ETHERSIA_PMTU_CACHE_SIZE];
+
+#if ETHERSIA_REASSEMBLY_SLOTS > 0
+    /** Packets being reassembled from fragments */
+    struct ip6_reassembly_slot _reassembly[ETHERSIA_REASSEMBLY_SLOTS];
+#endif
+
+    /** One bit for each port in the ephemeral range that is in use */
+    uint8_t _portsInUse[(ETHERSIA_EPHEMERAL_PORT_COUNT + 7) / 8];
+
+    /** Recently released ports, that allocatePort() avoids (0 = unused entry) */
+    uint16_t _recentPorts[ETHERSIA_RECENT_PORTS];
+
+    /** The position in _recentPorts to store the next released port */
+    uint8_t _recentPortNext;
+
+    /** Timers set using setTimer() */
+    struct ethersia_timer _timers[ETHERSIA_MAX_TIMERS];
+
+    /** The Identification field of the last fragmented packet that we sent (random start) */
+    uint32_t _fragmentId;
+
+    /** Multicast groups joined using joinGroup() */
+    struct ethersia_multicast_group _multicastGroups[ETHERSIA_MAX_MULTICAST_GROUPS];
+
+    /** The time (in milliseconds) to send the next MLD Report */
+    unsigned long _mldReportTime;
+
+    /** Set to true when a MLD Report is waiting to be sent */
+    boolean _mldReportPending;
+
+    /** Set to true when the waiting MLD Report includes the current state of all our groups */
+    boolean _mldStateReport;
+
+    /** The host that ping() is sending Echo Requests to */
+    IPv6Address _pingAddress;
+
+    /** The Ethernet address to send Echo Requests to */
+    MACAddress _pingMac;
+
+    /** Statistics for the current or last ping() */
+    struct ping_statistics _pingStatistics;
+
+    /** The sum of the round-trip times received, used to calculate the average */
+    uint32_t _pingTotalTime;
+
+    /** The sum of the differences between consecutive round-trip times, used to calculate the jitter */
+    uint32_t _pingTotalJitter;
+
+    /** The round-trip time of the last Echo Reply */
+    uint16_t _pingLastTime;
+
+    /** The time (in milliseconds) that the last Echo Request was sent */
+    unsigned long _pingSentTime;
+
+    /** The Identifier field of our Echo Requests */
+    uint16_t _pingIdentifier;
+
+    /** The Sequence Number of the last Echo Request sent */
+    uint16_t _pingSequence;
+
+    /** The number of bytes of data in each Echo Request */
+    uint16_t _pingSize;
+
+    /** The number of Echo Requests still to be sent */
+    uint8_t _pingRemaining;
+
+    /** Set to true when waiting for an Echo Reply to the last Echo Request */
+    boolean _pingWaiting;
+
+    /** Set to true while Neighbour Discovery for the host being pinged is in progress */
+    boolean _pingResolving;
+
+    /** The number of Neighbour Solicitations sent for the host being pinged */
+    uint8_t _pingSolicitations;
+
+    /** The hostname that startLookup() is looking up (NULL = no lookup in progress) */
+    const char *_lookupHostname;
+
+    /** The address found by the last startLookup() */
+    IPv6Address _lookupAddress;
+
+    /** The MAC address to send DNS requests to */
+    MACAddress _lookupMac;
+
+    /** The time (in milliseconds) that the last DNS request or Neighbour Solicitation was sent */
+    unsigned long _lookupSentTime;
+
+    /** The ID of the DNS request, to match the reply */
+    uint16_t _lookupId;
+
+    /** The local UDP port number that the DNS request is sent from */
+    uint16_t _lookupPort;
+
+    /** The number of DNS requests sent */
+    uint8_t _lookupRequests;
+
+    /** The number of Neighbour Solicitations sent for the DNS server */
+    uint8_t _lookupSolicitations;
+
+    /** Set to true while Neighbour Discovery for the DNS server is in progress */
+    boolean _lookupResolving;
+
+    /** Set to true if the last startLookup() found an address */
+    boolean _lookupFound;
+
+    /** The current stage of address auto-configuration (EtherSiaAddressState) */
+    uint8_t _addressState;
+
+    /** The number of DAD or RS packets sent in the current stage */
+    uint8_t _solicitationCount;
+
+    /** The time (in milliseconds) when the next DAD or RS packet should be sent */
+    unsigned long _nextSolicitation;
+
+    /** Function to call when _addressState changes */
+    void (*_addressCallback)(uint8_t state);
+
+    /** Where to save and restore the network configuration */
+    EtherSia_ConfigStore *_configStore;
+
+    /** Token buckets for rate limiting ICMPv6 messages that we generate */
+    struct icmp6_rate_limit _rateLimit[ICMP6_RATE_CLASSES];
+
+    /**
+     * Take a token from a rate limiter's bucket
+     *
+     * @param messageClass The class of message (ICMP6_RATE_ERROR or ICMP6_RATE_ECHO)
+     * @return true if the message can be sent, false if it should be suppressed
+     */
+    boolean icmp6RateLimit(uint8_t messageClass);
+
+    /**
+     * Restore the network configuration from the configuration store
+     *
+     * @return true if a valid configuration was restored
+     */
+    boolean restoreConfig();
+
     /** The buffer that sent and received packets are stored in */
     union {
-        uint8_t _buffer[ETHERSIA_MAX_PACKET_SIZE];
+        uint8_t _buffer[ETHERSIA_BUFFER_SIZE];
         void* _ptr;
     };
 
     /** Flag indicating if the buffer contains a valid packet we received */
     boolean _bufferContainsReceived;
 
+    /** The result of isOurAddress() for the destination of the received packet in the buffer */
+    uint8_t _destinationType;
+
     /** Flag indicating if the buffer contains a valid packet we received */
     boolean _autoConfigurationEnabled;
 
@@ -406,11 +1252,126 @@ protected:
     boolean icmp6ProcessPacket();
 
     /**
-     * Perform Stateless auto-configuration
+     * Perform the next step of Duplicate Address Detection and
+     * Stateless auto-configuration, if it is due
      *
-     * @return true if successful, false if failure
+     * This is called every time receivePacket() is called.
      */
-    boolean icmp6AutoConfigure();
+    void icmp6AutoConfigure();
+
+    /**
+     * Check if icmp6AutoConfigure() has anything left to do
+     *
+     * @return true if it will do something when _nextSolicitation is reached
+     */
+    boolean icmp6AutoConfigurePending();
+
+    /**
+     * Change the stage of address auto-configuration and call the callback function
+     *
+     * @param state The new EtherSiaAddressState
+     */
+    void setAddressState(uint8_t state);
+
+    /**
+     * Process a received ICMPv6 Packet Too Big message in the packet buffer
+     *
+     * Reduces the Path MTU to the destination of the packet that was too big
+     */
+    void icmp6ProcessPacketTooBig();
+
+    /**
+     * Add a received fragment in the packet buffer to a reassembly slot
+     *
+     * When the last missing fragment arrives, the reassembled packet is
+     * copied back into the packet buffer, without the Fragment header.
+     *
+     * @return true if the packet buffer now contains a complete packet
+     */
+    boolean ip6Reassemble();
+
+    /**
+     * Process a received MLD message in the packet buffer
+     *
+     * Schedules a MLDv2 Report in reply to a Multicast Listener Query
+     */
+    void mldProcessPacket();
+
+    /**
+     * Send the next DNS request for startLookup(), or give up, if one is due
+     */
+    void lookupCheck();
+
+    /**
+     * Process a received UDP packet, in case it is the reply to startLookup()
+     *
+     * @return true if the packet was the DNS reply
+     */
+    boolean lookupProcessReply();
+
+    /**
+     * Process a received Neighbour Advertisement
+     *
+     * Sends the first DNS request, if it is the answer for the DNS server
+     */
+    void lookupProcessNA();
+
+    /**
+     * Stop the lookup in progress and release its local port
+     *
+     * @param address The address that was found, or NULL if the lookup failed
+     */
+    void lookupFinish(const IPv6Address *address);
+
+    /**
+     * Send the next ping() Echo Request, if one is due
+     *
+     * This is called every time receivePacket() is called.
+     */
+    void pingCheck();
+
+    /**
+     * Process a received ICMPv6 Echo Reply in the packet buffer
+     *
+     * Updates the ping() statistics, if it is a reply to our last Echo Request
+     *
+     * @return true if the packet was a reply to our last Echo Request
+     */
+    boolean pingProcessReply();
+
+    /**
+     * Process a received ICMPv6 Neighbour Advertisement in the packet buffer
+     *
+     * Starts sending Echo Requests, if it is the answer for the host being pinged
+     */
+    void pingProcessNA();
+
+    /**
+     * Send a MLDv2 Report, if one is scheduled and it is due
+     *
+     * This is called every time receivePacket() is called.
+     * State Change Reports are retransmitted from here, until each
+     * change has been sent MLD_ROBUSTNESS_VARIABLE times.
+     */
+    void mldCheckReport();
+
+    /**
+     * Schedule sending the next MLDv2 Report
+     *
+     * @param maxDelay The maximum random delay (in milliseconds) before sending it
+     * @param stateReport true if the Report should include the current state of all our groups
+     */
+    void mldScheduleReport(unsigned long maxDelay, boolean stateReport);
+
+    /**
+     * Send a MLDv2 Report to all MLDv2 capable routers
+     *
+     * A State Change Report contains every group with changes still to be
+     * reported, and schedules the next retransmission if any remain.
+     *
+     * @param stateChange true to report joined and left groups, false to report the current state of all our groups
+     */
+    void mldSendReport(boolean stateChange);
 
     /**
      * Send a ICMPv6 Neighbour Solicitation (NS) for specified IPv6 Address
@@ -420,6 +1381,18 @@ protected:
      */
     void icmp6SendNS(IPv6Address &targetAddress, IPv6Address &sourceAddress);
 
+    /**
+     * Send the next Neighbour Solicitation for a host that is being resolved without blocking, if one is due
+     *
+     * The Neighbour Advertisement is picked out of the received packets by the caller.
+     *
+     * @param targetAddress The IPv6 address to be resolved
+     * @param sentTime The time that the last solicitation was sent, updated when another is sent
+     * @param solicitations The number of solicitations sent so far, updated when another is sent
+     * @return false if the host didn't answer NEIGHBOUR_SOLICITATION_ATTEMPTS solicitations
+     */
+    boolean icmp6SolicitNeighbour(IPv6Address &targetAddress, unsigned long &sentTime, uint8_t &solicitations);
+
     /**
      * Send a ICMPv6 Neighbour Solicitation (NS) for specified IPv6 Address
      *
@@ -463,6 +1436,94 @@ protected:
      */
     void icmp6ProcessPrefix(struct icmp6_prefix_information *pi);
 
+    /**
+     * Handle a single Route Information option from a Router Advertisement (RA) packet (RFC4191)
+     *
+     * @param option Pointer to the start of the option
+     * @param routerMac The Ethernet address of the router that sent the option
+     */
+    void icmp6ProcessRoute(const uint8_t *option, const MACAddress &routerMac);
+
+    /**
+     * Find the length of the longest on-link prefix that matches an address
+     *
+     * @param address The global address to look up
+     * @return The prefix length, or -1 if the address isn't on-link
+     */
+    int16_t onLinkPrefixLength(const IPv6Address &address);
+
+    /**
+     * Find the router to send to, for a destination that isn't on the local link
+     *
+     * @param destination The IPv6 address to send to
+     * @return A pointer to the router's MAC address, or NULL if the destination is on-link
+     */
+    MACAddress* nextHopRouter(const IPv6Address &destination);
+
+    /**
+     * Add, update or remove an entry in the route table, keeping it sorted by prefix length
+     *
+     * @param prefix The destination prefix
+     * @param prefixLength The length of the prefix in bits
+     * @param mac The Ethernet address of the next-hop router
+     * @param lifetime The route lifetime in seconds (0 to remove the route)
+     * @param preference The Route Preference (-1, 0 or 1)
+     * @return true if the route table was updated
+     */
+    boolean routeUpdate(const IPv6Address &prefix, uint8_t prefixLength, const MACAddress &mac, uint32_t lifetime, int8_t preference);
+
+    /**
+     * Remove an entry from the route table, moving the shorter prefixes up
+     *
+     * @param index The position of the entry in the route table
+     */
+    void routeRemove(uint8_t index);
+
+    /**
+     * Add, update or remove an entry in the default router list
+     *
+     * @param mac The Ethernet address of the router
+     * @param lifetime The router lifetime in seconds (0 to remove the router)
+     * @param preference The Default Router Preference (-1, 0 or 1)
+     */
+    void icmp6UpdateRouter(MACAddress &mac, uint16_t lifetime, int8_t preference);
+
+    /**
+     * Choose the default router with the highest preference from the router list
+     */
+    void icmp6SelectRouter();
+
+    /**
+     * Choose a global address from the prefix list, if we don't have one
+     */
+    void icmp6SelectGlobalAddress();
+
+    /**
+     * Count down the router, prefix and DNS server lifetimes, and remove expired entries
+     *
+     * This is called every time receivePacket() is called, but only does any work once a second.
+     */
+    void icmp6CheckLifetimes();
+
+    /**
+     * Get the time until icmp6CheckLifetimes() next has a router, prefix, route, Path MTU or DNS server to expire
+     *
+     * @return The time in seconds, or ND_INFINITE_LIFETIME if nothing expires
+     */
+    uint32_t icmp6NextExpiry();
+
+    /**
+     * Call the functions of any timers set using setTimer() that have expired
+     *
+     * This is called every time receivePacket() is called.
+     */
+    void timerCheck();
+
+    /**
+     * Set the DNS server address back to the default (Google Public DNS)
+     */
+    void resetDnsServerAddress();
+
     /**
      * Send an ICMPv6 packet stored in the EtherSia packet buffer
      * Ensures the protocol and checksum are set before sending.
@@ -483,6 +1544,11 @@ protected:
 #ifndef ARDUINO
 #include "dummy.h"
 #include "LinuxSocket.h"
+#include "Tap.h"
+#endif
+
+#if !defined(ARDUINO) && defined(__linux__)
+#include "XDP.h"
 #endif
 
 
@@ -7,25 +7,34 @@
 #define ICMPV6_PACKET_H
 
 #define ICMP6_TYPE_UNREACHABLE    1
+#define ICMP6_TYPE_PACKET_TOO_BIG 2
 #define ICMP6_TYPE_PARAM_PROB     4
 #define ICMP6_TYPE_ECHO           128
 #define ICMP6_TYPE_ECHO_REPLY     129
+#define ICMP6_TYPE_MLD_QUERY      130
+#define ICMP6_TYPE_MLD_REPORT     131
+#define ICMP6_TYPE_MLD_DONE       132
 #define ICMP6_TYPE_RS             133
 #define ICMP6_TYPE_RA             134
 #define ICMP6_TYPE_NS             135
 #define ICMP6_TYPE_NA             136
 #define ICMP6_TYPE_NA             136
+#define ICMP6_TYPE_MLD2_REPORT    143
 
 #define ICMP6_CODE_PORT_UNREACHABLE  4
 #define ICMP6_CODE_UNRECOGNIZED_NH   1
 
 #define ICMP6_NA_FLAG_S           (1 << 6)
 
+/* Minimum valid lifetime an RA can reduce a prefix to (RFC4862 5.5.3) */
+#define ND_TWO_HOURS              (2UL * 60 * 60)
+
 #define ICMP6_OPTION_SOURCE_LINK_ADDRESS 1
 #define ICMP6_OPTION_TARGET_LINK_ADDRESS 2
 #define ICMP6_OPTION_PREFIX_INFORMATION  3
 #define ICMP6_OPTION_REDIRECTED_HEADER   4
 #define ICMP6_OPTION_MTU                 5
+#define ICMP6_OPTION_ROUTE_INFORMATION   24
 #define ICMP6_OPTION_RECURSIVE_DNS       25
 
 
@@ -53,6 +62,22 @@ struct icmp6_error_header {
 static_assert(sizeof(struct icmp6_error_header) == ICMP6_ERROR_HEADER_LEN, "Size is not correct");
 
 
+/**
+ * Structure for accessing the fields of a ICMP6 Echo Request or Echo Reply packet
+ * @private
+ */
+struct icmp6_echo_header {
+    uint16_t identifier;
+    uint16_t sequence;
+    // Echo data follows
+} __attribute__((__packed__));
+#define ICMP6_ECHO_HEADER_LEN     (4)
+#define ICMP6_ECHO_HEADER_OFFSET  (ICMP6_HEADER_OFFSET + ICMP6_HEADER_LEN)
+
+/* Verify that compiler gets the structure size correct */
+static_assert(sizeof(struct icmp6_echo_header) == ICMP6_ECHO_HEADER_LEN, "Size is not correct");
+
+
 /**
  * Structure for accessing the fields of a ICMP6 Router Solicitation packet
  * @private
@@ -137,6 +162,87 @@ static_assert(sizeof(struct icmp6_na_header) == ICMP6_NA_HEADER_LEN, "Size is no
 
 
 
+/* MLDv2 Multicast Address Record Types (RFC3810 5.2.12) */
+#define MLD2_MODE_IS_EXCLUDE      2
+#define MLD2_CHANGE_TO_INCLUDE    3
+#define MLD2_CHANGE_TO_EXCLUDE    4
+
+/**
+ * Structure for accessing the fields of a Hop-by-Hop Options header containing
+ * a Router Alert option, which MLD messages are sent with (RFC2711)
+ * @private
+ */
+struct ip6_router_alert_header {
+    uint8_t next_header;
+    uint8_t length;
+
+    uint8_t option_type;
+    uint8_t option_len;
+    uint16_t value;
+
+    uint8_t padding[2];
+} __attribute__((__packed__));
+#define IP6_ROUTER_ALERT_HEADER_LEN   (8)
+
+/* Verify that compiler gets the structure size correct */
+static_assert(sizeof(struct ip6_router_alert_header) == IP6_ROUTER_ALERT_HEADER_LEN, "Size is not correct");
+
+
+/**
+ * Structure for accessing the fields of a MLDv2 Multicast Listener Query
+ * @private
+ */
+struct mld2_query_header {
+    uint16_t max_response_code;
+    uint16_t reserved;
+    IPv6Address group;
+
+    uint8_t flags;
+    uint8_t qqic;
+    uint16_t source_count;
+} __attribute__((__packed__));
+#define MLD2_QUERY_HEADER_LEN     (24)
+#define MLD2_QUERY_HEADER_OFFSET  (ICMP6_HEADER_OFFSET + ICMP6_HEADER_LEN)
+
+/* Verify that compiler gets the structure size correct */
+static_assert(sizeof(struct mld2_query_header) == MLD2_QUERY_HEADER_LEN, "Size is not correct");
+
+
+/**
+ * Structure for accessing the fields of a MLDv2 Multicast Listener Report
+ * @private
+ */
+struct mld2_report_header {
+    uint8_t type;
+    uint8_t code;
+    uint16_t checksum;
+
+    uint16_t reserved;
+    uint16_t record_count;
+    // Multicast Address Records follow
+} __attribute__((__packed__));
+#define MLD2_REPORT_HEADER_LEN    (8)
+
+/* Verify that compiler gets the structure size correct */
+static_assert(sizeof(struct mld2_report_header) == MLD2_REPORT_HEADER_LEN, "Size is not correct");
+
+
+/**
+ * Structure for accessing the fields of a MLDv2 Multicast Address Record
+ * @private
+ */
+struct mld2_address_record {
+    uint8_t type;
+    uint8_t aux_len;
+    uint16_t source_count;
+    IPv6Address group;
+} __attribute__((__packed__));
+#define MLD2_ADDRESS_RECORD_LEN   (20)
+
+/* Verify that compiler gets the structure size correct */
+static_assert(sizeof(struct mld2_address_record) == MLD2_ADDRESS_RECORD_LEN, "Size is not correct");
+
+
 /**
  * Class for accessing the fields of a ICMP6 packet
  * @private
@@ -150,10 +256,12 @@ public:
 
     union {
         struct icmp6_error_header err;
+        struct icmp6_echo_header echo;
         struct icmp6_ra_header ra;
         struct icmp6_rs_header rs;
         struct icmp6_na_header na;
         struct icmp6_ns_header ns;
+        struct mld2_query_header mld;
     } __attribute__((__packed__));
 
 } __attribute__((__packed__));
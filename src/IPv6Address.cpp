@@ -44,10 +44,36 @@ boolean IPv6Address::isZero() const
     return 1;
 }
 
-boolean IPv6Address::inSameSubnet(const IPv6Address& address) const
+boolean IPv6Address::inSameSubnet(const IPv6Address& address, uint8_t prefixLength) const
 {
-    // Check if the first 64 bits match
-    return memcmp(_address, address._address, 8) == 0;
+    uint8_t bytes = prefixLength / 8;
+    uint8_t bits = prefixLength % 8;
+
+    if (prefixLength >= 128) {
+        return *this == address;
+    }
+
+    // Compare the whole bytes, then the bits left over
+    if (memcmp(_address, address._address, bytes) != 0) {
+        return false;
+    }
+
+    return bits == 0 || ((_address[bytes] ^ address._address[bytes]) & (0xFF << (8 - bits))) == 0;
+}
+
+void IPv6Address::maskPrefix(uint8_t prefixLength)
+{
+    if (prefixLength >= 128) {
+        return;
+    }
+
+    uint8_t bytes = prefixLength / 8;
+    uint8_t bits = prefixLength % 8;
+
+    if (bits) {
+        _address[bytes++] &= (0xFF << (8 - bits));
+    }
+    memset(&_address[bytes], 0, 16 - bytes);
 }
 
 void IPv6Address::setEui64(const MACAddress &macAddress)
@@ -70,11 +96,24 @@ void IPv6Address::setLinkLocalAllNodes()
     _address[15] = 0x01;
 }
 
+boolean IPv6Address::isLinkLocalMulticast(uint8_t group) const
+{
+    // Check the last byte first, as it is the most likely to be different
+    if (_address[15] != group || _address[0] != 0xFF || _address[1] != 0x02) {
+        return false;
+    }
+
+    for (uint8_t i = 2; i < 15; i++) {
+        if (_address[i] != 0x00)
+            return false;
+    }
+
+    return true;
+}
+
 boolean IPv6Address::isLinkLocalAllNodes() const
 {
-    IPv6Address expected;
-    expected.setLinkLocalAllNodes();
-    return *this == expected;
+    return isLinkLocalMulticast(0x01);
 }
 
 void IPv6Address::setLinkLocalAllRouters()
@@ -87,9 +126,15 @@ void IPv6Address::setLinkLocalAllRouters()
 
 boolean IPv6Address::isLinkLocalAllRouters() const
 {
-    IPv6Address expected;
-    expected.setLinkLocalAllRouters();
-    return *this == expected;
+    return isLinkLocalMulticast(0x02);
+}
+
+void IPv6Address::setLinkLocalAllMLDv2Routers()
+{
+    setZero();
+    _address[0] = 0xFF;
+    _address[1] = 0x02;
+    _address[15] = 0x16;
 }
 
 // See RFC4291 section 2.7.1.
@@ -108,9 +153,24 @@ void IPv6Address::setSolicitedNodeMulticastAddress(const IPv6Address &address)
 // See RFC4291 section 2.7.1.
 boolean IPv6Address::isSolicitedNodeMulticastAddress(const IPv6Address &address) const
 {
-    IPv6Address expected;
-    expected.setSolicitedNodeMulticastAddress(address);
-    return *this == expected;
+    // Check the low-order 24 bits first, as they are the most likely to be different
+    if (_address[15] != address._address[15] ||
+            _address[14] != address._address[14] ||
+            _address[13] != address._address[13]) {
+        return false;
+    }
+
+    if (_address[0] != 0xFF || _address[1] != 0x02 ||
+            _address[11] != 0x01 || _address[12] != 0xFF) {
+        return false;
+    }
+
+    for (uint8_t i = 2; i < 11; i++) {
+        if (_address[i] != 0x00)
+            return false;
+    }
+
+    return true;
 }
 
 IPv6Address::operator uint8_t*()
@@ -194,13 +254,53 @@ uint8_t IPv6Address::type()
     }
 }
 
-void IPv6Address::print(Print &p) const
+// See RFC5952 section 4
+uint8_t IPv6Address::toString(char *buf) const
 {
-    for (byte i = 0; i < 16; ++i) {
-        printPaddedHex(_address[i], p);
-        if (i % 2 == 1 && i < 15)
-            p.print(':');
+    int8_t zeroStart = -1;
+    int8_t zeroLen = 1;
+    int8_t runStart = -1;
+    char *pos = buf;
+
+    // Find the longest run of two or more zero words (the first, if there is a tie)
+    for (int8_t i = 0; i < 8; i++) {
+        if (_address[i * 2] == 0 && _address[i * 2 + 1] == 0) {
+            if (runStart < 0) {
+                runStart = i;
+            }
+            if (i - runStart + 1 > zeroLen) {
+                zeroStart = runStart;
+                zeroLen = i - runStart + 1;
+            }
+        } else {
+            runStart = -1;
+        }
     }
+
+    for (int8_t i = 0; i < 8; i++) {
+        if (i == zeroStart) {
+            // Replace the run of zeros with a double colon
+            *pos++ = ':';
+            *pos++ = ':';
+            i += zeroLen - 1;
+            continue;
+        }
+
+        if (i > 0 && i != zeroStart + zeroLen) {
+            *pos++ = ':';
+        }
+        pos = writeHex16(pos, ((uint16_t)_address[i * 2] << 8) | _address[i * 2 + 1]);
+    }
+
+    *pos = '\0';
+    return pos - buf;
+}
+
+void IPv6Address::print(Print &p) const
+{
+    char buf[MAX_IPV6_ADDRESS_STR_LEN + 1];
+    uint8_t len = toString(buf);
+    p.write((const uint8_t *)buf, len);
 }
 
 void IPv6Address::println(Print &p) const
@@ -208,3 +308,8 @@ void IPv6Address::println(Print &p) const
     this->print(p);
     p.println();
 }
+
+uint8_t invalidIPv6AddressLiteral()
+{
+    return 0;
+}
@@ -13,6 +13,18 @@
 #define MAX_IPV6_ADDRESS_STR_LEN  39
 
 
+/**
+ * Called when an _ip6 literal is not a valid IPv6 address
+ *
+ * This function isn't constexpr, so using it while evaluating a
+ * constant expression causes a compile error.
+ *
+ * @return 0
+ * @private
+ */
+uint8_t invalidIPv6AddressLiteral();
+
+
 /** A enumeration of IPv6 address types */
 enum IPv6AddressType {
     ADDRESS_TYPE_LINK_LOCAL = 1,  /**< Link-local address type */
@@ -28,6 +40,14 @@ class IPv6Address {
 private:
     uint8_t _address[16];
 
+    /**
+     * Check if the address is a link-local scope multicast address of the form FF02::n
+     *
+     * @param group The value of the last byte of the address
+     * @return true if the address matches
+     */
+    boolean isLinkLocalMulticast(uint8_t group) const;
+
 public:
     /**
      * Constructor for a new / all-zero IPv6 address (::)
@@ -40,6 +60,15 @@ public:
      */
     IPv6Address(const uint8_t *address);
 
+    /**
+     * Constructor from 16 octets, most significant first
+     */
+    constexpr IPv6Address(uint8_t a0, uint8_t a1, uint8_t a2, uint8_t a3,
+                          uint8_t a4, uint8_t a5, uint8_t a6, uint8_t a7,
+                          uint8_t a8, uint8_t a9, uint8_t a10, uint8_t a11,
+                          uint8_t a12, uint8_t a13, uint8_t a14, uint8_t a15)
+        : _address{a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15} {}
+
     /**
      * Constructor from a human readable IPv6 address string
      * @param addrstr the address to parse
@@ -110,6 +139,11 @@ public:
      */
     boolean isLinkLocalAllRouters() const;
 
+    /**
+     * Set address to multicast address for all MLDv2 capable routers (FF02::16)
+     */
+    void setLinkLocalAllMLDv2Routers();
+
     /**
      * Set the last 64-bits of the IPv6 address to a EUI-64 based on a 48-bit MAC Address
      * Note this only sets the last 64-bits of the address.
@@ -161,11 +195,30 @@ public:
     /**
      * Returns true if two addresses are in the same subnet
      *
-     * @note assumes that local subnet is /64 (which is an assumption elsewhere too)
-     * @param address the address to
-     * @return true if the addresses are in the same subnet
+     * @param address the address to compare with
+     * @param prefixLength the length of the subnet prefix in bits (defaults to /64)
+     * @return true if the first prefixLength bits of the addresses match
      */
-    boolean inSameSubnet(const IPv6Address& address) const;
+    boolean inSameSubnet(const IPv6Address& address, uint8_t prefixLength=64) const;
+
+    /**
+     * Clear all the bits of the address after the prefix
+     *
+     * For example 2001:db8:1234::1 with a prefix length of 32 becomes 2001:db8::
+     *
+     * @param prefixLength the number of bits to keep
+     */
+    void maskPrefix(uint8_t prefixLength);
+
+    /**
+     * Convert the address to a human readable string, compressed as described in RFC5952
+     *
+     * For example 2001:db8::1
+     *
+     * @param buf The buffer to write to (at least MAX_IPV6_ADDRESS_STR_LEN + 1 bytes)
+     * @return The length of the string, not including the null terminator
+     */
+    uint8_t toString(char *buf) const;
 
     /**
      * Print a IPv6 address to a stream as a human readable string.
@@ -179,9 +232,147 @@ public:
      */
     void println(Print &print=Serial) const;
 
+    /*
+     * The functions below parse an IPv6 address string at compile time, for
+     * the _ip6 literal. C++11 constexpr functions can only contain a single
+     * return statement, so they loop using recursion.
+     */
+
+    /**
+     * Find the position of a double colon (::) in an address string
+     * @return the position, or len if there isn't one
+     * @private
+     */
+    static constexpr size_t literalFindDoubleColon(const char *str, size_t len, size_t pos)
+    {
+        return (pos + 1 >= len) ? len :
+               (str[pos] == ':' && str[pos + 1] == ':') ? pos :
+               literalFindDoubleColon(str, len, pos + 1);
+    }
+
+    /**
+     * Count the number of colons between pos and end
+     * @private
+     */
+    static constexpr uint8_t literalCountColons(const char *str, size_t pos, size_t end)
+    {
+        return (pos >= end) ? 0 : (str[pos] == ':') + literalCountColons(str, pos + 1, end);
+    }
+
+    /**
+     * Count the number of colon separated groups between pos and end
+     * @private
+     */
+    static constexpr uint8_t literalCountGroups(const char *str, size_t pos, size_t end)
+    {
+        return (pos >= end) ? 0 : 1 + literalCountColons(str, pos, end);
+    }
+
+    /**
+     * Check that every group between pos and end contains 1 to 4 hex digits
+     * @private
+     */
+    static constexpr boolean literalGroupsValid(const char *str, size_t pos, size_t end, uint8_t digits)
+    {
+        return (pos >= end) ? (digits >= 1 && digits <= 4) :
+               (str[pos] == ':') ? (digits >= 1 && digits <= 4 && literalGroupsValid(str, pos + 1, end, 0)) :
+               (literalHexDigit(str[pos]) >= 0 && digits < 4 && literalGroupsValid(str, pos + 1, end, digits + 1));
+    }
+
+    /**
+     * Check that an IPv6 address string is valid
+     * @private
+     */
+    static constexpr boolean literalValid(const char *str, size_t len, size_t doubleColon)
+    {
+        return (doubleColon == len) ?
+               (literalCountGroups(str, 0, len) == 8 && literalGroupsValid(str, 0, len, 0)) :
+               (literalFindDoubleColon(str, len, doubleColon + 1) == len &&
+                literalCountGroups(str, 0, doubleColon) + literalCountGroups(str, doubleColon + 2, len) <= 7 &&
+                (doubleColon == 0 || literalGroupsValid(str, 0, doubleColon, 0)) &&
+                (doubleColon + 2 == len || literalGroupsValid(str, doubleColon + 2, len, 0)));
+    }
+
+    /**
+     * Find the position of the n-th group after pos
+     * @private
+     */
+    static constexpr size_t literalGroupStart(const char *str, size_t pos, uint8_t n)
+    {
+        return (n == 0) ? pos : literalGroupStart(str, pos + 1, str[pos] == ':' ? n - 1 : n);
+    }
+
+    /**
+     * Get the value of the group that starts at pos
+     * @private
+     */
+    static constexpr uint16_t literalGroupValue(const char *str, size_t pos, size_t end, uint16_t value)
+    {
+        return (pos >= end || str[pos] == ':') ? value :
+               literalGroupValue(str, pos + 1, end, (value << 4) | literalHexDigit(str[pos]));
+    }
+
+    /**
+     * Get one of the eight 16-bit words of an address string
+     * @private
+     */
+    static constexpr uint16_t literalWord(const char *str, size_t len, size_t doubleColon, uint8_t word)
+    {
+        return (doubleColon == len) ?
+               literalGroupValue(str, literalGroupStart(str, 0, word), len, 0) :
+               (word < literalCountGroups(str, 0, doubleColon)) ?
+               literalGroupValue(str, literalGroupStart(str, 0, word), doubleColon, 0) :
+               (word >= 8 - literalCountGroups(str, doubleColon + 2, len)) ?
+               literalGroupValue(str, literalGroupStart(str, doubleColon + 2, word - (8 - literalCountGroups(str, doubleColon + 2, len))), len, 0) :
+               0;
+    }
+
+    /**
+     * Get one octet of an address string, at compile time
+     *
+     * @param str The IPv6 address string
+     * @param len The length of the string
+     * @param index The octet number (0 to 15)
+     * @return The value of the octet
+     * @private
+     */
+    static constexpr uint8_t literalOctet(const char *str, size_t len, uint8_t index)
+    {
+        return literalValid(str, len, literalFindDoubleColon(str, len, 0)) ?
+               (literalWord(str, len, literalFindDoubleColon(str, len, 0), index / 2) >> ((index % 2) ? 0 : 8)) & 0xFF :
+               invalidIPv6AddressLiteral();
+    }
+
 } __attribute__((__packed__));
 
 /* Verify that compiler gets the structure size correct */
 static_assert(sizeof(IPv6Address) == 16, "Size is not correct");
 
+/**
+ * User-defined literal for an IPv6 address, for example "2001:db8::1"_ip6
+ *
+ * The address is only parsed at compile time, and an invalid address
+ * only causes a compile error, when the literal is used in a constant
+ * expression - for example to initialise a constexpr variable.
+ * Otherwise it may be parsed at run time, and an invalid address
+ * silently gives an address of all zeros.
+ *
+ * @param str The IPv6 address string
+ * @param len The length of the string
+ * @return An IPv6Address object
+ */
+constexpr IPv6Address operator"" _ip6(const char *str, size_t len)
+{
+    return IPv6Address(
+               IPv6Address::literalOctet(str, len, 0), IPv6Address::literalOctet(str, len, 1),
+               IPv6Address::literalOctet(str, len, 2), IPv6Address::literalOctet(str, len, 3),
+               IPv6Address::literalOctet(str, len, 4), IPv6Address::literalOctet(str, len, 5),
+               IPv6Address::literalOctet(str, len, 6), IPv6Address::literalOctet(str, len, 7),
+               IPv6Address::literalOctet(str, len, 8), IPv6Address::literalOctet(str, len, 9),
+               IPv6Address::literalOctet(str, len, 10), IPv6Address::literalOctet(str, len, 11),
+               IPv6Address::literalOctet(str, len, 12), IPv6Address::literalOctet(str, len, 13),
+               IPv6Address::literalOctet(str, len, 14), IPv6Address::literalOctet(str, len, 15)
+           );
+}
+
 #endif
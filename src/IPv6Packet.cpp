@@ -35,6 +35,12 @@ boolean IPv6Packet::isValid()
         return false;
     }
 
+    // Fragments are checked after reassembly
+    uint8_t protocol;
+    if (extensionHeadersLength(protocol) >= 0 && protocol == IP6_PROTO_FRAGMENT) {
+        return true;
+    }
+
     // Verify the packet checksum (it should add up to 0)
     if (calculateChecksum() != 0) {
         return false;
@@ -135,18 +141,132 @@ void IPv6Packet::setDestination(IPv6Address& address)
 
 
 // This function is derived from Contiki's uip6.c / upper_layer_chksum()
+// Check that all the options in a Hop-by-Hop or Destination Options header
+// can be skipped over (RFC8200 4.2)
+static boolean checkOptions(const uint8_t *options, uint16_t len)
+{
+    uint16_t pos = 0;
+
+    while (pos < len) {
+        if (options[pos] == IP6_OPTION_PAD1) {
+            pos++;
+            continue;
+        }
+
+        if (pos + 2 > len || pos + 2 + options[pos + 1] > len) {
+            // Option is longer than the header
+            return false;
+        }
+
+        if (options[pos] & 0xC0) {
+            // The highest two bits say that the packet must be discarded
+            // if the option isn't recognised
+            return false;
+        }
+
+        pos += 2 + options[pos + 1];
+    }
+
+    return true;
+}
+
+int16_t IPv6Packet::extensionHeadersLength(uint8_t &protocol)
+{
+    uint8_t *header = payload();
+    uint16_t len = payloadLength();
+    uint16_t offset = 0;
+
+    protocol = this->protocol();
+    while (protocol == IP6_PROTO_HOP_BY_HOP ||
+            protocol == IP6_PROTO_ROUTING ||
+            protocol == IP6_PROTO_DEST_OPTS) {
+
+        if (offset + 8 > len) {
+            return -1;
+        }
+
+        uint16_t headerLen = (header[1] + 1) * 8;
+        if (offset + headerLen > len) {
+            return -1;
+        }
+
+        if (protocol == IP6_PROTO_HOP_BY_HOP) {
+            // Hop-by-Hop Options must directly follow the IPv6 header
+            if (offset != 0 || !checkOptions(header + 2, headerLen - 2)) {
+                return -1;
+            }
+        } else if (protocol == IP6_PROTO_DEST_OPTS) {
+            if (!checkOptions(header + 2, headerLen - 2)) {
+                return -1;
+            }
+        } else if (header[3] != 0) {
+            // Segments Left isn't zero, so we aren't the final destination
+            return -1;
+        }
+
+        protocol = header[0];
+        header += headerLen;
+        offset += headerLen;
+    }
+
+    return offset;
+}
+
+boolean IPv6Packet::removeExtensionHeaders()
+{
+    uint8_t proto;
+    int16_t headersLen = extensionHeadersLength(proto);
+
+    if (headersLen < 0) {
+        return false;
+    } else if (headersLen > 0) {
+        uint16_t len = payloadLength() - headersLen;
+        memmove(payload(), payload() + headersLen, len);
+        setPayloadLength(len);
+        setProtocol(proto);
+    }
+
+    return true;
+}
+
 uint16_t IPv6Packet::calculateChecksum()
 {
+    return calculateChecksum(addressChecksum());
+}
+
+uint16_t IPv6Packet::addressChecksum()
+{
+    /* Sum IP source and destination addresses. */
+    uint16_t sum = chksum(0, (uint8_t *)(source()), 16);
+    return chksum(sum, (uint8_t *)(destination()), 16);
+}
+
+uint16_t IPv6Packet::calculateChecksum(uint16_t addressSum)
+{
+    uint8_t proto;
+    int16_t headersLen = extensionHeadersLength(proto);
+
+    /* The checksum doesn't cover the extension headers */
+    if (headersLen < 0) {
+        headersLen = 0;
+        proto = protocol();
+    }
+
+    uint8_t *data = payload() + headersLen;
+    uint16_t len = payloadLength() - headersLen;
+
     /* First sum pseudoheader. */
     /* IP protocol and length fields. This addition cannot carry. */
-    volatile uint16_t newsum = payloadLength() + protocol();
+    uint16_t t = len + proto;
 
-    /* Sum IP source and destination addresses. */
-    newsum = chksum(newsum, (uint8_t *)(source()), 16);
-    newsum = chksum(newsum, (uint8_t *)(destination()), 16);
+    /* Add the sum of the IP source and destination addresses. */
+    volatile uint16_t newsum = addressSum + t;
+    if (newsum < t) {
+        newsum++;      /* carry */
+    }
 
     /* Sum the payload header and data */
-    newsum = chksum(newsum, payload(), payloadLength());
+    newsum = chksum(newsum, data, len);
 
     return ~newsum;
 }
@@ -18,11 +18,25 @@ enum ether_types {
 /** Default value for the IPv6 hop limit field */
 #define IP6_DEFAULT_HOP_LIMIT     (64)
 
+/** Default value for the hop limit field of multicast packets, which keeps them on the local link (RFC3493 5.2) */
+#define IP6_MULTICAST_HOP_LIMIT   (1)
+
+/** The smallest MTU that every IPv6 link must support (RFC8200 5) */
+#define IP6_MIN_MTU               (1280)
+
+/** Option type of a single byte of padding, in Hop-by-Hop and Destination Options headers */
+#define IP6_OPTION_PAD1           (0)
+
 /** Enumeration of IP protocol numbers */
 enum ip_protocol {
+    IP6_PROTO_HOP_BY_HOP = 0,   ///< IP protocol number for a Hop-by-Hop Options header
     IP6_PROTO_TCP = 6,      ///< IP protocol number for TCP
     IP6_PROTO_UDP = 17,     ///< IP protocol number for UDP
-    IP6_PROTO_ICMP6 = 58    ///< IP protocol number for ICMP6
+    IP6_PROTO_ROUTING = 43,     ///< IP protocol number for a Routing header
+    IP6_PROTO_FRAGMENT = 44,    ///< IP protocol number for a Fragment header
+    IP6_PROTO_ICMP6 = 58,   ///< IP protocol number for ICMP6
+    IP6_PROTO_NONE = 59,        ///< IP protocol number for No Next Header
+    IP6_PROTO_DEST_OPTS = 60    ///< IP protocol number for a Destination Options header
 };
 
 
@@ -58,7 +72,8 @@ public:
 
     /**
      * Check if the Ethernet and IPv6 headers are valid
-     * Also verifies the checksum of the packet
+     * Also verifies the checksum of the packet, unless it is a fragment
+     * (which can only be verified once it has been reassembled)
      *
      * @return true if the packets fields are valid
      */
@@ -189,12 +204,55 @@ public:
      */
     void setDestination(IPv6Address& address);
 
+    /**
+     * Walk through any extension headers, to find the upper-layer protocol
+     *
+     * Hop-by-Hop Options, Routing and Destination Options headers are skipped.
+     * The walk stops at any other header, including a Fragment header.
+     *
+     * @param protocol Set to the protocol number of the upper-layer header
+     * @return the total length of the extension headers (0 if there are none),
+     *         or -1 if they are malformed or must not be skipped (RFC8200 4)
+     */
+    int16_t extensionHeadersLength(uint8_t &protocol);
+
+    /**
+     * Remove any extension headers, so that the upper-layer header
+     * directly follows the IPv6 header
+     *
+     * The payload length and protocol fields are updated to match.
+     *
+     * @return false if the extension headers are malformed or must not be skipped
+     */
+    boolean removeExtensionHeaders();
+
     /**
      * Calculate the 16-bit checksum for the IPv6 packet
+     *
+     * Any extension headers are not included in the checksum.
+     *
      * @return the checksum of the packet
      */
     uint16_t calculateChecksum();
 
+    /**
+     * Calculate the 16-bit checksum for the IPv6 packet, using a partial checksum of the addresses
+     *
+     * This allows the sum of the source and destination addresses to be cached,
+     * when sending several packets between the same two addresses.
+     *
+     * @param addressSum the result of addressChecksum() for this packet
+     * @return the checksum of the packet
+     */
+    uint16_t calculateChecksum(uint16_t addressSum);
+
+    /**
+     * Calculate the partial 16-bit checksum of the source and destination addresses
+     *
+     * @return the partial checksum (not inverted), for passing to calculateChecksum()
+     */
+    uint16_t addressChecksum();
+
 protected:
 
     // Ethernet Header
@@ -224,4 +282,28 @@ protected:
 static_assert(sizeof(IPv6Packet) == ETHER_HEADER_LEN + IP6_HEADER_LEN, "Size is not correct");
 
 
+/**
+ * Structure for accessing the fields of an IPv6 Fragment header (RFC8200 4.5)
+ * @private
+ */
+struct ip6_fragment_header {
+    uint8_t next_header;        ///< Protocol of the first header of the fragmentable part
+    uint8_t reserved;           ///< Reserved field, set to 0
+    uint16_t offset_flags;      ///< 13-bit offset (in 8-byte units), 2 reserved bits and the M flag
+    uint32_t identification;    ///< Identifies the original packet that the fragment belongs to
+} __attribute__((__packed__));
+
+/** The length of an IPv6 Fragment header */
+#define IP6_FRAGMENT_HEADER_LEN   (8)
+
+/** Mask for the offset (in bytes) in the offset_flags field of a Fragment header */
+#define IP6_FRAGMENT_OFFSET_MASK  (0xFFF8)
+
+/** The More Fragments flag in the offset_flags field of a Fragment header */
+#define IP6_FRAGMENT_MORE         (0x0001)
+
+/* Verify that compiler gets the structure size correct */
+static_assert(sizeof(struct ip6_fragment_header) == IP6_FRAGMENT_HEADER_LEN, "Size is not correct");
+
+
 #endif
@@ -63,6 +63,16 @@ EtherSia_LinuxSocket::begin(const MACAddress &address)
 {
     _localMac = address;
 
+    if (!openSocket()) {
+        return false;
+    }
+
+    return EtherSia::begin();
+}
+
+boolean
+EtherSia_LinuxSocket::openSocket()
+{
     ifindex = if_nametoindex(ifname);
     if (ifindex <= 0) {
         perror("if_nametoindex");
@@ -71,7 +81,7 @@ EtherSia_LinuxSocket::begin(const MACAddress &address)
 
     if ((sockfd = socket(PF_PACKET, SOCK_RAW, htons(ETHER_TYPE_IPV6))) == -1) {
         perror("socket(PF_PACKET)");
-        return -1;
+        return false;
     }
 
     /* Set non-blocking mode */
@@ -99,7 +109,7 @@ EtherSia_LinuxSocket::begin(const MACAddress &address)
         return false;
     }
 
-    return EtherSia::begin();
+    return true;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -61,9 +61,21 @@ public:
 
 protected:
 
+    /**
+     * Open the raw socket and bind it to the Ethernet interface
+     * @return true if successful
+     */
+    boolean openSocket();
+
     char ifname[IFNAMSIZ];
     int ifindex;
     int sockfd;
 };
 
+// EtherSia_LinuxUring derives from EtherSia_LinuxSocket, so it is included from here,
+// whichever of EtherSia.h, LinuxSocket.h or LinuxUring.h is included first
+#if defined(__linux__)
+#include "LinuxUring.h"
+#endif
+
 #endif /* LINUXSOCKET_H */
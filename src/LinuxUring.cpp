@@ -0,0 +1,491 @@
+/*
+ * Copyright (c) 2017, Nicholas Humfrey
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#if !defined(ARDUINO) && defined(__linux__)
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <netinet/ether.h>
+#include <linux/if_packet.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "LinuxUring.h"
+
+
+/** Load a value written by the kernel into a ring index */
+#define RING_LOAD(ptr)          __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+
+/** Publish a new ring index to the kernel */
+#define RING_STORE(ptr, val)    __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+/** user_data value for the multishot receives; sends use 1 + the transmit buffer number */
+#define URING_TAG_RECV          (0)
+
+/** Offset of the first transmit buffer in the buffer area */
+#define URING_TX_OFFSET         (ETHERSIA_URING_RX_BUFFERS * ETHERSIA_URING_BUFFER_SIZE)
+
+/** Offset of the provided buffer ring in the buffer area (page aligned) */
+#define URING_BUFRING_OFFSET    (URING_TX_OFFSET + (ETHERSIA_URING_TX_BUFFERS * ETHERSIA_URING_BUFFER_SIZE))
+
+/** Total size of the buffer area */
+#define URING_BUFFERS_LENGTH    (URING_BUFRING_OFFSET + (ETHERSIA_URING_RX_BUFFERS * sizeof(struct io_uring_buf)))
+
+
+static int uringSetup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int uringRegister(int fd, unsigned opcode, void *arg, unsigned nrArgs)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+
+EtherSia_LinuxUring::EtherSia_LinuxUring(const char* iface, boolean sqpoll) :
+    EtherSia_LinuxSocket(iface)
+{
+    useSqPoll = sqpoll;
+    ringfd = -1;
+    sqMap = MAP_FAILED;
+    cqMap = MAP_FAILED;
+    sqes = (struct io_uring_sqe*)MAP_FAILED;
+    buffers = (uint8_t*)MAP_FAILED;
+}
+
+
+boolean
+EtherSia_LinuxUring::begin(const MACAddress &address)
+{
+    _localMac = address;
+
+    if (!openSocket()) {
+        return false;
+    }
+
+    /* Bind to the interface, so that send() doesn't need an address */
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETHER_TYPE_IPV6);
+    sll.sll_ifindex = ifindex;
+    if (bind(sockfd, (struct sockaddr*)&sll, sizeof(sll)) == -1) {
+        perror("bind(AF_PACKET)");
+        end();
+        return false;
+    }
+
+    if (!setupRing() || !setupBuffers()) {
+        end();
+        return false;
+    }
+
+    armReceives();
+    flush();
+
+    return EtherSia::begin();
+}
+
+boolean
+EtherSia_LinuxUring::setupRing()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (useSqPoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 1000;
+    }
+
+    ringfd = uringSetup(ETHERSIA_URING_ENTRIES, &params);
+    if (ringfd < 0) {
+        perror("io_uring_setup");
+        return false;
+    }
+
+    sqMapLength = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqMapLength = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqMapLength > sqMapLength)
+            sqMapLength = cqMapLength;
+        cqMapLength = sqMapLength;
+    }
+
+    sqMap = mmap(NULL, sqMapLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+    if (sqMap == MAP_FAILED) {
+        perror("mmap(IORING_OFF_SQ_RING)");
+        return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cqMap = sqMap;
+    } else {
+        cqMap = mmap(NULL, cqMapLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+        if (cqMap == MAP_FAILED) {
+            perror("mmap(IORING_OFF_CQ_RING)");
+            return false;
+        }
+    }
+
+    sqes = (struct io_uring_sqe*)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        perror("mmap(IORING_OFF_SQES)");
+        return false;
+    }
+
+    uint8_t *sq = (uint8_t*)sqMap;
+    sqHead = (unsigned*)(sq + params.sq_off.head);
+    sqTail = (unsigned*)(sq + params.sq_off.tail);
+    sqFlags = (unsigned*)(sq + params.sq_off.flags);
+    sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    sqEntries = params.sq_entries;
+    sqLocalTail = *sqTail;
+    sqPending = 0;
+
+    // Each submission queue slot always refers to the SQE with the same index
+    unsigned *sqArray = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sqEntries; i++) {
+        sqArray[i] = i;
+    }
+
+    uint8_t *cq = (uint8_t*)cqMap;
+    cqHead = (unsigned*)(cq + params.cq_off.head);
+    cqTail = (unsigned*)(cq + params.cq_off.tail);
+    cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+boolean
+EtherSia_LinuxUring::setupBuffers()
+{
+    buffers = (uint8_t*)mmap(NULL, URING_BUFFERS_LENGTH, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+        perror("mmap(buffers)");
+        return false;
+    }
+
+    // Register a ring of buffers that the kernel can pick from for each received frame
+    // (struct io_uring_buf_ring::bufs is offset by the flexible array macro in C++, so index the entries directly)
+    bufRing = (struct io_uring_buf*)(buffers + URING_BUFRING_OFFSET);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+    reg.ring_entries = ETHERSIA_URING_RX_BUFFERS;
+    reg.bgid = 0;
+    if (uringRegister(ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register(IORING_REGISTER_PBUF_RING)");
+        return false;
+    }
+
+    bufRingTail = 0;
+    for (uint16_t bid = 0; bid < ETHERSIA_URING_RX_BUFFERS; bid++) {
+        struct io_uring_buf *buf = &bufRing[bufRingTail & (ETHERSIA_URING_RX_BUFFERS - 1)];
+        buf->addr = (uint64_t)(uintptr_t)(buffers + bid * ETHERSIA_URING_BUFFER_SIZE);
+        buf->len = ETHERSIA_URING_BUFFER_SIZE;
+        buf->bid = bid;
+        bufRingTail++;
+    }
+    RING_STORE(&((struct io_uring_buf_ring*)bufRing)->tail, bufRingTail);
+
+    rxPendingHead = 0;
+    rxPendingCount = 0;
+    recvInFlight = 0;
+
+    for (txFreeCount = 0; txFreeCount < ETHERSIA_URING_TX_BUFFERS; txFreeCount++) {
+        txFree[txFreeCount] = txFreeCount;
+    }
+
+    return true;
+}
+
+/*---------------------------------------------------------------------------*/
+
+struct io_uring_sqe*
+EtherSia_LinuxUring::getSqe()
+{
+    if (sqLocalTail - RING_LOAD(sqHead) >= sqEntries) {
+        // Submission queue is full - hand everything over to the kernel
+        flush();
+        if (sqLocalTail - RING_LOAD(sqHead) >= sqEntries)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &sqes[sqLocalTail & sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqLocalTail++;
+    sqPending++;
+    return sqe;
+}
+
+void
+EtherSia_LinuxUring::enter(unsigned minComplete, unsigned flags)
+{
+    unsigned toSubmit = sqPending;
+
+    if (useSqPoll) {
+        // The kernel thread picks up new entries by itself; only wake it if it has gone to sleep
+        toSubmit = 0;
+        sqPending = 0;
+        if (RING_LOAD(sqFlags) & IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+    }
+
+    if (toSubmit == 0 && minComplete == 0 && !(flags & IORING_ENTER_SQ_WAKEUP)) {
+        return;
+    }
+
+    if (uringEnter(ringfd, toSubmit, minComplete, flags) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            perror("io_uring_enter");
+        return;
+    }
+
+    sqPending = 0;
+}
+
+void
+EtherSia_LinuxUring::flush()
+{
+    if (ringfd < 0)
+        return;
+
+    RING_STORE(sqTail, sqLocalTail);
+    enter(0, 0);
+}
+
+void
+EtherSia_LinuxUring::armReceives()
+{
+    if (rxPendingCount >= ETHERSIA_URING_RX_BUFFERS) {
+        // Every buffer holds a frame waiting to be read, so a receive would just fail with ENOBUFS
+        return;
+    }
+
+    while (recvInFlight < ETHERSIA_URING_RECV_REQUESTS) {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == NULL) {
+            return;
+        }
+
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sockfd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = URING_TAG_RECV;
+        recvInFlight++;
+    }
+}
+
+void
+EtherSia_LinuxUring::reapCompletions()
+{
+    unsigned head = *cqHead;
+    unsigned tail = RING_LOAD(cqTail);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &cqes[head & cqMask];
+
+        if (cqe->user_data == URING_TAG_RECV) {
+            if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                uint8_t slot = (rxPendingHead + rxPendingCount) % ETHERSIA_URING_RX_BUFFERS;
+                rxPendingId[slot] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                rxPendingLen[slot] = cqe->res;
+                rxPendingCount++;
+            } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+                errno = -cqe->res;
+                perror("io_uring recv");
+            }
+
+            // The kernel stops a multishot receive when it runs out of buffers
+            if (!(cqe->flags & IORING_CQE_F_MORE) && recvInFlight > 0) {
+                recvInFlight--;
+            }
+        } else {
+            if (cqe->res < 0) {
+                errno = -cqe->res;
+                perror("io_uring send");
+            }
+            txFree[txFreeCount++] = cqe->user_data - 1;
+        }
+
+        head++;
+    }
+
+    RING_STORE(cqHead, head);
+}
+
+/*---------------------------------------------------------------------------*/
+
+uint16_t
+EtherSia_LinuxUring::sendFrame(const uint8_t *data, uint16_t datalen)
+{
+    if (datalen > ETHERSIA_URING_BUFFER_SIZE) {
+        return 0;
+    }
+
+    // Wait for a transmit buffer to become free
+    reapCompletions();
+    while (txFreeCount == 0) {
+        RING_STORE(sqTail, sqLocalTail);
+        enter(1, IORING_ENTER_GETEVENTS);
+        reapCompletions();
+    }
+
+    uint8_t slot = txFree[--txFreeCount];
+    uint8_t *buf = buffers + URING_TX_OFFSET + slot * ETHERSIA_URING_BUFFER_SIZE;
+    memcpy(buf, data, datalen);
+
+    struct io_uring_sqe *sqe = getSqe();
+    if (sqe == NULL) {
+        txFree[txFreeCount++] = slot;
+        return 0;
+    }
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = datalen;
+    sqe->user_data = 1 + slot;
+
+    if (useSqPoll || sqPending >= ETHERSIA_URING_SEND_BATCH) {
+        flush();
+    }
+
+    return datalen;
+}
+
+/*---------------------------------------------------------------------------*/
+
+uint16_t
+EtherSia_LinuxUring::readFrame(uint8_t *buffer, uint16_t bufsize)
+{
+    reapCompletions();
+
+    // Restart any receives that ended, even if there is no frame to hand out
+    if (recvInFlight < ETHERSIA_URING_RECV_REQUESTS) {
+        armReceives();
+    }
+
+    if (rxPendingCount == 0 || sqPending) {
+        // Submit queued sends and receives and collect any new completions in a single system call
+        RING_STORE(sqTail, sqLocalTail);
+        enter(0, useSqPoll ? 0 : IORING_ENTER_GETEVENTS);
+        reapCompletions();
+    }
+
+    if (rxPendingCount == 0) {
+        return 0;
+    }
+
+    uint16_t bid = rxPendingId[rxPendingHead];
+    uint16_t len = rxPendingLen[rxPendingHead];
+    rxPendingHead = (rxPendingHead + 1) % ETHERSIA_URING_RX_BUFFERS;
+    rxPendingCount--;
+
+    uint8_t *buf = buffers + bid * ETHERSIA_URING_BUFFER_SIZE;
+    if (len > bufsize) {
+        len = 0;
+    } else {
+        memcpy(buffer, buf, len);
+    }
+
+    // Give the buffer back to the kernel
+    struct io_uring_buf *entry = &bufRing[bufRingTail & (ETHERSIA_URING_RX_BUFFERS - 1)];
+    entry->addr = (uint64_t)(uintptr_t)buf;
+    entry->len = ETHERSIA_URING_BUFFER_SIZE;
+    entry->bid = bid;
+    bufRingTail++;
+    RING_STORE(&((struct io_uring_buf_ring*)bufRing)->tail, bufRingTail);
+
+    // Now that there is a buffer to receive into, restart any receives that ran out
+    armReceives();
+
+    return len;
+}
+
+void
+EtherSia_LinuxUring::end()
+{
+    if (ringfd >= 0 && buffers != MAP_FAILED) {
+        // Wait for any frames that are still being sent
+        flush();
+        while (txFreeCount < ETHERSIA_URING_TX_BUFFERS) {
+            if (uringEnter(ringfd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+                break;
+            reapCompletions();
+        }
+    }
+
+    if (ringfd >= 0) {
+        close(ringfd);
+        ringfd = -1;
+    }
+
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqEntries * sizeof(struct io_uring_sqe));
+        sqes = (struct io_uring_sqe*)MAP_FAILED;
+    }
+
+    if (cqMap != MAP_FAILED && cqMap != sqMap) {
+        munmap(cqMap, cqMapLength);
+    }
+    cqMap = MAP_FAILED;
+
+    if (sqMap != MAP_FAILED) {
+        munmap(sqMap, sqMapLength);
+        sqMap = MAP_FAILED;
+    }
+
+    if (buffers != MAP_FAILED) {
+        munmap(buffers, URING_BUFFERS_LENGTH);
+        buffers = (uint8_t*)MAP_FAILED;
+    }
+
+    EtherSia_LinuxSocket::end();
+}
+
+#endif
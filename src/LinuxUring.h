@@ -0,0 +1,150 @@
+/**
+ * Header file for using EtherSia with a network Socket and io_uring on Linux
+ * @file LinuxUring.h
+ */
+
+#ifndef LINUXURING_H
+#define LINUXURING_H
+
+#include <linux/io_uring.h>
+
+#include "LinuxSocket.h"
+
+/** The number of entries in the io_uring submission queue */
+#define ETHERSIA_URING_ENTRIES      (64)
+
+/** The number of buffers provided to the kernel for receiving frames (must be a power of two) */
+#define ETHERSIA_URING_RX_BUFFERS   (32)
+
+/** The number of buffers for frames waiting to be sent */
+#define ETHERSIA_URING_TX_BUFFERS   (32)
+
+/** The size of each receive and transmit buffer */
+#define ETHERSIA_URING_BUFFER_SIZE  (2048)
+
+/** The number of multishot receive requests kept in flight on the socket */
+#define ETHERSIA_URING_RECV_REQUESTS (4)
+
+/** The number of queued sends that triggers a submission (when not using SQPOLL) */
+#define ETHERSIA_URING_SEND_BATCH   (8)
+
+
+/**
+ * Run EtherSia on Linux using a raw socket, with the frames sent and received using io_uring
+ * Not intended for use with running EtherSia on Arduino.
+ *
+ * A set of multishot receive requests is kept in flight, which place frames into buffers
+ * provided to the kernel, and sends are queued up and submitted in batches.
+ *
+ * With SQPOLL enabled, a kernel thread picks up submissions, so steady-state
+ * traffic doesn't need any system calls. Without it, queued sends are submitted
+ * when readFrame() is next called, or when ETHERSIA_URING_SEND_BATCH are waiting.
+ *
+ * Requires Linux 6.0 or newer.
+ *
+ * @note this is probably only useful for testing and development of EtherSia.
+ */
+class EtherSia_LinuxUring : public EtherSia_LinuxSocket {
+
+public:
+    /**
+     * Constructor
+     * @param iface the name of the Ethernet interface to send/receive on
+     * @param sqpoll true to use a kernel thread to poll the submission queue
+     */
+    EtherSia_LinuxUring(const char* iface = NULL, boolean sqpoll = false);
+
+    // Tell the compiler we want to use begin() from the base class
+    using EtherSia::begin;
+
+    /**
+     * Initialise the raw socket and io_uring
+     * Must be called before sending or receiving Ethernet frames
+     *
+     * @param address the local MAC address for the Ethernet interface
+     * @return Returns true if setting up the Ethernet interface was successful
+     */
+    virtual boolean begin(const MACAddress &address);
+
+    /**
+     * Queue an Ethernet frame to be sent
+     *
+     * The frame is copied, so the buffer can be re-used as soon as this returns.
+     *
+     * @param data a pointer to the data to send
+     * @param datalen the length of the data in the packet
+     * @return the number of bytes queued
+     */
+    virtual uint16_t sendFrame(const uint8_t *data, uint16_t datalen);
+
+    /**
+     * Read an Ethernet frame from the completion queue
+     * @param buffer a pointer to a buffer to write the packet to
+     * @param bufsize the available space in the buffer
+     * @return the length of the received packet
+     *         or 0 if no packet was received
+     */
+    virtual uint16_t readFrame(uint8_t *buffer, uint16_t bufsize);
+
+    /**
+     * Submit any queued sends to the kernel
+     */
+    virtual void flush();
+
+    /**
+     * Send any queued frames and close the io_uring and raw socket
+     */
+    virtual void end();
+
+protected:
+
+    boolean setupRing();
+    boolean setupBuffers();
+    struct io_uring_sqe* getSqe();
+    void armReceives();
+    void reapCompletions();
+    void enter(unsigned minComplete, unsigned flags);
+
+    boolean useSqPoll;
+    int ringfd;
+
+    // Submission queue
+    void *sqMap;
+    size_t sqMapLength;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqFlags;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqLocalTail;
+    unsigned sqPending;
+    struct io_uring_sqe *sqes;
+
+    // Completion queue
+    void *cqMap;
+    size_t cqMapLength;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+
+    // Buffers
+    uint8_t *buffers;
+    struct io_uring_buf *bufRing;
+    uint16_t bufRingTail;
+
+    /** Buffer IDs and lengths of received frames waiting to be read */
+    uint16_t rxPendingId[ETHERSIA_URING_RX_BUFFERS];
+    uint16_t rxPendingLen[ETHERSIA_URING_RX_BUFFERS];
+    uint8_t rxPendingHead;
+    uint8_t rxPendingCount;
+
+    /** The number of multishot receive requests that the kernel hasn't finished */
+    uint8_t recvInFlight;
+
+    /** Stack of transmit buffers that aren't in use */
+    uint8_t txFree[ETHERSIA_URING_TX_BUFFERS];
+    uint8_t txFreeCount;
+};
+
+#endif /* LINUXURING_H */
@@ -7,16 +7,6 @@ MACAddress::MACAddress()
     memset(_address, 0, sizeof(_address));
 }
 
-MACAddress::MACAddress(uint8_t one, uint8_t two, uint8_t three, uint8_t four, uint8_t five, uint8_t six)
-{
-    _address[0] = one;
-    _address[1] = two;
-    _address[2] = three;
-    _address[3] = four;
-    _address[4] = five;
-    _address[5] = six;
-}
-
 MACAddress::MACAddress(const byte macaddr[6])
 {
     memcpy(_address, macaddr, sizeof(_address));
@@ -53,7 +43,6 @@ void MACAddress::setIPv6Multicast(const uint8_t *address)
     _address[5] = address[15];
 }
 
-<<<<<<< HEAD
 void MACAddress::fromBytes(uint8_t one, uint8_t two, uint8_t three, uint8_t four, uint8_t five, uint8_t six)
 {
     _address[0] = one;
@@ -62,11 +51,11 @@ void MACAddress::fromBytes(uint8_t one, uint8_t two, uint8_t three, uint8_t four
     _address[3] = four;
     _address[4] = five;
     _address[5] = six;
-=======
+}
+
 boolean MACAddress::isIPv6Multicast()
 {
     return _address[0] == 0x33 && _address[1] == 0x33;
->>>>>>> refs/remotes/njh/master
 }
 
 boolean MACAddress::fromString(const char *macstr)
@@ -105,13 +94,26 @@ uint8_t MACAddress::operator[](int index) const
     return _address[index];
 }
 
-void MACAddress::print(Print &p) const
+uint8_t MACAddress::toString(char *buf) const
 {
+    char *pos = buf;
+
     for (uint8_t i = 0; i < 6; ++i) {
-        printPaddedHex(_address[i], p);
-        if (i < 5)
-            p.print(':');
+        if (i > 0)
+            *pos++ = ':';
+        *pos++ = hexDigit(_address[i] >> 4);
+        *pos++ = hexDigit(_address[i]);
     }
+
+    *pos = '\0';
+    return pos - buf;
+}
+
+void MACAddress::print(Print &p) const
+{
+    char buf[MAC_ADDRESS_STR_LEN + 1];
+    uint8_t len = toString(buf);
+    p.write((const uint8_t *)buf, len);
 }
 
 void MACAddress::println(Print &p) const
@@ -119,3 +121,8 @@ void MACAddress::println(Print &p) const
     this->print(p);
     p.println();
 }
+
+uint8_t invalidMACAddressLiteral()
+{
+    return 0;
+}
@@ -7,6 +7,37 @@
 #define MACAddress_H
 
 #include <stdint.h>
+#include <stddef.h>
+
+
+/** The string length of a MAC address */
+#define MAC_ADDRESS_STR_LEN  17
+
+
+/**
+ * Convert an ASCII hex character to its integer value, at compile time
+ *
+ * @param c The character (0-9, a-f or A-F)
+ * @return The integer value or -1 if it is invalid
+ * @private
+ */
+constexpr int8_t literalHexDigit(char c)
+{
+    return (c >= '0' && c <= '9') ? c - '0' :
+           (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+           (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+}
+
+/**
+ * Called when a _mac literal is not a valid MAC address
+ *
+ * This function isn't constexpr, so using it while evaluating a
+ * constant expression causes a compile error.
+ *
+ * @return 0
+ * @private
+ */
+uint8_t invalidMACAddressLiteral();
 
 
 /**
@@ -43,7 +74,8 @@ public:
      * @param five The fifth octet of the address
      * @param six The sixth octet of the address
      */
-    MACAddress(uint8_t one, uint8_t two, uint8_t three, uint8_t four, uint8_t five, uint8_t six);
+    constexpr MACAddress(uint8_t one, uint8_t two, uint8_t three, uint8_t four, uint8_t five, uint8_t six)
+        : _address{one, two, three, four, five, six} {}
 
     /**
      * Parse a human readable MAC address into a MACAddress object.
@@ -98,6 +130,14 @@ public:
      */
     uint8_t operator[](int index) const;
 
+    /**
+     * Convert the MAC address to a human readable string
+     *
+     * @param buf The buffer to write to (at least MAC_ADDRESS_STR_LEN + 1 bytes)
+     * @return The length of the string, not including the null terminator
+     */
+    uint8_t toString(char *buf) const;
+
     /**
      * Print a MAC address to a stream as a human readable string.
      * @param print The stream to print to (defaults to Serial)
@@ -110,9 +150,63 @@ public:
      */
     void println(Print &print=Serial) const;
 
+    /**
+     * Check if a string is a valid MAC address, at compile time
+     *
+     * @param str The string to check, from position pos onwards
+     * @param len The length of the string
+     * @param pos The position to start checking from
+     * @return true if the string contains six pairs of hex digits separated by colons
+     * @private
+     */
+    static constexpr boolean literalValid(const char *str, size_t len, size_t pos)
+    {
+        return len == 17 && (pos >= len ||
+                             ((pos % 3 == 2 ? str[pos] == ':' : literalHexDigit(str[pos]) >= 0) &&
+                              literalValid(str, len, pos + 1)));
+    }
+
+    /**
+     * Get one octet of a MAC address string, at compile time
+     *
+     * @param str The MAC address string
+     * @param len The length of the string
+     * @param index The octet number (0 to 5)
+     * @return The value of the octet
+     * @private
+     */
+    static constexpr uint8_t literalOctet(const char *str, size_t len, uint8_t index)
+    {
+        return literalValid(str, len, 0) ?
+               (literalHexDigit(str[index * 3]) << 4) | literalHexDigit(str[index * 3 + 1]) :
+               invalidMACAddressLiteral();
+    }
+
 } __attribute__((__packed__));
 
 /* Verify that compiler gets the structure size correct */
 static_assert(sizeof(MACAddress) == 6, "Size is not correct");
 
+/**
+ * User-defined literal for a MAC address, for example "5e:73:f9:8a:cf:ba"_mac
+ *
+ * The address is only parsed at compile time, and an invalid address
+ * only causes a compile error, when the literal is used in a constant
+ * expression - for example to initialise a constexpr variable.
+ * Otherwise it may be parsed at run time, and an invalid address
+ * silently gives an address of all zeros.
+ *
+ * @param str The MAC address string
+ * @param len The length of the string
+ * @return A MACAddress object
+ */
+constexpr MACAddress operator"" _mac(const char *str, size_t len)
+{
+    return MACAddress(
+               MACAddress::literalOctet(str, len, 0), MACAddress::literalOctet(str, len, 1),
+               MACAddress::literalOctet(str, len, 2), MACAddress::literalOctet(str, len, 3),
+               MACAddress::literalOctet(str, len, 4), MACAddress::literalOctet(str, len, 5)
+           );
+}
+
 #endif
@@ -10,7 +10,17 @@ Socket::Socket(EtherSia &ether, uint16_t localPort) : _ether(ether)
     _localPort = localPort;
     _remoteAddress.setZero();
     _remotePort = 0;
+    _hopLimit = 0;
     _writePos = -1;
+    _checksumFlags = 0;
+
+    // Stop the port being given to another socket
+    _ether.reservePort(localPort);
+}
+
+Socket::~Socket()
+{
+    _ether.releasePort(_localPort);
 }
 
 boolean Socket::setRemoteAddress(const __FlashStringHelper* remoteAddress, uint16_t remotePort)
@@ -48,23 +58,24 @@ boolean Socket::setRemoteAddress(IPv6Address &remoteAddress, uint16_t remotePort
 {
     _remotePort = remotePort;
     _remoteAddress = remoteAddress;
+    _checksumFlags = 0;
 
     if (_localPort == 0) {
-        _localPort = random(20000, 30000);
+        _localPort = _ether.allocatePort();
     }
 
     // Work out the MAC address to use
-    if (_ether.inOurSubnet(_remoteAddress)) {
-        MACAddress *mac = _ether.discoverNeighbour(_remoteAddress);
-        if (mac == NULL) {
-            return false;
-        } else {
-            _remoteMac = *mac;
-        }
-    } else {
-        _remoteMac = _ether.routerMac();
+    if (_remoteAddress.isMulticast()) {
+        _remoteMac.setIPv6Multicast(_remoteAddress);
+        return true;
     }
 
+    MACAddress *mac = _ether.nextHop(_remoteAddress);
+    if (mac == NULL) {
+        return false;
+    }
+    _remoteMac = *mac;
+
     return true;
 }
 
@@ -83,6 +94,12 @@ uint16_t Socket::localPort()
     return _localPort;
 }
 
+void Socket::releaseLocalPort()
+{
+    _ether.releasePort(_localPort);
+    _localPort = 0;
+}
+
 IPv6Address& Socket::packetSource()
 {
     return _ether.packet().source();
@@ -110,13 +127,26 @@ void Socket::send(const void *data, uint16_t length, boolean isReply)
 {
     uint8_t* payload = this->transmitPayload();
 
-    // FIXME: check it isn't too big
-    memcpy(payload, data, length);
+    // Don't send more than will fit in the packet buffer and the path to the remote host
+    if (length > maxPayloadLength()) {
+        if (sendFragmented(data, length, isReply)) {
+            return;
+        }
+        length = maxPayloadLength();
+    }
+
+    memmove(payload, data, length);
 
     send(length, isReply);
 }
 
 void Socket::send(uint16_t length, boolean isReply)
+{
+    preparePacket(isReply);
+    sendInternal(length, isReply);
+}
+
+void Socket::preparePacket(boolean isReply)
 {
     IPv6Packet& packet = _ether.packet();
 
@@ -126,9 +156,42 @@ void Socket::send(uint16_t length, boolean isReply)
         packet.setDestination(_remoteAddress);
         packet.setEtherDestination(_remoteMac);
         _ether.prepareSend();
+
+        if (_hopLimit) {
+            packet.setHopLimit(_hopLimit);
+        } else if (_remoteAddress.isMulticast()) {
+            packet.setHopLimit(IP6_MULTICAST_HOP_LIMIT);
+        }
     }
+}
 
-    sendInternal(length, isReply);
+boolean Socket::sendFragmented(const void* /*data*/, uint16_t /*length*/, boolean /*isReply*/)
+{
+    return false;
+}
+
+uint16_t Socket::addressChecksum()
+{
+    IPv6Packet& packet = _ether.packet();
+
+    // Only cache the checksum for packets to the remote address, not replies to other hosts
+    if (_remoteAddress.isZero() || packet.destination() != _remoteAddress) {
+        return packet.addressChecksum();
+    }
+
+    // The source is always one of our addresses, so it is known from its type
+    uint8_t flags = CHECKSUM_FLAG_VALID;
+    if (packet.source().isLinkLocal()) {
+        flags |= CHECKSUM_FLAG_LINK_LOCAL;
+    }
+
+    if (_checksumFlags != flags || _checksumGeneration != _ether.addressGeneration()) {
+        _checksum = packet.addressChecksum();
+        _checksumGeneration = _ether.addressGeneration();
+        _checksumFlags = flags;
+    }
+
+    return _checksum;
 }
 
 void Socket::sendReply() {
@@ -147,6 +210,18 @@ void Socket::sendReply(const void *data, uint16_t length) {
     send(data, length, true);
 }
 
+uint16_t Socket::maxPayloadLength()
+{
+    IPv6Packet& packet = _ether.packet();
+    uint16_t headerLen = transmitPayload() - packet.payload();
+
+    if (_remoteAddress.isZero()) {
+        return _ether.pathMtu(packet.source()) - IP6_HEADER_LEN - headerLen;
+    } else {
+        return _ether.pathMtu(_remoteAddress) - IP6_HEADER_LEN - headerLen;
+    }
+}
+
 boolean Socket::payloadEquals(const char *str)
 {
     return strncmp((char*)payload(), str, payloadLength()) == 0;
@@ -180,10 +255,73 @@ size_t Socket::write(uint8_t chr)
         writePayloadHeader();
     }
 
-    if (doWriteChar) {
+    if (doWriteChar && _writePos < maxPayloadLength()) {
         payload[_writePos++] = chr;
         return 1;
     } else {
         return 0;
     }
 }
+
+size_t Socket::write(const uint8_t *buffer, size_t size)
+{
+    size_t count = 0;
+    size_t pos = 0;
+
+    while (pos < size) {
+        if (buffer[pos] == '\n' || buffer[pos] == '\r') {
+            // Newlines may send the packet, so they are handled one at a time
+            count += write(buffer[pos++]);
+            continue;
+        }
+
+        // Find the end of this run of characters
+        size_t run = 1;
+        while (pos + run < size && buffer[pos + run] != '\n' && buffer[pos + run] != '\r') {
+            run++;
+        }
+
+        if (_writePos == -1) {
+            _writePos = 0;
+            writePayloadHeader();
+        }
+
+        // Copy as much of the run as will fit
+        uint16_t maxLen = maxPayloadLength();
+        size_t len = (_writePos < maxLen) ? maxLen - _writePos : 0;
+        if (len > run) {
+            len = run;
+        }
+
+        memcpy(this->transmitPayload() + _writePos, buffer + pos, len);
+        _writePos += len;
+        count += len;
+        pos += run;
+    }
+
+    return count;
+}
+
+size_t Socket::print(const __FlashStringHelper *str)
+{
+    const char *ptr = (const char *)str;
+    uint8_t chunk[32];
+    size_t remaining = strlen_P(ptr);
+    size_t count = 0;
+
+    // Copy out of Flash Memory a chunk at a time
+    while (remaining) {
+        size_t len = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+        memcpy_P(chunk, ptr, len);
+        count += write(chunk, len);
+        ptr += len;
+        remaining -= len;
+    }
+
+    return count;
+}
+
+size_t Socket::println(const __FlashStringHelper *str)
+{
+    return print(str) + println();
+}
@@ -11,6 +11,12 @@
 
 class EtherSia;
 
+/** Socket::_checksumFlags bit: the cached checksum is valid */
+#define CHECKSUM_FLAG_VALID       (0x01)
+
+/** Socket::_checksumFlags bit: the cached checksum is for our link-local address */
+#define CHECKSUM_FLAG_LINK_LOCAL  (0x02)
+
 /**
  * Abstract base class for a IP socket
  */
@@ -34,6 +40,11 @@ public:
      */
     Socket(EtherSia &ether, uint16_t localPort);
 
+    /**
+     * Destroy the socket, releasing its local port number
+     */
+    ~Socket();
+
     /**
      * Set the remote address (as a string) and port to send packets to
      *
@@ -83,6 +94,27 @@ public:
      */
     uint16_t localPort();
 
+    /**
+     * Release the local port number, so that setRemoteAddress() allocates a new one
+     *
+     * This is for sockets without a fixed local port, that are used again
+     * for a new conversation.
+     */
+    void releaseLocalPort();
+
+    /**
+     * Set the hop limit of packets sent to the remote address
+     *
+     * By default, packets to a unicast address use IP6_DEFAULT_HOP_LIMIT
+     * and packets to a multicast group use IP6_MULTICAST_HOP_LIMIT,
+     * so that they don't leave the local link.
+     *
+     * @param hopLimit The hop limit to use (or 0 to use the default)
+     */
+    inline void setHopLimit(uint8_t hopLimit) {
+        _hopLimit = hopLimit;
+    }
+
     /**
      * Get the IPv6 source address of the last packet received
      *
@@ -199,6 +231,22 @@ public:
      */
     virtual uint8_t* transmitPayload();
 
+    /**
+     * Get the maximum length of payload that can be sent to the remote host
+     *
+     * This is limited by the size of the packet buffer, and the Path MTU
+     * to the remote address (or the source of the current packet, if no
+     * remote address has been set).
+     *
+     * @return The maximum payload length (in bytes)
+     */
+    uint16_t maxPayloadLength();
+
+    // Tell the compiler we want to use the other print(), println() and write() methods from Print
+    using Print::print;
+    using Print::println;
+    using Print::write;
+
     /**
      * Write a single character into the packet buffer
      *
@@ -207,6 +255,35 @@ public:
      */
     virtual size_t write(uint8_t chr);
 
+    /**
+     * Write a block of characters into the packet buffer
+     *
+     * Runs of characters between newlines are copied in one go.
+     * Newlines are passed to handleWriteNewline() one at a time, in the same
+     * way as write(uint8_t).
+     *
+     * @param buffer The characters to write
+     * @param size The number of characters to write
+     * @return The number of bytes written to the buffer
+     */
+    virtual size_t write(const uint8_t *buffer, size_t size);
+
+    /**
+     * Write a string stored in flash memory into the packet buffer
+     *
+     * @param str The string to write (use the F() macro)
+     * @return The number of bytes written to the buffer
+     */
+    size_t print(const __FlashStringHelper *str);
+
+    /**
+     * Write a string stored in flash memory into the packet buffer, followed by a newline
+     *
+     * @param str The string to write (use the F() macro)
+     * @return The number of bytes written to the buffer
+     */
+    size_t println(const __FlashStringHelper *str);
+
 protected:
 
     /**
@@ -232,6 +309,36 @@ protected:
      */
     virtual void writePayloadHeader();
 
+    /**
+     * Set the addresses in the packet buffer, ready to send a packet
+     *
+     * @param isReply true if the sent packet is a reply to the packet current in the buffer
+     */
+    void preparePacket(boolean isReply);
+
+    /**
+     * Protocol specific function that is called by send() when the data
+     * is too big to fit in a single packet
+     *
+     * Default behaviour is to return false, so that the data is truncated.
+     *
+     * @param data The data to send as the payload
+     * @param length The length (in bytes) of the data to send
+     * @param isReply Set to true if this packet is a reply to an incoming packet
+     * @return true if the data was sent as a series of fragments
+     */
+    virtual boolean sendFragmented(const void *data, uint16_t length, boolean isReply);
+
+    /**
+     * Get the partial checksum of the source and destination addresses in the packet buffer
+     *
+     * For packets to the remote address, the result is cached until
+     * the remote address or our addresses change.
+     *
+     * @return the partial checksum, to pass to IPv6Packet::calculateChecksum()
+     */
+    uint16_t addressChecksum();
+
     /**
      * Protocol specific function that is called by send(), sendReply() etc.
      *
@@ -246,9 +353,14 @@ protected:
     MACAddress _remoteMac;       ///< The Ethernet address to send packets to
     uint16_t _remotePort;        ///< The remote port number
     uint16_t _localPort;         ///< The local port number
+    uint8_t _hopLimit;           ///< The hop limit for sent packets (0 = default)
 
     /** The current position of writing data to buffer (when using Print interface) */
     int16_t _writePos;
+
+    uint16_t _checksum;           ///< Cached partial checksum of the addresses, see addressChecksum()
+    uint8_t _checksumGeneration;  ///< The EtherSia::addressGeneration() when _checksum was calculated
+    uint8_t _checksumFlags;       ///< Whether _checksum is valid, and if it is for our link-local address
 };
 
 
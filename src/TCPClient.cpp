@@ -12,6 +12,166 @@ TCPClient::TCPClient(EtherSia &ether) : Socket(ether)
     _nrexmitFinAck=0;
     _nrcvd=0;
     _ndropped=0;
+    _remoteWindow=0;
+    _sendBuffer=NULL;
+    _sendBufferSize=0;
+    _sendBufferStart=0;
+    _appliFlags=0;
+    _timerFlags=0;
+    _unAckLen=0;
+    _sentLength=0;
+    _rttTiming=false;
+    _persistTimer=UIP_RTO;
+    _persistCount=0;
+    _inactivity=millis();
+}
+
+TCPClient::~TCPClient()
+{
+    _ether.cancelTimer(periodicTimer, this);
+}
+
+void TCPClient::periodicTimer(void *client)
+{
+    ((TCPClient*)client)->periodic();
+}
+
+void TCPClient::periodic()
+{
+    _periodic = millis();
+
+    //if we have outstanding datas, we decrease the retransmission timer
+    //and retransmit when it expires, without waiting for havePacket()
+    if (_unAckLen > 0 && _state != TCP_STATE_DISCONNECTED && !(_state & TCP_STATE_TIMEDOUT)) {
+        if (_timer > 0) {
+            _timer--;
+        }
+        if (_rttTiming && _rttTicks < 127) {
+            _rttTicks++;
+        }
+        PRINT(F("[sa:"));PRINT(_sa);
+        PRINT(F("-sv:"));PRINT(_sv);
+        PRINT(F("-rto:"));PRINT(_rto);
+        PRINT(F("-timer:"));PRINT(_timer);
+        PRINT(F("-nrtx:"));PRINT(_nrtx);PRINTLN(F("]"));
+        if (_timer == 0) {
+            retransmit();
+        }
+    }
+
+    //the server's receive window is closed and nothing is in flight to get it opened again:
+    //probe it, in case the ACK that opens it is lost (RFC9293 3.8.6.1)
+    if (_state == TCP_STATE_CONNECTED && _unAckLen == 0 && _remoteWindow == 0) {
+        if (_persistTimer > 0) {
+            _persistTimer--;
+        }
+        if (_persistTimer == 0) {
+            sendWindowProbe();
+            if (_persistCount < 4) {
+                _persistCount++;
+            }
+            _persistTimer = UIP_RTO << _persistCount;
+        }
+    } else {
+        _persistTimer = UIP_RTO;
+        _persistCount = 0;
+    }
+
+    /** _appliFlags hasn't changed for TCP_INACTIVITY_TIME_OUT
+     * we inform the application on the next call to havePacket()
+     */
+    if ((long)(millis() - _inactivity) >= (long)TCP_INACTIVITY_TIME_OUT) {
+        _timerFlags |= UIP_RESET;
+        _inactivity = millis();
+    }
+
+    //keep ticking from EtherSia::poll() until the connection is closed,
+    //so that a disconnected client doesn't use up a timer
+    if (_state != TCP_STATE_DISCONNECTED) {
+        _ether.setTimer(periodicTimer, this, PERIODIC_TIME_OUT);
+    }
+}
+
+void TCPClient::retransmit()
+{
+    IPv6Packet& packet = _ether.packet();
+    struct tcp_header *tcpHeader = TCP_HEADER_PTR;
+
+    //first we update the timer with an exponential backoff
+    _timer = UIP_RTO << (_nrtx > 4 ? 4 : _nrtx);
+
+    //the ACK of a retransmitted segment can't be used to measure the RTT (Karn's algorithm)
+    _rttTiming = false;
+
+    //the packet buffer is used for the retransmission, without any received packet in it
+    preparePacket(false);
+    tcpHeader->dataOffset = 5<<4;
+
+    //if we've reached the maximum retransmit number, we send a RST
+    if (_nrtx==UIP_MAXRTX || ((_state==TCP_STATE_WAIT_SYN_ACK) && _nrtx==UIP_MAXSYNRTX)){
+        // network congestion / we inform the application and send a reset
+        _state|=TCP_STATE_TIMEDOUT;
+        tcpHeader->flags = TCP_FLAG_RST | TCP_FLAG_ACK;
+        sendNoData();
+        return;
+    }
+
+    //if not we update ntrx and do the retransmission
+    _nrtx++;
+    switch (_state & TCP_STATE_MASK){
+    case TCP_STATE_WAIT_SYN_ACK :
+        _nrexmitSynAck++;
+        tcpHeader->flags = TCP_FLAG_SYN;
+        //we include a full line of options with our SYN, in order to send our MSS to the server
+        tcpHeader->dataOffset=6<<4;
+        sendNoData();
+        break;
+    case TCP_STATE_CONNECTED :
+        _nrexmitData++;
+        if (_sendBuffer) {
+            //we have a copy of the data, so we send it again ourselves
+            retransmitBuffer();
+        } else {
+            //we set the appropriate flag in order to inform the ino application that the "data" segment has to be resent
+            _timerFlags |= UIP_REXMIT;
+        }
+        break;
+    case TCP_STATE_LAST_ACK :
+        _nrexmitFinAck++;
+        tcpHeader->flags = TCP_FLAG_FIN | TCP_FLAG_ACK;
+        sendNoData();
+        break;
+    }
+}
+
+void TCPClient::sendWindowProbe()
+{
+    IPv6Packet& packet = _ether.packet();
+    struct tcp_header *tcpHeader = TCP_HEADER_PTR;
+
+    //an empty segment with an old sequence number makes the server send an ACK with its current window
+    preparePacket(false);
+    tcpHeader->flags = TCP_FLAG_ACK;
+    tcpHeader->dataOffset = 5<<4;
+    packet.setPayloadLength((tcpHeader->dataOffset & 0xF0)>>2);
+    fillTCPHeader(_localSeqNum - 1);
+    _ether.send();
+}
+
+void TCPClient::sendNoData()
+{
+    IPv6Packet& packet = _ether.packet();
+    struct tcp_header *tcpHeader = TCP_HEADER_PTR;
+
+    packet.setPayloadLength((tcpHeader->dataOffset & 0xF0)>>2);
+    //segments without data use the next sequence number, after any data in flight
+    //(a SYN or FIN is the only unacknowledged data in the other states)
+    if ((_state & TCP_STATE_MASK) == TCP_STATE_CONNECTED) {
+        fillTCPHeader(_localSeqNum + _unAckLen);
+    } else {
+        fillTCPHeader(_localSeqNum);
+    }
+    _ether.send();
 }
 
 //ACTIVE OPEN
@@ -26,11 +186,14 @@ void TCPClient::connect()
     _remoteSeqNum = 0;
 
     // Use a new local port number for new connections
-    _localPort++;
+    _ether.releasePort(_localPort);
+    _localPort = _ether.allocatePort();
 
     //_unAckLen is the number of unacknowledged sent bytes
     //TCP length of our SYN is 1 byte
     _unAckLen=1;
+    _remoteWindow=0;
+    _sendBufferStart=0;
 
     //RTT related parameters
     _timer=_rto=UIP_RTO;
@@ -39,12 +202,19 @@ void TCPClient::connect()
     _sa=0;
     _sv=16;
     _nrtx=0;
+    _rttTiming=false;
+    _persistTimer=UIP_RTO;
+    _persistCount=0;
 
     tcpHeader->flags = TCP_FLAG_SYN;
 
     _state = TCP_STATE_WAIT_SYN_ACK;
     _periodic = _inactivity = millis();
 
+    //the periodic timer is run by EtherSia::poll(), so that retransmission
+    //timeouts count down even when havePacket() isn't called for a while
+    _ether.setTimer(periodicTimer, this, PERIODIC_TIME_OUT);
+
     send((uint16_t)0, false);
 
 }
@@ -59,15 +229,17 @@ boolean TCPClient::havePacket()
     if (_appliFlags) {
       _inactivity = millis();
     }
-	
-    _appliFlags = 0;
-	
-    /** _appliFlags hasn't changed for 10 minutes
-     * we inform the application
+
+    //start with the flags that periodic() has raised since the last call
+    _appliFlags = _timerFlags;
+    _timerFlags = 0;
+
+    /** _appliFlags hasn't changed for TCP_INACTIVITY_TIME_OUT
+     * periodic() checks this while connected, the timer is stopped while disconnected
      */
-     if((long)(millis()-_inactivity) >= 600000){
-         _appliFlags |= UIP_RESET;
-     }
+    if ((long)(millis()-_inactivity) >= (long)TCP_INACTIVITY_TIME_OUT) {
+        _appliFlags |= UIP_RESET;
+    }
 
     //in disconnect mode we do not accept incoming packets, as we only realize active open
     if (_state == TCP_STATE_DISCONNECTED) goto drop;
@@ -75,19 +247,13 @@ boolean TCPClient::havePacket()
 
     /** we check if the periodic timer has fired
      * the periodic timer is set to fire on PERIODIC_TIME_OUT
+     * it is normally run by EtherSia::poll(), this catches up if the timer couldn't be set
+     * (but not over the top of a received packet, which may be for another socket)
      */
-    if((long)(millis()-_periodic) >= PERIODIC_TIME_OUT){
-      //we reset the timer
-      _periodic = millis();
-      //if we have outstanding datas, we decrease the retransmission timer
-      if(_unAckLen>0){
-          _timer--;
-          PRINT(F("[sa:"));PRINT(_sa);
-          PRINT(F("-sv:"));PRINT(_sv);
-          PRINT(F("-rto:"));PRINT(_rto);
-          PRINT(F("-timer:"));PRINT(_timer);
-          PRINT(F("-nrtx:"));PRINT(_nrtx);PRINTLN(F("]"));
-      }
+    if((long)(millis()-_periodic) >= PERIODIC_TIME_OUT && !_ether.bufferContainsReceived()){
+      periodic();
+      _appliFlags |= _timerFlags;
+      _timerFlags = 0;
     }
 
     if (!_ether.bufferContainsReceived()) {
@@ -95,7 +261,7 @@ boolean TCPClient::havePacket()
         goto check_for_retransmit;
     } else _nrcvd++;
 
-    if (packet.destination() != _ether.linkLocalAddress() || (packet.source() != remoteAddress())) {
+    if (!_ether.packetDestinationType() || (packet.source() != remoteAddress())) {
         // Wrong IP pair - packet is not for us or not from the good source
         // we drop the packet !!
         _ndropped++;
@@ -182,6 +348,11 @@ boolean TCPClient::havePacket()
             goto drop;
         }
 
+        //the server tells us how much more data it can receive in every segment
+        if (tcpHeader->flags & TCP_FLAG_ACK) {
+            _remoteWindow = ntohs(tcpHeader->window);
+        }
+
         /** in case the sequence number of the incoming packet is not what we're expecting
         we send an ACK with the correct numbers inside
         */
@@ -196,17 +367,24 @@ boolean TCPClient::havePacket()
 
         /**ACKING TEST
          is the packet acknowledging sent datas ?
+         acknowledgements are cumulative, so it may acknowledge some or all of the segments in flight
         */
         if ((tcpHeader->flags & TCP_FLAG_ACK) && (_unAckLen >0)){
-            if (ntohl(tcpHeader->acknowledgementNum) == (_localSeqNum + _unAckLen)){
-                _localSeqNum += _unAckLen;
-                /**This Ack coming in response to a sent packet constitutes a measurement we can use to update the RTT estimation
+            tmp32 = ntohl(tcpHeader->acknowledgementNum) - _localSeqNum;
+            if (tmp32 > 0 && tmp32 <= _unAckLen){
+                _localSeqNum += tmp32;
+                if (_sendBuffer && (_state & TCP_STATE_MASK) == TCP_STATE_CONNECTED) {
+                    _sendBufferStart = (_sendBufferStart + tmp32) % _sendBufferSize;
+                }
+                /**This Ack coming in response to the timed segment constitutes a measurement we can use to update the RTT estimation
                 RTT : round trip time
+                only one segment is timed at a time, so that the ACKs of the other segments in flight don't give short samples
                 The following code comes from the Van Jacobson's article on congestion avoidance
                 */
-                if (_nrtx == 0) {
+                if (_rttTiming && (int32_t)(_localSeqNum - _rttSeqNum) >= 0 && _nrtx == 0) {
                     signed char m;
-                    m = _rto - _timer;
+                    _rttTiming = false;
+                    m = _rttTicks;
                     m = m - (_sa >> 3);
                     _sa += m;
                     if (m < 0) m = -m;
@@ -215,7 +393,7 @@ boolean TCPClient::havePacket()
                     _rto = (_sa >> 3) + _sv;
                 }
                 _timer = _rto;
-                _unAckLen=0;
+                _unAckLen -= tmp32;
                 _appliFlags=UIP_ACKDATA;
                 PRINT(F("["));
                 if(_nrtx == 0) PRINT(F("UPDATED"));
@@ -291,60 +469,19 @@ boolean TCPClient::havePacket()
         //prepareReply() swaps ethernet source and destination mac and IP and fixes a fresh hopLimit
         _ether.prepareReply();
         tcpHeader->dataOffset = 5 << 4;
-    tcp_send_nodata :
-        packet.setPayloadLength((tcpHeader->dataOffset & 0xF0)>>2);
-        fillTCPHeader();
-        _ether.send();
+        sendNoData();
 
     goto drop;
 
-    //this is the check for retransmit algorithm !!
+    //retransmissions are made by periodic(), from EtherSia::poll()
     check_for_retransmit :
-        if (_unAckLen>0) {
-            if (_timer == 0){
-                //first we update the timer with an exponential backoff
-                _timer = UIP_RTO << (_nrtx > 4 ? 4 : _nrtx);
-                //if we've reached the maximum retransmit number, we send a RST
-                if (_nrtx==UIP_MAXRTX || ((_state==TCP_STATE_WAIT_SYN_ACK) && _nrtx==UIP_MAXSYNRTX)){
-
-                    // network congestion / we inform the application and send a reset
-                    _state|=TCP_STATE_TIMEDOUT;
-                    tcpHeader->flags = TCP_FLAG_RST | TCP_FLAG_ACK;
-                    tcpHeader->dataOffset=5<<4;
-                    goto tcp_resend;
-                }
-                //if not we update ntrx and do the retransmission
-                _nrtx++;
-                switch (_state & TCP_STATE_MASK){
-                case TCP_STATE_WAIT_SYN_ACK :
-                    _nrexmitSynAck++;
-                    tcpHeader->flags = TCP_FLAG_SYN;
-                    //we include a full line of options with our SYN, in order to send our MSS to the server
-                    tcpHeader->dataOffset=6<<4;
-                    tcp_resend :
-                        _ether.prepareSend();
-                        packet.setDestination(_remoteAddress);
-                        packet.setEtherDestination(_remoteMac);
-                        goto tcp_send_nodata;
-                    break;
-                case TCP_STATE_CONNECTED :
-                    _nrexmitData++;
-                    tcpHeader->flags = TCP_FLAG_ACK;
-                    //we set the appropriate flag in order to inform the ino application that the "data" segment has to be resent
-                    _appliFlags |= UIP_REXMIT;
-                    goto drop;
-                    break;
-                case TCP_STATE_LAST_ACK :
-                    _nrexmitFinAck++;
-                    tcpHeader->flags = TCP_FLAG_FIN | TCP_FLAG_ACK;
-                    tcpHeader->dataOffset=5<<4;
-                    goto tcp_resend;
-                    break;
-                }
-            }
-        }
 
     drop :
+        //the periodic timer is only needed until the connection is closed
+        if (_state == TCP_STATE_DISCONNECTED) {
+            _ether.cancelTimer(periodicTimer, this);
+        }
+
         /** Here we can return if datas were received or not
          * havePacket() sends only "blank" packets with empty payload - no side effect on TCP payload
          */
@@ -352,7 +489,7 @@ boolean TCPClient::havePacket()
         else return false;
 }
 
-void TCPClient::fillTCPHeader()
+void TCPClient::fillTCPHeader(uint32_t sequenceNum)
 {
     IPv6Packet& packet = _ether.packet();
     struct tcp_header *tcpHeader = TCP_HEADER_PTR;
@@ -360,7 +497,7 @@ void TCPClient::fillTCPHeader()
     tcpHeader->destinationPort = htons(_remotePort);
     tcpHeader->sourcePort = htons(_localPort);
 
-    tcpHeader->sequenceNum = htonl(_localSeqNum);
+    tcpHeader->sequenceNum = htonl(sequenceNum);
     tcpHeader->acknowledgementNum = htonl(_remoteSeqNum);
 
     packet.setProtocol(IP6_PROTO_TCP);
@@ -369,11 +506,11 @@ void TCPClient::fillTCPHeader()
     if ((tcpHeader->dataOffset & 0xF0)>0x50){
         tcpHeader->mssOptionKind = 2;
         tcpHeader->mssOptionLen = 4;
-        tcpHeader->mssOptionValue = tcpHeader->window;
+        tcpHeader->mssOptionValue = htons(_ether.tcpMaxSegmentSize(_remoteAddress));
     }
     tcpHeader->urgentPointer = 0;
     tcpHeader->checksum = 0;
-    tcpHeader->checksum = htons(packet.calculateChecksum());
+    tcpHeader->checksum = htons(packet.calculateChecksum(addressChecksum()));
     PRINT(F("[Send"));
     if ((tcpHeader->flags & 0x3f) & TCP_FLAG_SYN)PRINT(F("-SYN"));
     if ((tcpHeader->flags & 0x3f) & TCP_FLAG_FIN)PRINT(F("-FIN"));
@@ -389,21 +526,131 @@ void TCPClient::sendInternal(uint16_t length, boolean /*isReply*/)
 {
     IPv6Packet& packet = _ether.packet();
     struct tcp_header *tcpHeader = TCP_HEADER_PTR;
+    uint32_t sequenceNum = _localSeqNum;
+    boolean newData = !(_appliFlags & UIP_REXMIT) && (_state & TCP_STATE_MASK) == TCP_STATE_CONNECTED;
+
+    _sentLength = length;
+
+    if (newData) {
+        //new data follows the segments that are still in flight
+        sequenceNum += _unAckLen;
+
+        //anything beyond the server's receive window, or that doesn't fit in the send buffer, isn't sent
+        uint16_t space = (_unAckLen < _remoteWindow) ? _remoteWindow - _unAckLen : 0;
+        if (_sendBuffer && _sendBufferSize - _unAckLen < space) {
+            space = _sendBufferSize - _unAckLen;
+        }
+        if (length > space) length = space;
+
+        _sentLength = length;
+        if (length == 0) {
+            //don't send an empty segment, the application can try again when sendSpace() allows it
+            return;
+        }
+
+        if (_sendBuffer) {
+            //keep a copy for retransmission
+            uint16_t pos = (_sendBufferStart + _unAckLen) % _sendBufferSize;
+            uint16_t first = _sendBufferSize - pos;
+            if (first > length) first = length;
+            memcpy(_sendBuffer + pos, transmitPayload(), first);
+            memcpy(_sendBuffer, transmitPayload() + first, length - first);
+        }
+    }
+
+    //the header may have been overwritten by a received packet since havePacket() set the flags
+    if ((_state & TCP_STATE_MASK) == TCP_STATE_CONNECTED) {
+        tcpHeader->flags = TCP_FLAG_ACK;
+    }
+
     //When data are sent, TCPHeader must contain 6 lines of 32 bits
     tcpHeader->dataOffset=6<<4;
     packet.setPayloadLength(((tcpHeader->dataOffset & 0xF0)>>2) + length);
-    fillTCPHeader();
+    fillTCPHeader(sequenceNum);
     _ether.send();
 
     if (!(_appliFlags & UIP_REXMIT)){
+        //the retransmission timer times the oldest segment in flight,
+        //so it is only restarted when nothing else is waiting for an ACK
+        if (_unAckLen == 0) {
+            _timer=_rto;
+            //added on 01/07/2017
+            _nrtx=0;
+        }
+        //time this segment for the RTT estimate, unless another one is being timed already
+        if (!_rttTiming) {
+            _rttTiming = true;
+            _rttSeqNum = sequenceNum + length;
+            _rttTicks = 0;
+        }
         _unAckLen+=length;
-        _timer=_rto;
-        //added on 01/07/2017
-        _nrtx=0;
     }
 
 }
 
+void TCPClient::retransmitBuffer()
+{
+    IPv6Packet& packet = _ether.packet();
+    struct tcp_header *tcpHeader = TCP_HEADER_PTR;
+    uint16_t maxLength = maxPayloadLength();
+
+    for (uint16_t offset = 0; offset < _unAckLen; ) {
+        uint16_t length = _unAckLen - offset;
+        if (length > maxLength) length = maxLength;
+
+        preparePacket(false);
+        tcpHeader->flags = TCP_FLAG_ACK;
+        tcpHeader->dataOffset = 6<<4;
+
+        uint16_t pos = (_sendBufferStart + offset) % _sendBufferSize;
+        uint16_t first = _sendBufferSize - pos;
+        if (first > length) first = length;
+        memcpy(transmitPayload(), _sendBuffer + pos, first);
+        memcpy(transmitPayload() + first, _sendBuffer, length - first);
+
+        packet.setPayloadLength(((tcpHeader->dataOffset & 0xF0)>>2) + length);
+        fillTCPHeader(_localSeqNum + offset);
+        _ether.send();
+
+        offset += length;
+
+        //don't send more than the server can receive
+        if (offset >= _remoteWindow) break;
+    }
+}
+
+void TCPClient::setSendBuffer(uint8_t *buffer, uint16_t size)
+{
+    _sendBuffer = buffer;
+    _sendBufferSize = size;
+    _sendBufferStart = 0;
+}
+
+uint16_t TCPClient::sendSpace()
+{
+    uint16_t space;
+
+    if (!connected() || _unAckLen >= _remoteWindow) {
+        return 0;
+    }
+
+    if (_sendBuffer) {
+        space = _sendBufferSize - _unAckLen;
+    } else {
+        //stop-and-wait: the last segment has to be acknowledged first
+        space = _unAckLen ? 0 : 0xFFFF;
+    }
+
+    if (space > _remoteWindow - _unAckLen) {
+        space = _remoteWindow - _unAckLen;
+    }
+    if (space > maxPayloadLength()) {
+        space = maxPayloadLength();
+    }
+
+    return space;
+}
+
 uint8_t* TCPClient::payload()
 {
     IPv6Packet& packet = _ether.packet();
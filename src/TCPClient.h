@@ -14,6 +14,9 @@
 //the periodic time out expressed in ms
 #define PERIODIC_TIME_OUT 250
 
+//the time out expressed in ms after which reset() tells the application that nothing has happened
+#define TCP_INACTIVITY_TIME_OUT 600000UL
+
 /**
  * Class for open a TCP connection to a client
  *
@@ -29,6 +32,11 @@ public:
      */
     TCPClient(EtherSia &ether);
 
+    /**
+     * Destroy the TCP client, stopping its periodic timer
+     */
+    ~TCPClient();
+
     /**
      * Check if a TCP data packet is available for this client
      *
@@ -68,6 +76,40 @@ public:
      */
     void connect();
 
+    /**
+     * Keep a copy of sent data, so that several segments can be sent before they are acknowledged
+     *
+     * Without a send buffer, only one segment can be unacknowledged at a time and
+     * the application has to send it again when rexmit() returns true.
+     * With a send buffer, data can be sent until the buffer or the server's
+     * receive window is full, and lost segments are retransmitted automatically.
+     *
+     * @param buffer The memory to keep unacknowledged data in (must stay valid while the client is in use)
+     * @param size The size of the buffer in bytes
+     */
+    void setSendBuffer(uint8_t *buffer, uint16_t size);
+
+    /**
+     * Get the number of bytes that can be sent now
+     *
+     * This is limited by the server's receive window, the free space in the
+     * send buffer (or one segment at a time without a send buffer)
+     * and the maximum payload length.
+     *
+     * @return The number of bytes, or 0 if nothing can be sent until more data is acknowledged
+     */
+    uint16_t sendSpace();
+
+    /**
+     * Get the number of bytes that the last call to send() actually sent
+     *
+     * Data beyond the server's receive window or the free space in the
+     * send buffer is not sent. Nothing is sent if none of it fits.
+     *
+     * @return The number of bytes sent, which may be less than requested (or 0)
+     */
+    uint16_t sentLength(){return _sentLength;}
+
     /**
      * Check if client has successfully connected to the server
      *
@@ -155,13 +197,49 @@ protected:
         UIP_MAXSYNRTX = 5,//the max number of times a SYN segment should be sent before connection abortion
     };
 	
+    /**
+     * Called by EtherSia::poll() every PERIODIC_TIME_OUT milliseconds
+     *
+     * @param client The TCPClient that set the timer
+     */
+    static void periodicTimer(void *client);
+
+    /**
+     * count down the retransmission timer, retransmit when it expires,
+     * check for inactivity and set the periodic timer again
+     */
+    void periodic();
+
+    /**
+     * retransmit the oldest unacknowledged segment, with an exponential backoff,
+     * or send a RST if it has been retransmitted too many times
+     */
+    void retransmit();
+
+    /**
+     * send an empty segment to make the server report its receive window, while it is closed
+     */
+    void sendWindowProbe();
+
+    /**
+     * send a segment without data, using the flags and dataOffset already in the TCP header
+     */
+    void sendNoData();
+
     /**
      * sets all numbers (ports, sequence) in TCP header 
      * sets window size, checksum, urgent pointer and options if any
      * @note dataOffset should have been set before any call to this methodIn havePacket()It 
      * @note fixes the protocol in the IP header - does not fix payloadLength in the IP header
+     * @param sequenceNum the sequence number of the segment
+     */
+    void fillTCPHeader(uint32_t sequenceNum);
+
+    /**
+     * send all the unacknowledged data in the send buffer again (go-back-N)
+     * at least one segment is sent, even if the server's receive window is closed
      */
-    void fillTCPHeader(); 
+    void retransmitBuffer();
 
     /**
      * Protocol specific function that is called by send(), sendReply() etc.
@@ -176,8 +254,21 @@ protected:
 
     uint8_t _state;
     uint8_t _appliFlags;
+    //the application flags raised by periodic(), passed on by the next havePacket()
+    uint8_t _timerFlags;
     uint16_t _unAckLen;
 
+    //the receive window advertised by the server
+    uint16_t _remoteWindow;
+
+    //the number of bytes accepted by the last send()
+    uint16_t _sentLength;
+
+    //the unacknowledged data, starting at _localSeqNum (NULL = stop-and-wait)
+    uint8_t *_sendBuffer;
+    uint16_t _sendBufferSize;
+    uint16_t _sendBufferStart;
+
     //the 2 periodic timers
     uint32_t _inactivity;
     uint32_t _periodic;
@@ -189,6 +280,15 @@ protected:
     uint8_t _sa;
     uint8_t _sv;
 
+    //the end of the segment being timed for the RTT estimate, and the periodic ticks since it was sent
+    uint32_t _rttSeqNum;
+    uint8_t _rttTicks;
+    boolean _rttTiming;
+
+    //the persist timer, that probes the server's receive window while it is closed
+    uint8_t _persistTimer;
+    uint8_t _persistCount;
+
     // the number of retransmissions for the last segment sent...
     uint8_t _nrtx;
 
@@ -84,7 +84,7 @@ void TCPServer::sendInternal(uint16_t length, boolean /*isReply*/)
 
     tcpHeader->mssOptionKind = 2;
     tcpHeader->mssOptionLen = 4;
-    tcpHeader->mssOptionValue = tcpHeader->window;
+    tcpHeader->mssOptionValue = htons(_ether.tcpMaxSegmentSize(packet.destination()));
 
     packet.setPayloadLength(TCP_TRANSMIT_HEADER_LEN + length);
 
@@ -4,12 +4,29 @@
 #define TFTP_DEBUG(str)
 //#define TFTP_DEBUG(str) Serial.println(F(str))
 
-TFTPServer::TFTPServer(EtherSia &ether, uint16_t localPort) : UDPSocket(ether, localPort)
+TFTPServer::TFTPServer(EtherSia &ether, uint16_t localPort) : UDPSocket(ether, localPort), _data(ether)
 {
+    _fileno = 0;
+    _timerSet = false;
+}
+
+TFTPServer::~TFTPServer()
+{
+    _ether.cancelTimer(timeoutTimer, this);
 }
 
 boolean TFTPServer::handleRequest()
 {
+    if (transferInProgress() && !_timerSet && (long)(millis() - _deadline) >= 0) {
+        // There was no free timer, so the timeout is checked here instead
+        timeout();
+    }
+
+    if (transferInProgress() && _data.havePacket()) {
+        handleTransferPacket();
+        return true;
+    }
+
     if (!havePacket()) {
         // No packet, or it isn't for us
         return false;
@@ -17,6 +34,12 @@ boolean TFTPServer::handleRequest()
 
     uint8_t *payload = this->payload();
     if ((payload[0] == 0x00) && (payload[1] == TFTP_OPCODE_READ || payload[1] == TFTP_OPCODE_WRITE)) {
+        if (transferInProgress()) {
+            TFTP_DEBUG("TFTP: Error, a transfer is already in progress");
+            sendError(TFTP_UNDEFINED_ERROR);
+            return true;
+        }
+
         const char* filename = (char*)(&payload[2]);
         int8_t fileno = openFile(filename);
         if (fileno <= 0) {
@@ -42,121 +65,140 @@ boolean TFTPServer::handleRequest()
 
 void TFTPServer::handleWriteRequest(int8_t fileno, IPv6Address& address, uint16_t port)
 {
-    UDPSocket data(_ether);
-    data.setRemoteAddress(address, port);
+    // Each transfer gets a new local port number (Transfer ID)
+    if (!_data.setRemoteAddress(address, port)) {
+        _data.releaseLocalPort();
+        return;
+    }
+
+    _fileno = fileno;
+    _writing = true;
+    _block = 1;
 
     // Acknowledge the request / Start the transfer
-    sendAck(data, 0);
-
-    uint32_t timeout = millis() + TFTP_DATA_TIMEOUT;
-    uint16_t expectedBlock = 1;
-    while (1) {
-        _ether.receivePacket();
-
-        if (data.havePacket()) {
-            uint8_t *payload = data.payload();
-
-            if (payload[0] == 0x00 && payload[1] == TFTP_OPCODE_DATA) {
-                uint16_t len = this->payloadLength() - 4;
-                uint16_t block = bytesToWord(payload[2], payload[3]);
-
-                if (block <= expectedBlock) {
-                    // Acknowledge the current or past blocks (could be a duplicate packet)
-                    // But don't acknowledge future blocks
-                    sendAck(data, block);
-                } else {
-                    TFTP_DEBUG("TFTP: Received out of order block");
-                }
-
-                if (block == expectedBlock) {
-                    writeBytes(fileno, block, &payload[4], len);
-                    expectedBlock++;
-
-                    // Update timeout
-                    timeout = millis() + TFTP_DATA_TIMEOUT;
-
-                    // End of transfer?
-                    if (len != TFTP_BLOCK_SIZE) {
-                        TFTP_DEBUG("TFTP: End of Transfer");
-                        break;
-                    }
-                }
-            }
-        }
+    sendAck(_data, 0);
+    setTimeout(TFTP_DATA_TIMEOUT);
+}
 
-        if ((int32_t)(timeout - millis()) <= 0) {
-            TFTP_DEBUG("TFTP: Write Request Timeout");
-            return;
-        }
+void TFTPServer::handleReadRequest(int8_t fileno, IPv6Address& address, uint16_t port)
+{
+    // Each transfer gets a new local port number (Transfer ID)
+    if (!_data.setRemoteAddress(address, port)) {
+        _data.releaseLocalPort();
+        return;
     }
 
+    _fileno = fileno;
+    _writing = false;
+    _block = 1;
+    _retries = 0;
+    sendData();
 }
 
-void TFTPServer::handleReadRequest(int8_t fileno, IPv6Address& address, uint16_t port)
+void TFTPServer::handleTransferPacket()
 {
-    UDPSocket data(_ether);
-    data.setRemoteAddress(address, port);
-
-    uint8_t retries = 0;
-    for (uint16_t block=1; block<UINT16_MAX;) {
-        uint8_t *payload = data.payload();
-        payload[0] = 0x00;
-        payload[1] = TFTP_OPCODE_DATA;
-        payload[2] = (block & 0xFF00) >> 8;
-        payload[3] = (block & 0xFF);
-
-        uint16_t len = readBytes(fileno, block, &payload[4]);
-        data.send((uint16_t)(len + 4));
-
-        boolean gotAck = waitForAck(data, block);
-        if (gotAck) {
-            block++;
-            retries = 0;
+    uint8_t *payload = _data.payload();
+    uint16_t block = bytesToWord(payload[2], payload[3]);
+
+    if (payload[0] != 0x00) {
+        return;
+    }
+
+    if (_writing && payload[1] == TFTP_OPCODE_DATA) {
+        uint16_t len = _data.payloadLength() - 4;
+
+        if (block <= _block) {
+            // Acknowledge the current or past blocks (could be a duplicate packet)
+            // But don't acknowledge future blocks
+            sendAck(_data, block);
         } else {
-            if (++retries > TFTP_RETRIES) {
-                // Too many retries, abort
-                TFTP_DEBUG("TFTP: abort, too many retries");
-                break;
+            TFTP_DEBUG("TFTP: Received out of order block");
+        }
+
+        if (block == _block) {
+            writeBytes(_fileno, block, &payload[4], len);
+            _block++;
+
+            // End of transfer?
+            if (len != TFTP_BLOCK_SIZE) {
+                TFTP_DEBUG("TFTP: End of Transfer");
+                finishTransfer();
             } else {
-                // Try sending again
-                TFTP_DEBUG("TFTP: ACK timeout, re-sending packet");
-                continue;
+                // Update timeout
+                setTimeout(TFTP_DATA_TIMEOUT);
             }
         }
-
-        if (len < TFTP_BLOCK_SIZE) {
+    } else if (!_writing && payload[1] == TFTP_OPCODE_ACK) {
+        if (block != _block) {
+            // Ack for wrong block
+            retransmit();
+        } else if (_blockLength < TFTP_BLOCK_SIZE) {
             // No more data to send
             TFTP_DEBUG("TFTP: finished sending file");
-            break;
+            finishTransfer();
+        } else {
+            _block++;
+            _retries = 0;
+            sendData();
         }
     }
 }
 
-boolean TFTPServer::waitForAck(UDPSocket &sock, uint16_t expectedBlock)
+void TFTPServer::timeoutTimer(void *server)
 {
-    uint32_t timeout = millis() + TFTP_ACK_TIMEOUT;
-
-    do {
-        _ether.receivePacket();
-
-        if (sock.havePacket()) {
-            uint8_t *payload = sock.payload();
-            if (payload[0] == 0x00 && payload[1] == TFTP_OPCODE_ACK) {
-                uint16_t recievedBlock = bytesToWord(payload[2], payload[3]);
-                if (recievedBlock != expectedBlock) {
-                    // Ack for wrong block
-                    return false;
-                } else {
-                    // Got correct Ack
-                    return true;
-                }
-            }
-        }
+    ((TFTPServer*)server)->timeout();
+}
+
+void TFTPServer::setTimeout(uint16_t delay)
+{
+    _deadline = millis() + delay;
+    _timerSet = _ether.setTimer(timeoutTimer, this, delay);
+}
+
+void TFTPServer::timeout()
+{
+    if (_writing) {
+        TFTP_DEBUG("TFTP: Write Request Timeout");
+        finishTransfer();
+    } else {
+        TFTP_DEBUG("TFTP: ACK timeout, re-sending packet");
+        retransmit();
+    }
+}
 
-    } while ((int32_t)(timeout - millis()) > 0);
+void TFTPServer::retransmit()
+{
+    if (++_retries > TFTP_RETRIES) {
+        // Too many retries, abort
+        TFTP_DEBUG("TFTP: abort, too many retries");
+        finishTransfer();
+    } else {
+        // Try sending again
+        sendData();
+    }
+}
+
+void TFTPServer::sendData()
+{
+    uint8_t *payload = _data.payload();
+    payload[0] = 0x00;
+    payload[1] = TFTP_OPCODE_DATA;
+    payload[2] = (_block & 0xFF00) >> 8;
+    payload[3] = (_block & 0xFF);
+
+    _blockLength = readBytes(_fileno, _block, &payload[4]);
+    _data.send((uint16_t)(_blockLength + 4));
+
+    setTimeout(TFTP_ACK_TIMEOUT);
+}
+
+void TFTPServer::finishTransfer()
+{
+    _ether.cancelTimer(timeoutTimer, this);
+    _fileno = 0;
 
-    // Timed out, nothing received
-    return false;
+    // The next transfer gets a new local port number
+    _data.releaseLocalPort();
 }
 
 void TFTPServer::sendAck(UDPSocket &sock, uint16_t block)
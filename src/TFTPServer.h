@@ -19,8 +19,9 @@
  * - writeBytes()
  * - readBytes()
  *
- * Warning: after a read or write request is initiated other packets are
- * ignored until the transfer is complete.
+ * Transfers run in the background: handleRequest() processes the packets
+ * and EtherSia::poll() runs the timeouts and retransmissions. Only one
+ * transfer can be in progress at a time, other requests get an error.
  *
  */
 class TFTPServer: public UDPSocket {
@@ -35,6 +36,11 @@ public:
      */
     TFTPServer(EtherSia &ether, uint16_t localPort=69);
 
+    /**
+     * Destroy the TFTP server, stopping its timer
+     */
+    ~TFTPServer();
+
     /**
      * Handle TFTP packets
      *
@@ -44,6 +50,15 @@ public:
      */
     boolean handleRequest();
 
+    /**
+     * Check if a read or write transfer is in progress
+     *
+     * @return true if a transfer has been started and not finished yet
+     */
+    boolean transferInProgress() {
+        return _fileno > 0;
+    }
+
 
     /// The maximum size of payload in a DATA packet
     const uint16_t TFTP_BLOCK_SIZE = 512;
@@ -117,10 +132,74 @@ protected:
     void handleWriteRequest(int8_t fileno, IPv6Address& address, uint16_t port);
     void handleReadRequest(int8_t fileno, IPv6Address& address, uint16_t port);
 
-    boolean waitForAck(UDPSocket &sock, uint16_t expectedBlock);
+    /**
+     * Process a DATA or ACK packet for the transfer in progress
+     */
+    void handleTransferPacket();
+
+    /**
+     * Called by EtherSia::poll() when the transfer in progress times out
+     *
+     * @param server The TFTPServer that set the timer
+     */
+    static void timeoutTimer(void *server);
+
+    /**
+     * Set the timeout of the transfer in progress
+     *
+     * If there is no free timer, handleRequest() checks the deadline instead.
+     *
+     * @param delay The time to wait (in milliseconds)
+     */
+    void setTimeout(uint16_t delay);
+
+    /**
+     * Send the current DATA block again or give up on a write, when the transfer times out
+     */
+    void timeout();
+
+    /**
+     * Send the current DATA block again, or give up after TFTP_RETRIES
+     */
+    void retransmit();
+
+    /**
+     * Read and send the current DATA block, and wait for its ACK
+     */
+    void sendData();
+
+    /**
+     * Stop the transfer in progress
+     */
+    void finishTransfer();
+
     void sendAck(UDPSocket &sock, uint16_t block);
     void sendError(uint8_t errorCode);
 
+    /// The socket for the transfer in progress
+    UDPSocket _data;
+
+    /// The file being transferred (0 = no transfer in progress)
+    int8_t _fileno;
+
+    /// Set to true if the transfer in progress is a write request
+    boolean _writing;
+
+    /// The block being sent (read) or the next block expected (write)
+    uint16_t _block;
+
+    /// The length of the last DATA block sent
+    uint16_t _blockLength;
+
+    /// The number of times the current DATA block has been sent again
+    uint8_t _retries;
+
+    /// The time (in milliseconds) that the transfer in progress times out
+    unsigned long _deadline;
+
+    /// Set to true if EtherSia::poll() runs the timeout, false if handleRequest() has to check it
+    boolean _timerSet;
+
 };
 
 
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2017, Nicholas Humfrey
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#if !defined(ARDUINO) && defined(__linux__)
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+
+#include "Tap.h"
+#include "util.h"
+
+/*
+ * The virtio-net header that prefixes each frame when IFF_VNET_HDR is used
+ * (linux/virtio_net.h can't be included from C++, so it is defined here)
+ */
+struct tap_vnet_header {
+    uint8_t flags;
+    uint8_t gsoType;
+    uint16_t hdrLen;
+    uint16_t gsoSize;
+    uint16_t csumStart;
+    uint16_t csumOffset;
+} __attribute__((__packed__));
+
+/** The checksum of the frame needs to be completed, using csumStart and csumOffset */
+#define TAP_VNET_F_NEEDS_CSUM   (1)
+
+
+EtherSia_Tap::EtherSia_Tap(const char* ifname, uint8_t flags, uint8_t queues)
+{
+    memset(this->ifname, 0, sizeof(this->ifname));
+    strncpy(this->ifname, ifname, sizeof(this->ifname)-1);
+    tapFlags = flags;
+
+    if (queues < 1)
+        queues = 1;
+    if (queues > ETHERSIA_TAP_MAX_QUEUES)
+        queues = ETHERSIA_TAP_MAX_QUEUES;
+    if (!(flags & TAP_FLAG_MULTI_QUEUE))
+        queues = 1;
+    wantedQueues = queues;
+
+    numQueues = 0;
+    nextQueue = 0;
+    for (uint8_t i=0; i<ETHERSIA_TAP_MAX_QUEUES; i++) {
+        tapfd[i] = -1;
+    }
+}
+
+int
+EtherSia_Tap::openQueue()
+{
+    struct ifreq ifr;
+    int fd;
+
+    if ((fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK)) == -1) {
+        perror("open(/dev/net/tun)");
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ-1);
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    if (tapFlags & TAP_FLAG_MULTI_QUEUE)
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    if (tapFlags & TAP_FLAG_VNET_HDR)
+        ifr.ifr_flags |= IFF_VNET_HDR;
+
+    if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
+        perror("ioctl(TUNSETIFF)");
+        close(fd);
+        return -1;
+    }
+
+    // The kernel may have picked the name for us (eg if it contained %d)
+    strncpy(ifname, ifr.ifr_name, IFNAMSIZ-1);
+
+    if (tapFlags & TAP_FLAG_VNET_HDR) {
+        int hdrsize = sizeof(struct tap_vnet_header);
+        if (ioctl(fd, TUNSETVNETHDRSZ, &hdrsize) == -1) {
+            perror("ioctl(TUNSETVNETHDRSZ)");
+            close(fd);
+            return -1;
+        }
+
+        // Allow the kernel to hand us frames without a completed checksum
+        if (ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM) == -1) {
+            perror("ioctl(TUNSETOFFLOAD)");
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+boolean
+EtherSia_Tap::begin(const MACAddress &address)
+{
+    _localMac = address;
+
+    for (uint8_t i=0; i<wantedQueues; i++) {
+        int fd = openQueue();
+        if (fd == -1) {
+            end();
+            return false;
+        }
+        tapfd[numQueues++] = fd;
+    }
+
+    /* Bring the interface up, if it isn't already */
+    int sockfd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sockfd != -1) {
+        struct ifreq ifopts;
+        memset(&ifopts, 0, sizeof(ifopts));
+        strncpy(ifopts.ifr_name, ifname, IFNAMSIZ-1);
+        if (ioctl(sockfd, SIOCGIFFLAGS, &ifopts) == 0 && !(ifopts.ifr_flags & IFF_UP)) {
+            ifopts.ifr_flags |= IFF_UP;
+            if (ioctl(sockfd, SIOCSIFFLAGS, &ifopts) == -1) {
+                perror("ioctl(SIOCSIFFLAGS)");
+            }
+        }
+        close(sockfd);
+    }
+
+    return EtherSia::begin();
+}
+
+int
+EtherSia_Tap::queueFd(uint8_t queue)
+{
+    if (queue >= numQueues)
+        return -1;
+
+    return tapfd[queue];
+}
+
+/*---------------------------------------------------------------------------*/
+
+uint16_t
+EtherSia_Tap::sendFrame(const uint8_t *data, uint16_t datalen)
+{
+    struct tap_vnet_header vnet;
+    struct iovec iov[2];
+    int iovcnt = 0;
+    int result;
+
+    if (numQueues == 0)
+        return 0;
+
+    if (tapFlags & TAP_FLAG_VNET_HDR) {
+        // Checksums are always calculated by EtherSia, so no offload flags are needed
+        memset(&vnet, 0, sizeof(vnet));
+        iov[iovcnt].iov_base = &vnet;
+        iov[iovcnt].iov_len = sizeof(vnet);
+        iovcnt++;
+    }
+
+    iov[iovcnt].iov_base = (void*)data;
+    iov[iovcnt].iov_len = datalen;
+    iovcnt++;
+
+    /* Frames are always sent on the first queue */
+    result = writev(tapfd[0], iov, iovcnt);
+    if (result <= 0) {
+        perror("writev");
+        return 0;
+    }
+
+    if (tapFlags & TAP_FLAG_VNET_HDR)
+        result -= sizeof(vnet);
+
+    return result;
+}
+
+/*---------------------------------------------------------------------------*/
+
+uint16_t
+EtherSia_Tap::readFrame(uint8_t *buffer, uint16_t bufsize)
+{
+    struct tap_vnet_header vnet;
+    struct iovec iov[2];
+    int iovcnt = 0;
+    int result = 0;
+
+    if (tapFlags & TAP_FLAG_VNET_HDR) {
+        iov[iovcnt].iov_base = &vnet;
+        iov[iovcnt].iov_len = sizeof(vnet);
+        iovcnt++;
+    }
+
+    iov[iovcnt].iov_base = buffer;
+    iov[iovcnt].iov_len = bufsize;
+    iovcnt++;
+
+    // Poll each of the queues in turn, starting after the last one read from
+    for (uint8_t i=0; i<numQueues; i++) {
+        int fd = tapfd[nextQueue];
+        nextQueue = (nextQueue + 1) % numQueues;
+
+        result = readv(fd, iov, iovcnt);
+        if (result > 0) {
+            break;
+        } else if (result < 0 && errno != EAGAIN) {
+            perror("Failed to read");
+        }
+    }
+
+    if (result <= 0)
+        return 0;
+
+    if (tapFlags & TAP_FLAG_VNET_HDR) {
+        result -= sizeof(vnet);
+        if (result <= 0)
+            return 0;
+
+        if (vnet.flags & TAP_VNET_F_NEEDS_CSUM) {
+            // The kernel has only filled in the pseudo-header part of the checksum
+            // Sum the rest of the segment from csum_start to complete it
+            uint16_t start = vnet.csumStart;
+            uint16_t offset = start + vnet.csumOffset;
+            if (offset + 2 > result) {
+                return 0;
+            }
+
+            uint16_t sum = ~chksum(0, &buffer[start], result - start);
+            if (sum == 0)
+                sum = 0xffff;
+            buffer[offset] = sum >> 8;
+            buffer[offset + 1] = sum & 0xff;
+        }
+    }
+
+    return result;
+}
+
+void
+EtherSia_Tap::end()
+{
+    for (uint8_t i=0; i<numQueues; i++) {
+        if (tapfd[i] >= 0) {
+            close(tapfd[i]);
+            tapfd[i] = -1;
+        }
+    }
+    numQueues = 0;
+    nextQueue = 0;
+}
+
+#endif
@@ -0,0 +1,119 @@
+/**
+ * Header file for using EtherSia with a TAP device on Linux
+ * @file Tap.h
+ */
+
+#ifndef TAP_H
+#define TAP_H
+
+#include <net/if.h>
+
+#include "EtherSia.h"
+
+/** The maximum number of queues that can be attached to a multi-queue TAP device */
+#define ETHERSIA_TAP_MAX_QUEUES     (8)
+
+/** Flags to enable optional features of the TAP device */
+enum tap_flags {
+    TAP_FLAG_MULTI_QUEUE = 0x01,  ///< Open the device with IFF_MULTI_QUEUE
+    TAP_FLAG_VNET_HDR = 0x02      ///< Use a virtio-net header and enable checksum offload
+};
+
+/**
+ * Run EtherSia on Linux using a TAP device (/dev/net/tun) to send and receive Ethernet frames
+ * Not intended for use with running EtherSia on Arduino.
+ *
+ * Unlike EtherSia_LinuxSocket, a TAP device does not need promiscuous mode or
+ * a physical interface. If the device has been created in advance with:
+ *
+ *     sudo ip tuntap add dev tap0 mode tap user $USER
+ *     sudo ip link set tap0 up
+ *
+ * then EtherSia can be run without root privileges, and the Linux kernel's own
+ * IPv6 stack on the other end of the device can be used to talk to EtherSia.
+ *
+ * @note this is probably only useful for testing and development of EtherSia.
+ */
+class EtherSia_Tap : public EtherSia {
+
+public:
+    /**
+     * Constructor
+     * @param iface the name of the TAP device to create or attach to
+     * @param flags a bitmask of tap_flags values
+     * @param queues the number of queues to open (requires TAP_FLAG_MULTI_QUEUE if more than 1)
+     */
+    EtherSia_Tap(const char* iface = "tap0", uint8_t flags = 0, uint8_t queues = 1);
+
+    // Tell the compiler we want to use begin() from the base class
+    using EtherSia::begin;
+
+    /**
+     * Open the TAP device
+     * Must be called before sending or receiving Ethernet frames
+     *
+     * @param address the local MAC address for EtherSia to use on the device
+     * @return Returns true if setting up the TAP device was successful
+     */
+    virtual boolean begin(const MACAddress &address);
+
+    /**
+     * Send an Ethernet frame
+     * @param data a pointer to the data to send
+     * @param datalen the length of the data in the packet
+     * @return the number of bytes transmitted
+     */
+    virtual uint16_t sendFrame(const uint8_t *data, uint16_t datalen);
+
+    /**
+     * Read an Ethernet frame
+     *
+     * If more than one queue is open, then the queues are polled in turn.
+     *
+     * @param buffer a pointer to a buffer to write the packet to
+     * @param bufsize the available space in the buffer
+     * @return the length of the received packet
+     *         or 0 if no packet was received
+     */
+    virtual uint16_t readFrame(uint8_t *buffer, uint16_t bufsize);
+
+    /**
+     * Get the number of queues that are open on the TAP device
+     * @return the number of open queues
+     */
+    inline uint8_t queueCount() {
+        return numQueues;
+    }
+
+    /**
+     * Get the file descriptor for one of the queues of the TAP device
+     *
+     * This can be used to hand a queue to a separate worker thread.
+     *
+     * @param queue the queue number (starting at 0)
+     * @return the file descriptor or -1 if the queue isn't open
+     */
+    int queueFd(uint8_t queue = 0);
+
+    /**
+     * Close the TAP device
+     */
+    virtual void end();
+
+protected:
+
+    /**
+     * Open a single queue on the TAP device
+     * @return the file descriptor for the queue or -1 on failure
+     */
+    int openQueue();
+
+    char ifname[IFNAMSIZ];
+    uint8_t tapFlags;
+    uint8_t numQueues;
+    uint8_t wantedQueues;
+    uint8_t nextQueue;
+    int tapfd[ETHERSIA_TAP_MAX_QUEUES];
+};
+
+#endif /* TAP_H */
@@ -3,20 +3,168 @@
 
 UDPSocket::UDPSocket(EtherSia &ether) : Socket(ether)
 {
+    _queue = NULL;
+    _queueSize = 0;
+    _queueStart = 0;
+    _queueUsed = 0;
+    _queueCount = 0;
 }
 
 UDPSocket::UDPSocket(EtherSia &ether, uint16_t localPort) : Socket(ether, localPort)
 {
+    _queue = NULL;
+    _queueSize = 0;
+    _queueStart = 0;
+    _queueUsed = 0;
+    _queueCount = 0;
+}
+
+UDPSocket::~UDPSocket()
+{
+    leaveMulticastGroup();
+
+    if (_queue) {
+        _ether.removeReceiveQueue(this);
+    }
+}
+
+boolean UDPSocket::setMulticastGroup(const char *group, uint16_t port)
+{
+    IPv6Address addr(group);
+    return setMulticastGroup(addr, port);
+}
+
+boolean UDPSocket::setMulticastGroup(IPv6Address &group, uint16_t port)
+{
+    if (!_ether.joinGroup(group)) {
+        return false;
+    }
+
+    // Leave the group that the socket was bound to before, now that the new one has been joined
+    leaveMulticastGroup();
+
+    _ether.releasePort(_localPort);
+    _localPort = port;
+    _ether.reservePort(port);
+    return setRemoteAddress(group, port);
+}
+
+void UDPSocket::leaveMulticastGroup()
+{
+    if (_remoteAddress.isMulticast()) {
+        _ether.leaveGroup(_remoteAddress);
+        _remoteAddress.setZero();
+        _remotePort = 0;
+    }
+}
+
+boolean UDPSocket::setReceiveQueue(uint8_t *buffer, uint16_t size)
+{
+    if (!_ether.addReceiveQueue(this)) {
+        return false;
+    }
+
+    _queue = buffer;
+    _queueSize = size;
+    _queueStart = 0;
+    _queueUsed = 0;
+    _queueCount = 0;
+    return true;
+}
+
+void UDPSocket::queueCopy(uint16_t pos, uint8_t *data, uint16_t len, boolean toQueue)
+{
+    pos %= _queueSize;
+
+    // Copy in two parts if the data wraps around the end of the buffer
+    uint16_t first = _queueSize - pos;
+    if (first > len) {
+        first = len;
+    }
+
+    if (toQueue) {
+        memcpy(_queue + pos, data, first);
+        memcpy(_queue, data + first, len - first);
+    } else {
+        memcpy(data, _queue + pos, first);
+        memcpy(data + first, _queue, len - first);
+    }
+}
+
+boolean UDPSocket::queuePacket()
+{
+    IPv6Packet& packet = _ether.packet();
+    struct udp_queue_header header;
+
+    if (!packetMatches()) {
+        return false;
+    }
+
+    header.length = payloadLength();
+    if (UDP_QUEUE_HEADER_LEN + header.length > _queueSize - _queueUsed || _queueCount == 0xFF) {
+        // No space left in the queue - drop the packet
+        return true;
+    }
+
+    header.sourcePort = UDP_HEADER_PTR->sourcePort;
+    header.source = packet.source();
+    header.destination = packet.destination();
+    header.etherSource = packet.etherSource();
+
+    queueCopy(_queueStart + _queueUsed, (uint8_t*)&header, UDP_QUEUE_HEADER_LEN, true);
+    queueCopy(_queueStart + _queueUsed + UDP_QUEUE_HEADER_LEN, payload(), header.length, true);
+    _queueUsed += UDP_QUEUE_HEADER_LEN + header.length;
+    _queueCount++;
+
+    return true;
 }
 
 boolean UDPSocket::havePacket()
 {
     IPv6Packet& packet = _ether.packet();
 
+    if (_queue) {
+        struct udp_queue_header header;
+
+        // Don't overwrite a received packet that another socket may be waiting for
+        if (_queueCount == 0 || _ether.bufferContainsReceived()) {
+            return false;
+        }
+
+        queueCopy(_queueStart, (uint8_t*)&header, UDP_QUEUE_HEADER_LEN, false);
+
+        // Rebuild the packet in the packet buffer, so that it can be used and replied to as normal
+        packet.init();
+        packet.setEtherSource(header.etherSource);
+        packet.setSource(header.source);
+        packet.setDestination(header.destination);
+        packet.setProtocol(IP6_PROTO_UDP);
+        packet.setPayloadLength(UDP_HEADER_LEN + header.length);
+        UDP_HEADER_PTR->sourcePort = header.sourcePort;
+        UDP_HEADER_PTR->destinationPort = htons(_localPort);
+        UDP_HEADER_PTR->length = htons(UDP_HEADER_LEN + header.length);
+        UDP_HEADER_PTR->checksum = 0;
+        queueCopy(_queueStart + UDP_QUEUE_HEADER_LEN, payload(), header.length, false);
+
+        _queueStart = (_queueStart + UDP_QUEUE_HEADER_LEN + header.length) % _queueSize;
+        _queueUsed -= UDP_QUEUE_HEADER_LEN + header.length;
+        _queueCount--;
+
+        _ether.markBufferReceived();
+        return true;
+    }
+
     if (!_ether.bufferContainsReceived()) {
         return false;
     }
 
+    return packetMatches();
+}
+
+boolean UDPSocket::packetMatches()
+{
+    IPv6Packet& packet = _ether.packet();
+
     if (packet.protocol() != IP6_PROTO_UDP) {
         // Wrong protocol
         return false;
@@ -27,12 +175,17 @@ boolean UDPSocket::havePacket()
         return false;
     }
 
+    if (_remoteAddress.isMulticast()) {
+        // Sockets bound to a group accept packets from any member of the group
+        return packet.destination() == _remoteAddress;
+    }
+
     if (_remotePort && packetSourcePort() != _remotePort) {
         // Wrong source port
         return false;
     }
 
-    if (!_ether.isOurAddress(packetDestination())) {
+    if (!_ether.packetDestinationType()) {
         // Wrong destination address
         return false;
     }
@@ -63,11 +216,86 @@ void UDPSocket::sendInternal(uint16_t length, boolean isReply)
     }
     udpHeader->sourcePort = ntohs(_localPort);
     udpHeader->checksum = 0;
-    udpHeader->checksum = htons(packet.calculateChecksum());
+    udpHeader->checksum = htons(packet.calculateChecksum(addressChecksum()));
 
     _ether.send();
 }
 
+uint8_t UDPSocket::sendBatch(const void * const payloads[], const uint16_t lengths[], uint8_t count)
+{
+    IPv6Packet& packet = _ether.packet();
+    struct udp_header *udpHeader = UDP_HEADER_PTR;
+    uint16_t maxLen = maxPayloadLength();
+
+    if (count == 0) {
+        return 0;
+    }
+
+    // Everything apart from the lengths and checksum is the same for every packet
+    preparePacket(false);
+    packet.setProtocol(IP6_PROTO_UDP);
+    udpHeader->destinationPort = ntohs(_remotePort);
+    udpHeader->sourcePort = ntohs(_localPort);
+    uint16_t addressSum = addressChecksum();
+
+    for (uint8_t i = 0; i < count; i++) {
+        uint16_t length = lengths[i] > maxLen ? maxLen : lengths[i];
+        uint16_t totalLen = UDP_HEADER_LEN + length;
+
+        memcpy(payload(), payloads[i], length);
+        packet.setPayloadLength(totalLen);
+        udpHeader->length = htons(totalLen);
+        udpHeader->checksum = 0;
+        udpHeader->checksum = htons(packet.calculateChecksum(addressSum));
+
+        _ether.send();
+    }
+
+    // Let drivers that queue frames send the whole batch together
+    _ether.flush();
+
+    return count;
+}
+
+boolean UDPSocket::sendFragmented(const void *data, uint16_t length, boolean isReply)
+{
+    IPv6Packet& packet = _ether.packet();
+    struct udp_header header;
+    uint16_t totalLen = UDP_HEADER_LEN + length;
+
+    // The whole datagram must fit in a Fragment header's payload
+    if ((uint32_t)IP6_FRAGMENT_HEADER_LEN + UDP_HEADER_LEN + length > 0xFFFF) {
+        return false;
+    }
+
+    header.length = htons(totalLen);
+    if (isReply) {
+        header.destinationPort = UDP_HEADER_PTR->sourcePort;
+    } else {
+        header.destinationPort = ntohs(_remotePort);
+    }
+    header.sourcePort = ntohs(_localPort);
+    header.checksum = 0;
+
+    preparePacket(isReply);
+
+    // The checksum covers the whole datagram, so it can't be calculated one fragment at a time
+    uint16_t sum = totalLen + IP6_PROTO_UDP;
+    uint16_t addressSum = addressChecksum();
+    sum += addressSum;
+    if (sum < addressSum) {
+        sum++;      /* carry */
+    }
+    sum = chksum(sum, (uint8_t *)&header, UDP_HEADER_LEN);
+    sum = chksum(sum, (const uint8_t *)data, length);
+    header.checksum = htons(~sum);
+    if (header.checksum == 0) {
+        header.checksum = 0xFFFF;
+    }
+
+    return _ether.sendFragments(IP6_PROTO_UDP, (uint8_t *)&header, UDP_HEADER_LEN, (const uint8_t *)data, length);
+}
+
 uint16_t UDPSocket::packetSourcePort()
 {
     IPv6Packet& packet = _ether.packet();
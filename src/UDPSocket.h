@@ -35,12 +35,101 @@ public:
      */
     UDPSocket(EtherSia &ether, uint16_t localPort);
 
+    /**
+     * Destroy the UDP socket, detaching its receive queue from the Ethernet interface
+     * and leaving its multicast group
+     */
+    ~UDPSocket();
+
+    /**
+     * Bind the socket to a multicast group
+     *
+     * The group is joined, so that packets sent to it are received, and
+     * it becomes the remote address, so that send() sends to the whole group.
+     * If the socket was already bound to a group, that group is left.
+     * Once bound, havePacket() only accepts packets sent to the group,
+     * from any source address and port.
+     *
+     * @param group The multicast group address, as a C string
+     * @param port The UDP port number to send and receive on
+     * @return true if the group was joined, false if it isn't multicast or the group table is full
+     */
+    boolean setMulticastGroup(const char *group, uint16_t port);
+
+    /**
+     * Bind the socket to a multicast group
+     *
+     * @param group The multicast group address
+     * @param port The UDP port number to send and receive on
+     * @return true if the group was joined, false if it isn't multicast or the group table is full
+     */
+    boolean setMulticastGroup(IPv6Address &group, uint16_t port);
+
+    /**
+     * Leave the multicast group that the socket is bound to
+     *
+     * The remote address is cleared, so that the socket receives unicast packets again.
+     */
+    void leaveMulticastGroup();
+
+    /**
+     * Give the socket a queue to store received packets in, until havePacket() is called
+     *
+     * Without a queue, a packet is lost if havePacket() isn't called before the
+     * next call to receivePacket(). With a queue, receivePacket() copies packets
+     * for this socket into the queue, and havePacket() takes them out again,
+     * one at a time, when the packet buffer isn't holding another received packet.
+     *
+     * Each packet uses UDP_QUEUE_HEADER_LEN bytes plus the length of its payload.
+     * Packets that don't fit in the free space are dropped.
+     *
+     * @param buffer The memory to store the queue in (must stay allocated while the socket is in use)
+     * @param size The size of the buffer in bytes
+     * @return true if the queue was attached, false if ETHERSIA_MAX_RECEIVE_QUEUES sockets already have queues
+     */
+    boolean setReceiveQueue(uint8_t *buffer, uint16_t size);
+
+    /**
+     * Get the number of packets waiting in the receive queue
+     * @return the number of queued packets
+     */
+    inline uint8_t queuedCount() {
+        return _queueCount;
+    }
+
     /**
      * Check if a UDP packet is available to be processed on this socket
+     *
+     * If the socket has a receive queue, the next queued packet is
+     * copied into the packet buffer.
+     *
      * @return true if there is a valid packet has been received for this socket
      */
     boolean havePacket();
 
+    /**
+     * Copy the packet in the buffer into the receive queue, if it is for this socket
+     *
+     * @note This is called by EtherSia::receivePacket(), you don't need to call it
+     * @return true if the packet was for this socket (even if the queue was full)
+     */
+    boolean queuePacket();
+
+    /**
+     * Send several packets to the remote address, one after another
+     *
+     * The Ethernet, IPv6 and UDP headers are only built once, and the partial
+     * checksum of the addresses is re-used, so this is quicker than calling
+     * send() for each payload. Each payload must fit in a single packet,
+     * longer payloads are truncated.
+     *
+     * @param payloads An array of pointers to the payloads to send
+     * @param lengths An array of the lengths (in bytes) of each payload
+     * @param count The number of payloads in the arrays
+     * @return The number of packets sent
+     */
+    uint8_t sendBatch(const void * const payloads[], const uint16_t lengths[], uint8_t count);
+
     /**
      * Get the IPv6 source port number of the last UDP packet received
      *
@@ -75,6 +164,22 @@ public:
 
 protected:
 
+    /**
+     * Check if the received packet in the buffer is for this socket
+     * @return true if the packet matches the ports and addresses of this socket
+     */
+    boolean packetMatches();
+
+    /**
+     * Copy data in or out of the receive queue, wrapping around at the end
+     *
+     * @param pos The position in the queue, which may be past the end of the buffer
+     * @param data The data to copy
+     * @param len The number of bytes to copy
+     * @param toQueue true to copy into the queue, false to copy out of it
+     */
+    void queueCopy(uint16_t pos, uint8_t *data, uint16_t len, boolean toQueue);
+
     /**
      * Send a UDP packet, based on the contents of the buffer.
      * This function:
@@ -88,6 +193,22 @@ protected:
      * @param length The length (in bytes) of the data to send
      */
     void sendInternal(uint16_t length, boolean isReply);
+
+    /**
+     * Send a UDP packet that is too big for the Path MTU, as a series of IPv6 fragments
+     *
+     * @param data The data to send as the payload
+     * @param length The length (in bytes) of the data to send
+     * @param isReply Set to true if this packet is a reply to an incoming packet
+     * @return true if the fragments were sent
+     */
+    boolean sendFragmented(const void *data, uint16_t length, boolean isReply);
+
+    uint8_t *_queue;          ///< The buffer for queued packets (NULL if there is no queue)
+    uint16_t _queueSize;      ///< The size of the queue buffer
+    uint16_t _queueStart;     ///< The position of the oldest packet in the queue
+    uint16_t _queueUsed;      ///< The number of bytes used in the queue
+    uint8_t _queueCount;      ///< The number of packets in the queue
 };
 
 
@@ -118,5 +239,25 @@ struct udp_header {
 /* Verify that compiler gets the structure size correct */
 static_assert(sizeof(struct udp_header) == UDP_HEADER_LEN, "Size is not correct");
 
+/**
+ * Structure stored in front of each packet in a UDP receive queue
+ * @private
+ */
+struct udp_queue_header {
+    uint16_t length;            ///< The length of the UDP payload
+    uint16_t sourcePort;        ///< The source port (network byte order)
+    IPv6Address source;         ///< The IPv6 source address
+    IPv6Address destination;    ///< The IPv6 destination address
+    MACAddress etherSource;     ///< The Ethernet source address, for sending replies
+} __attribute__((__packed__));
+
+/**
+ * The number of bytes stored in a UDP receive queue for each packet, as well as its payload
+ */
+#define UDP_QUEUE_HEADER_LEN      (42)
+
+/* Verify that compiler gets the structure size correct */
+static_assert(sizeof(struct udp_queue_header) == UDP_QUEUE_HEADER_LEN, "Size is not correct");
+
 
 #endif
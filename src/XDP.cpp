@@ -0,0 +1,481 @@
+/*
+ * Copyright (c) 2017, Nicholas Humfrey
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#if !defined(ARDUINO) && defined(__linux__)
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <net/if.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#include "XDP.h"
+
+
+/** Load a value written by the kernel into a ring index */
+#define RING_LOAD(ptr)          __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+
+/** Publish a new ring index to the kernel */
+#define RING_STORE(ptr, val)    __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+/** Mask for converting a ring index into an entry number */
+#define RING_MASK               (ETHERSIA_XDP_RING_SIZE - 1)
+
+static int bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static struct bpf_insn bpfInsn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+    struct bpf_insn insn;
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = off;
+    insn.imm = imm;
+    return insn;
+}
+
+
+EtherSia_XDP::EtherSia_XDP(const char* ifname, uint32_t queue)
+{
+    memset(this->ifname, 0, sizeof(this->ifname));
+    if (ifname) {
+        strncpy(this->ifname, ifname, sizeof(this->ifname)-1);
+    }
+    queueId = queue;
+    ifindex = -1;
+    xskfd = -1;
+    mapfd = -1;
+    progfd = -1;
+    linkfd = -1;
+    zeroCopy = false;
+    umem = NULL;
+    txFreeCount = 0;
+    txPending = 0;
+    memset(&rx, 0, sizeof(rx));
+    memset(&tx, 0, sizeof(tx));
+    memset(&fill, 0, sizeof(fill));
+    memset(&comp, 0, sizeof(comp));
+}
+
+
+boolean
+EtherSia_XDP::loadProgram()
+{
+    union bpf_attr attr;
+    char license[] = "Dual BSD/GPL";
+
+    /* Create the map of queue number to AF_XDP socket */
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = queueId + 1;
+    mapfd = bpf(BPF_MAP_CREATE, &attr);
+    if (mapfd < 0) {
+        perror("bpf(BPF_MAP_CREATE)");
+        return false;
+    }
+
+    /*
+     * The XDP program:
+     *   if (data + ETHER_HEADER_LEN > data_end) return XDP_PASS;
+     *   if (ethertype != ETHER_TYPE_IPV6) return XDP_PASS;
+     *   return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+     */
+    struct bpf_insn insns[] = {
+        bpfInsn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data), 0),
+        bpfInsn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end), 0),
+        bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+        bpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETHER_HEADER_LEN),
+        bpfInsn(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 8, 0),
+        bpfInsn(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2, 12, 0),
+        bpfInsn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 6, htons(ETHER_TYPE_IPV6)),
+        bpfInsn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, rx_queue_index), 0),
+        bpfInsn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, mapfd),
+        bpfInsn(0, 0, 0, 0, 0),
+        bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+        bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+        bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+    };
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (uint64_t)(uintptr_t)insns;
+    attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+    attr.license = (uint64_t)(uintptr_t)license;
+    progfd = bpf(BPF_PROG_LOAD, &attr);
+    if (progfd < 0) {
+        perror("bpf(BPF_PROG_LOAD)");
+        return false;
+    }
+
+    /* Attach using the driver's native XDP support, falling back to generic XDP */
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = progfd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+    linkfd = bpf(BPF_LINK_CREATE, &attr);
+    if (linkfd < 0) {
+        attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+        linkfd = bpf(BPF_LINK_CREATE, &attr);
+        if (linkfd < 0) {
+            perror("bpf(BPF_LINK_CREATE)");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+boolean
+EtherSia_XDP::createUmem()
+{
+    struct xdp_umem_reg reg;
+    size_t len = ETHERSIA_XDP_NUM_FRAMES * ETHERSIA_XDP_FRAME_SIZE;
+
+    void *area = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) {
+        perror("mmap(UMEM)");
+        return false;
+    }
+    umem = (uint8_t*)area;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uint64_t)(uintptr_t)umem;
+    reg.len = len;
+    reg.chunk_size = ETHERSIA_XDP_FRAME_SIZE;
+    reg.headroom = 0;
+    if (setsockopt(xskfd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1) {
+        perror("setsockopt(XDP_UMEM_REG)");
+        return false;
+    }
+
+    return true;
+}
+
+boolean
+EtherSia_XDP::mapRing(struct xdp_ring_state &ring, uint64_t pgoff, const struct xdp_ring_offset &off, size_t entrySize)
+{
+    ring.mapLength = off.desc + ETHERSIA_XDP_RING_SIZE * entrySize;
+    ring.map = mmap(NULL, ring.mapLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xskfd, pgoff);
+    if (ring.map == MAP_FAILED) {
+        perror("mmap(XDP ring)");
+        ring.map = NULL;
+        return false;
+    }
+
+    ring.producer = (uint32_t*)((uint8_t*)ring.map + off.producer);
+    ring.consumer = (uint32_t*)((uint8_t*)ring.map + off.consumer);
+    ring.flags = (uint32_t*)((uint8_t*)ring.map + off.flags);
+    ring.entries = (uint8_t*)ring.map + off.desc;
+
+    return true;
+}
+
+boolean
+EtherSia_XDP::bindSocket(uint16_t flags)
+{
+    struct sockaddr_xdp sxdp;
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = queueId;
+    sxdp.sxdp_flags = flags | XDP_USE_NEED_WAKEUP;
+
+    return bind(xskfd, (struct sockaddr*)&sxdp, sizeof(sxdp)) == 0;
+}
+
+boolean
+EtherSia_XDP::begin(const MACAddress &address)
+{
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    int entries = ETHERSIA_XDP_RING_SIZE;
+
+    _localMac = address;
+
+    ifindex = if_nametoindex(ifname);
+    if (ifindex <= 0) {
+        perror("if_nametoindex");
+        return false;
+    }
+
+    if ((xskfd = socket(AF_XDP, SOCK_RAW, 0)) == -1) {
+        perror("socket(AF_XDP)");
+        return false;
+    }
+
+    if (!createUmem())
+        goto fail;
+
+    /* All the ring sizes must be set before the offsets can be read */
+    if (setsockopt(xskfd, SOL_XDP, XDP_UMEM_FILL_RING, &entries, sizeof(entries)) == -1 ||
+            setsockopt(xskfd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &entries, sizeof(entries)) == -1 ||
+            setsockopt(xskfd, SOL_XDP, XDP_RX_RING, &entries, sizeof(entries)) == -1 ||
+            setsockopt(xskfd, SOL_XDP, XDP_TX_RING, &entries, sizeof(entries)) == -1) {
+        perror("setsockopt(XDP ring size)");
+        goto fail;
+    }
+
+    if (getsockopt(xskfd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1) {
+        perror("getsockopt(XDP_MMAP_OFFSETS)");
+        goto fail;
+    }
+
+    if (!mapRing(fill, XDP_UMEM_PGOFF_FILL_RING, off.fr, sizeof(uint64_t)) ||
+            !mapRing(comp, XDP_UMEM_PGOFF_COMPLETION_RING, off.cr, sizeof(uint64_t)) ||
+            !mapRing(rx, XDP_PGOFF_RX_RING, off.rx, sizeof(struct xdp_desc)) ||
+            !mapRing(tx, XDP_PGOFF_TX_RING, off.tx, sizeof(struct xdp_desc))) {
+        goto fail;
+    }
+
+    /* The first half of the UMEM is used for receiving, the second half for transmitting */
+    for (uint32_t i=0; i<ETHERSIA_XDP_RING_SIZE; i++) {
+        ((uint64_t*)fill.entries)[i] = i * ETHERSIA_XDP_FRAME_SIZE;
+    }
+    RING_STORE(fill.producer, ETHERSIA_XDP_RING_SIZE);
+
+    txFreeCount = 0;
+    txPending = 0;
+    for (uint32_t i=ETHERSIA_XDP_RING_SIZE; i<ETHERSIA_XDP_NUM_FRAMES; i++) {
+        txFree[txFreeCount++] = i * ETHERSIA_XDP_FRAME_SIZE;
+    }
+
+    /* Try zero-copy first, then fall back to copy mode */
+    if (bindSocket(XDP_ZEROCOPY)) {
+        zeroCopy = true;
+    } else if (bindSocket(XDP_COPY)) {
+        zeroCopy = false;
+    } else {
+        perror("bind(AF_XDP)");
+        goto fail;
+    }
+
+    if (!loadProgram())
+        goto fail;
+
+    {
+        union bpf_attr attr;
+        uint32_t key = queueId;
+        uint32_t value = xskfd;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = mapfd;
+        attr.key = (uint64_t)(uintptr_t)&key;
+        attr.value = (uint64_t)(uintptr_t)&value;
+        if (bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+            perror("bpf(BPF_MAP_UPDATE_ELEM)");
+            goto fail;
+        }
+    }
+
+    return EtherSia::begin();
+
+fail:
+    end();
+    return false;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+EtherSia_XDP::kick()
+{
+    // Ask the kernel to process the TX ring
+    if (sendto(xskfd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1) {
+        if (errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN) {
+            perror("sendto(AF_XDP)");
+        }
+    }
+}
+
+void
+EtherSia_XDP::reapCompletions()
+{
+    uint32_t cons = *comp.consumer;
+    uint32_t prod = RING_LOAD(comp.producer);
+
+    while (cons != prod) {
+        txFree[txFreeCount++] = ((uint64_t*)comp.entries)[cons & RING_MASK];
+        cons++;
+    }
+
+    RING_STORE(comp.consumer, cons);
+}
+
+uint16_t
+EtherSia_XDP::sendFrame(const uint8_t *data, uint16_t datalen)
+{
+    if (xskfd < 0 || datalen > ETHERSIA_XDP_FRAME_SIZE)
+        return 0;
+
+    reapCompletions();
+    if (txFreeCount == 0) {
+        // All the frames are in flight - give the kernel a chance to complete some
+        kick();
+        reapCompletions();
+        if (txFreeCount == 0)
+            return 0;
+    }
+
+    uint32_t prod = *tx.producer;
+    uint64_t addr = txFree[--txFreeCount];
+    memcpy(umem + addr, data, datalen);
+
+    struct xdp_desc *desc = &((struct xdp_desc*)tx.entries)[prod & RING_MASK];
+    desc->addr = addr;
+    desc->len = datalen;
+    desc->options = 0;
+    RING_STORE(tx.producer, prod + 1);
+
+    // Wake up the kernel once for a whole batch of frames
+    if (++txPending >= ETHERSIA_XDP_SEND_BATCH)
+        flush();
+
+    return datalen;
+}
+
+void
+EtherSia_XDP::flush()
+{
+    if (xskfd < 0 || txPending == 0)
+        return;
+
+    txPending = 0;
+    if (RING_LOAD(tx.flags) & XDP_RING_NEED_WAKEUP)
+        kick();
+}
+
+/*---------------------------------------------------------------------------*/
+
+uint16_t
+EtherSia_XDP::readFrame(uint8_t *buffer, uint16_t bufsize)
+{
+    if (xskfd < 0)
+        return 0;
+
+    // Send anything queued up since the last call
+    flush();
+
+    uint32_t cons = *rx.consumer;
+    if (cons == RING_LOAD(rx.producer)) {
+        if (RING_LOAD(fill.flags) & XDP_RING_NEED_WAKEUP) {
+            recvfrom(xskfd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+        }
+        return 0;
+    }
+
+    struct xdp_desc *desc = &((struct xdp_desc*)rx.entries)[cons & RING_MASK];
+    uint64_t addr = desc->addr;
+    uint16_t len = desc->len;
+    if (len > bufsize) {
+        // Packet is too big for EtherSia buffer
+        len = 0;
+    } else {
+        memcpy(buffer, umem + addr, len);
+    }
+    RING_STORE(rx.consumer, cons + 1);
+
+    // Hand the frame straight back to the kernel for re-use
+    uint32_t prod = *fill.producer;
+    ((uint64_t*)fill.entries)[prod & RING_MASK] = addr & ~((uint64_t)ETHERSIA_XDP_FRAME_SIZE - 1);
+    RING_STORE(fill.producer, prod + 1);
+
+    return len;
+}
+
+void
+EtherSia_XDP::end()
+{
+    struct xdp_ring_state *rings[] = {&rx, &tx, &fill, &comp};
+
+    // Send any frames that are still waiting in the TX ring
+    flush();
+
+    // Closing the link detaches the XDP program from the interface
+    if (linkfd >= 0) {
+        close(linkfd);
+        linkfd = -1;
+    }
+    if (progfd >= 0) {
+        close(progfd);
+        progfd = -1;
+    }
+    if (mapfd >= 0) {
+        close(mapfd);
+        mapfd = -1;
+    }
+
+    for (uint8_t i=0; i<4; i++) {
+        if (rings[i]->map) {
+            munmap(rings[i]->map, rings[i]->mapLength);
+        }
+        memset(rings[i], 0, sizeof(struct xdp_ring_state));
+    }
+
+    if (xskfd >= 0) {
+        close(xskfd);
+        xskfd = -1;
+    }
+
+    if (umem) {
+        munmap(umem, ETHERSIA_XDP_NUM_FRAMES * ETHERSIA_XDP_FRAME_SIZE);
+        umem = NULL;
+    }
+    txFreeCount = 0;
+}
+
+#endif
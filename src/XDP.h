@@ -0,0 +1,152 @@
+/**
+ * Header file for using EtherSia with an AF_XDP socket on Linux
+ * @file XDP.h
+ */
+
+#ifndef XDP_H
+#define XDP_H
+
+#include <net/if.h>
+#include <linux/if_xdp.h>
+
+#include "EtherSia.h"
+
+/** The number of frames in the shared packet memory area (UMEM) */
+#define ETHERSIA_XDP_NUM_FRAMES     (256)
+
+/** The size of each frame in the UMEM (must be a power of two, 2048 or bigger) */
+#define ETHERSIA_XDP_FRAME_SIZE     (2048)
+
+/** The number of entries in each of the Fill, Completion, RX and TX rings */
+#define ETHERSIA_XDP_RING_SIZE      (ETHERSIA_XDP_NUM_FRAMES / 2)
+
+/** The number of frames waiting in the TX ring that triggers a wakeup of the kernel */
+#define ETHERSIA_XDP_SEND_BATCH     (8)
+
+
+/**
+ * Pointers into one of the four memory mapped AF_XDP rings
+ * @private
+ */
+struct xdp_ring_state {
+    uint32_t *producer;   ///< Index of the next entry to be produced
+    uint32_t *consumer;   ///< Index of the next entry to be consumed
+    uint32_t *flags;      ///< Ring flags (XDP_RING_NEED_WAKEUP)
+    void *entries;        ///< Ring entries (struct xdp_desc or 64-bit addresses)
+    void *map;            ///< Start of the memory mapped area
+    size_t mapLength;     ///< Length of the memory mapped area
+};
+
+
+/**
+ * Run EtherSia on Linux using an AF_XDP socket to send and receive Ethernet frames
+ * Not intended for use with running EtherSia on Arduino.
+ *
+ * A small XDP program is attached to the interface that redirects IPv6 frames
+ * arriving on the chosen queue into the socket; all other frames are passed on
+ * to the kernel. Frames are exchanged with the kernel through memory mapped
+ * rings, so no system calls are needed for each packet sent or received.
+ * When the kernel needs waking up to transmit, it is woken once for a batch of
+ * frames: when readFrame() is next called, or when ETHERSIA_XDP_SEND_BATCH are waiting.
+ *
+ * Zero-copy mode is used if the network driver supports it, otherwise it falls
+ * back to copy mode, which works with any driver (including veth).
+ *
+ * For benchmarking on a veth pair, turn off checksum offload on the peer
+ * interface, otherwise frames arrive with incomplete checksums and are dropped:
+ *
+ *     sudo ip link add veth0 type veth peer name veth1
+ *     sudo ethtool -K veth0 tx off
+ *
+ * Requires Linux 5.9 or newer and the CAP_NET_ADMIN and CAP_BPF capabilities (or root).
+ */
+class EtherSia_XDP : public EtherSia {
+
+public:
+    /**
+     * Constructor
+     * @param iface the name of the Ethernet interface to send/receive on
+     * @param queue the receive queue number of the interface to attach to
+     */
+    EtherSia_XDP(const char* iface = NULL, uint32_t queue = 0);
+
+    // Tell the compiler we want to use begin() from the base class
+    using EtherSia::begin;
+
+    /**
+     * Create the AF_XDP socket and attach the XDP program to the interface
+     * Must be called before sending or receiving Ethernet frames
+     *
+     * @param address the local MAC address for the Ethernet interface
+     * @return Returns true if setting up the Ethernet interface was successful
+     */
+    virtual boolean begin(const MACAddress &address);
+
+    /**
+     * Send an Ethernet frame
+     * @param data a pointer to the data to send
+     * @param datalen the length of the data in the packet
+     * @return the number of bytes transmitted
+     */
+    virtual uint16_t sendFrame(const uint8_t *data, uint16_t datalen);
+
+    /**
+     * Read an Ethernet frame
+     * @param buffer a pointer to a buffer to write the packet to
+     * @param bufsize the available space in the buffer
+     * @return the length of the received packet
+     *         or 0 if no packet was received
+     */
+    virtual uint16_t readFrame(uint8_t *buffer, uint16_t bufsize);
+
+    /**
+     * Wake up the kernel to transmit any frames waiting in the TX ring
+     */
+    virtual void flush();
+
+    /**
+     * Check if the socket is bound in zero-copy mode
+     * @return true for zero-copy mode, false for copy mode
+     */
+    inline boolean isZeroCopy() {
+        return zeroCopy;
+    }
+
+    /**
+     * Detach the XDP program and close the AF_XDP socket
+     */
+    virtual void end();
+
+protected:
+
+    boolean loadProgram();
+    boolean createUmem();
+    boolean mapRing(struct xdp_ring_state &ring, uint64_t pgoff, const struct xdp_ring_offset &offsets, size_t entrySize);
+    boolean bindSocket(uint16_t flags);
+    void reapCompletions();
+    void kick();
+
+    char ifname[IFNAMSIZ];
+    int ifindex;
+    uint32_t queueId;
+    int xskfd;
+    int mapfd;
+    int progfd;
+    int linkfd;
+    boolean zeroCopy;
+
+    uint8_t *umem;
+    struct xdp_ring_state rx;
+    struct xdp_ring_state tx;
+    struct xdp_ring_state fill;
+    struct xdp_ring_state comp;
+
+    /** Stack of UMEM frame addresses that are free for transmitting */
+    uint64_t txFree[ETHERSIA_XDP_NUM_FRAMES / 2];
+    uint16_t txFreeCount;
+
+    /** The number of frames added to the TX ring since the kernel was last woken up */
+    uint16_t txPending;
+};
+
+#endif /* XDP_H */
@@ -141,34 +141,159 @@ IPv6Address* dnsProcessReply(const uint8_t* payload, uint16_t length, uint16_t r
 
 IPv6Address* EtherSia::lookupHostname(const char* hostname)
 {
-    unsigned long nextRequest = millis();
-    uint16_t id = random(65535);
-    uint8_t requestCount = 0;
-    UDPSocket udp(*this);
-
-    udp.setRemoteAddress(_dnsServerAddress, DNS_PORT_NUMBER);
-
-    while (requestCount <= DNS_REQUEST_ATTEMPTS) {
-        // Is it time to send a request packet?
-        if ((long)(millis() - nextRequest) >= 0) {
-            uint16_t len = dnsMakeRequest(udp.payload(), hostname, id);
-            if (len) {
-                udp.send(len);
-                nextRequest = millis() + DNS_REQUEST_TIMEOUT;
-            }
-            requestCount++;
-        }
+    if (!startLookup(hostname)) {
+        return NULL;
+    }
 
-        // Have we received a reply?
+    while (lookupInProgress()) {
         receivePacket();
-        if (udp.havePacket()) {
-            IPv6Address *address = dnsProcessReply(udp.payload(), udp.payloadLength(), id);
-            if (address) {
-                return address;
-            }
+    }
+
+    return lookupResult();
+}
+
+boolean EtherSia::startLookup(const char* hostname)
+{
+    // Stop any lookup that is already in progress
+    lookupFinish(NULL);
+
+    _lookupPort = allocatePort();
+    if (_lookupPort == 0) {
+        return false;
+    }
+
+    _lookupHostname = hostname;
+    _lookupId = random(65535);
+    _lookupRequests = 0;
+    _lookupResolving = false;
+
+    // Work out the MAC address to use
+    if (_dnsServerAddress.isMulticast()) {
+        _lookupMac.setIPv6Multicast(_dnsServerAddress);
+    } else {
+        MACAddress *mac = nextHopRouter(_dnsServerAddress);
+        if (mac) {
+            _lookupMac = *mac;
+        } else {
+            // The DNS server is on-link: look up its MAC address from lookupCheck(), without blocking
+            _lookupResolving = true;
+            _lookupSolicitations = 0;
         }
     }
 
-    // Lookup failed
-    return NULL;
+    // Send the first request or Neighbour Solicitation straight away
+    if (_lookupResolving) {
+        _lookupSentTime = millis() - NEIGHBOUR_SOLICITATION_TIMEOUT;
+    } else {
+        _lookupSentTime = millis() - DNS_REQUEST_TIMEOUT;
+    }
+
+    return true;
+}
+
+IPv6Address* EtherSia::lookupResult()
+{
+    if (lookupInProgress() || !_lookupFound) {
+        return NULL;
+    }
+
+    return &_lookupAddress;
+}
+
+void EtherSia::lookupFinish(const IPv6Address *address)
+{
+    if (lookupInProgress()) {
+        releasePort(_lookupPort);
+        _lookupHostname = NULL;
+    }
+
+    _lookupFound = (address != NULL);
+    if (address) {
+        _lookupAddress = *address;
+    }
+}
+
+void EtherSia::lookupCheck()
+{
+    IPv6Packet& packet = (IPv6Packet&)_ptr;
+    struct udp_header *udpHeader = UDP_HEADER_PTR;
+
+    if (!lookupInProgress()) {
+        return;
+    }
+
+    if (_lookupResolving) {
+        if (!icmp6SolicitNeighbour(_dnsServerAddress, _lookupSentTime, _lookupSolicitations)) {
+            // The DNS server didn't answer, so there is nowhere to send the request
+            lookupFinish(NULL);
+        }
+        return;
+    }
+
+    if (millis() - _lookupSentTime < DNS_REQUEST_TIMEOUT) {
+        // Still waiting for a reply
+        return;
+    }
+
+    if (_lookupRequests >= DNS_REQUEST_ATTEMPTS) {
+        // Lookup failed
+        lookupFinish(NULL);
+        return;
+    }
+
+    packet.setDestination(_dnsServerAddress);
+    packet.setEtherDestination(_lookupMac);
+    prepareSend();
+
+    uint16_t length = UDP_HEADER_LEN + dnsMakeRequest(packet.payload() + UDP_HEADER_LEN, _lookupHostname, _lookupId);
+    packet.setProtocol(IP6_PROTO_UDP);
+    packet.setPayloadLength(length);
+
+    udpHeader->sourcePort = htons(_lookupPort);
+    udpHeader->destinationPort = htons(DNS_PORT_NUMBER);
+    udpHeader->length = htons(length);
+    udpHeader->checksum = 0;
+    udpHeader->checksum = htons(packet.calculateChecksum());
+    send();
+
+    _lookupSentTime = millis();
+    _lookupRequests++;
+}
+
+boolean EtherSia::lookupProcessReply()
+{
+    IPv6Packet& packet = (IPv6Packet&)_ptr;
+    struct udp_header *udpHeader = UDP_HEADER_PTR;
+
+    if (!lookupInProgress() || _lookupResolving || packet.payloadLength() < UDP_HEADER_LEN ||
+            ntohs(udpHeader->destinationPort) != _lookupPort ||
+            ntohs(udpHeader->sourcePort) != DNS_PORT_NUMBER ||
+            packet.source() != _dnsServerAddress) {
+        return false;
+    }
+
+    // Replies that don't answer our request are ignored, the request will be sent again
+    uint16_t length = packet.payloadLength() - UDP_HEADER_LEN;
+    IPv6Address *address = dnsProcessReply(packet.payload() + UDP_HEADER_LEN, length, _lookupId);
+    if (address) {
+        lookupFinish(address);
+    }
+
+    return true;
+}
+
+void EtherSia::lookupProcessNA()
+{
+    if (!lookupInProgress() || !_lookupResolving) {
+        return;
+    }
+
+    MACAddress *mac = icmp6ProcessNA(_dnsServerAddress);
+    if (mac) {
+        _lookupMac = *mac;
+        _lookupResolving = false;
+
+        // Send the first request straight away
+        _lookupSentTime = millis() - DNS_REQUEST_TIMEOUT;
+    }
 }
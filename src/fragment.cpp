@@ -0,0 +1,184 @@
+
+#include "EtherSia.h"
+
+
+
+boolean EtherSia::ip6Reassemble()
+{
+    IPv6Packet& packet = (IPv6Packet&)_ptr;
+    struct ip6_fragment_header *fragment = (struct ip6_fragment_header*)packet.payload();
+
+    if (packet.payloadLength() < IP6_FRAGMENT_HEADER_LEN) {
+        return false;
+    }
+
+    uint16_t offset = ntohs(fragment->offset_flags) & IP6_FRAGMENT_OFFSET_MASK;
+    boolean more = ntohs(fragment->offset_flags) & IP6_FRAGMENT_MORE;
+    uint16_t len = packet.payloadLength() - IP6_FRAGMENT_HEADER_LEN;
+
+    if (offset == 0 && !more) {
+        // Atomic fragment (RFC6946) - just remove the Fragment header
+        packet.setProtocol(fragment->next_header);
+        memmove(packet.payload(), packet.payload() + IP6_FRAGMENT_HEADER_LEN, len);
+        packet.setPayloadLength(len);
+        return packet.removeExtensionHeaders();
+    }
+
+#if ETHERSIA_REASSEMBLY_SLOTS > 0
+    struct ip6_reassembly_slot *slot = NULL;
+    struct ip6_reassembly_slot *freeSlot = NULL;
+
+    for (uint8_t i = 0; i < ETHERSIA_REASSEMBLY_SLOTS; i++) {
+        struct ip6_reassembly_slot *s = &_reassembly[i];
+
+        // Give up on packets that have taken too long to arrive
+        if (s->received && (long)(millis() - s->expires) >= 0) {
+            s->received = 0;
+        }
+
+        if (s->received == 0) {
+            if (freeSlot == NULL) {
+                freeSlot = s;
+            }
+        } else if (s->identification == fragment->identification &&
+                   s->source == packet.source() &&
+                   s->destination == packet.destination()) {
+            slot = s;
+            break;
+        }
+    }
+
+    if (slot == NULL) {
+        if (freeSlot == NULL) {
+            // All the slots are busy
+            return false;
+        }
+
+        slot = freeSlot;
+        slot->source = packet.source();
+        slot->destination = packet.destination();
+        slot->identification = fragment->identification;
+        slot->expires = millis() + ETHERSIA_REASSEMBLY_TIMEOUT;
+        slot->totalLength = 0;
+        memset(slot->blocks, 0, sizeof(slot->blocks));
+    }
+
+    // All fragments except the last must be a multiple of 8 bytes long
+    // and the last fragment must not disagree with a previous one
+    if (len == 0 || (more && (len & 0x07)) ||
+            offset + len > ETHERSIA_REASSEMBLY_SIZE ||
+            (slot->totalLength && offset + len > slot->totalLength) ||
+            (!more && slot->totalLength)) {
+        slot->received = 0;
+        return false;
+    }
+
+    // Discard the whole packet if any fragments overlap (RFC5722)
+    uint16_t firstBlock = offset / 8;
+    uint16_t lastBlock = (offset + len - 1) / 8;
+    for (uint16_t b = firstBlock; b <= lastBlock; b++) {
+        if (slot->blocks[b / 8] & (1 << (b % 8))) {
+            slot->received = 0;
+            return false;
+        }
+    }
+
+    if (!more) {
+        // Check that no fragments have already been received beyond the end
+        for (uint16_t b = lastBlock + 1; b < sizeof(slot->blocks) * 8; b++) {
+            if (slot->blocks[b / 8] & (1 << (b % 8))) {
+                slot->received = 0;
+                return false;
+            }
+        }
+        slot->totalLength = offset + len;
+    }
+
+    for (uint16_t b = firstBlock; b <= lastBlock; b++) {
+        slot->blocks[b / 8] |= (1 << (b % 8));
+    }
+
+    if (offset == 0) {
+        slot->protocol = fragment->next_header;
+    }
+
+    memcpy(slot->data + offset, packet.payload() + IP6_FRAGMENT_HEADER_LEN, len);
+    slot->received += len;
+
+    if (slot->totalLength == 0 || slot->received != slot->totalLength) {
+        // Still waiting for more fragments
+        return false;
+    }
+
+    // All fragments have arrived: copy the whole packet back into the packet buffer
+    packet.setProtocol(slot->protocol);
+    memcpy(packet.payload(), slot->data, slot->totalLength);
+    packet.setPayloadLength(slot->totalLength);
+    slot->received = 0;
+
+    return packet.removeExtensionHeaders();
+#else
+    // Fragment reassembly is disabled
+    return false;
+#endif
+}
+
+boolean EtherSia::sendFragments(uint8_t protocol, const uint8_t *header, uint16_t headerLen, const uint8_t *data, uint16_t dataLen)
+{
+    IPv6Packet& packet = (IPv6Packet&)_ptr;
+    struct ip6_fragment_header *fragment = (struct ip6_fragment_header*)packet.payload();
+    uint8_t *fragmentData = packet.payload() + IP6_FRAGMENT_HEADER_LEN;
+    uint32_t totalLen = (uint32_t)headerLen + dataLen;
+    uint16_t offset = 0;
+
+    // Each fragment, apart from the last, must be a multiple of 8 bytes long
+    uint16_t maxLen = (pathMtu(packet.destination()) - IP6_HEADER_LEN - IP6_FRAGMENT_HEADER_LEN) & IP6_FRAGMENT_OFFSET_MASK;
+
+    if (totalLen > 0xFFFF || maxLen < headerLen) {
+        return false;
+    }
+
+    // The data may already be in the packet buffer (such as the payload of a received packet).
+    // Move it to where the first fragment needs it, so building a fragment never overwrites
+    // data that is still to be sent.
+    if (data < _buffer + sizeof(_buffer) && data + dataLen > _buffer) {
+        uint8_t *inPlace = fragmentData + headerLen;
+        if (inPlace + dataLen > _buffer + sizeof(_buffer)) {
+            return false;
+        }
+        memmove(inPlace, data, dataLen);
+        data = inPlace;
+    }
+
+    _fragmentId++;
+    packet.setProtocol(IP6_PROTO_FRAGMENT);
+
+    while (offset < totalLen) {
+        uint16_t len = maxLen;
+        boolean more = true;
+        if (totalLen - offset <= maxLen) {
+            len = totalLen - offset;
+            more = false;
+        }
+
+        fragment->next_header = protocol;
+        fragment->reserved = 0;
+        fragment->offset_flags = htons(offset | more);
+        fragment->identification = htonl(_fragmentId);
+
+        // The upper-layer header always fits in the first fragment
+        if (offset == 0) {
+            memcpy(fragmentData, header, headerLen);
+            memmove(fragmentData + headerLen, data, len - headerLen);
+        } else {
+            memmove(fragmentData, data + (offset - headerLen), len);
+        }
+
+        packet.setPayloadLength(IP6_FRAGMENT_HEADER_LEN + len);
+        send();
+
+        offset += len;
+    }
+
+    return true;
+}
@@ -1,15 +1,64 @@
 
 #include "EtherSia.h"
 #include "ICMPv6Packet.h"
+#include "util.h"
 
 
 
+void EtherSia::setRateLimit(uint8_t messageClass, uint8_t burst, uint16_t interval)
+{
+    struct icmp6_rate_limit &limit = _rateLimit[messageClass];
+
+    limit.tokens = burst;
+    limit.burst = burst;
+    limit.interval = interval;
+    limit.lastRefill = millis();
+    limit.suppressed = 0;
+}
+
+boolean EtherSia::icmp6RateLimit(uint8_t messageClass)
+{
+    struct icmp6_rate_limit &limit = _rateLimit[messageClass];
+
+    if (limit.interval == 0) {
+        // No rate limit
+        return true;
+    }
+
+    // Add a token for each interval that has passed
+    unsigned long elapsed = millis() - limit.lastRefill;
+    if (elapsed >= limit.interval) {
+        unsigned long add = elapsed / limit.interval;
+        if (add >= (unsigned long)(limit.burst - limit.tokens)) {
+            limit.tokens = limit.burst;
+            limit.lastRefill = millis();
+        } else {
+            limit.tokens += add;
+            limit.lastRefill += add * limit.interval;
+        }
+    }
+
+    if (limit.tokens) {
+        limit.tokens--;
+        return true;
+    }
+
+    if (limit.suppressed < 0xFFFF) {
+        limit.suppressed++;
+    }
+    return false;
+}
+
 void EtherSia::icmp6ErrorReply(uint8_t type, uint8_t code)
 {
     ICMPv6Packet& packet = (ICMPv6Packet&)_ptr;
     uint16_t payloadLen = IP6_HEADER_LEN + packet.payloadLength();
     const uint16_t payloadMax = ETHERSIA_MAX_PACKET_SIZE - ICMP6_ERROR_HEADER_OFFSET - ICMP6_ERROR_HEADER_LEN;
 
+    if (!icmp6RateLimit(ICMP6_RATE_ERROR)) {
+        return;
+    }
+
     // Make sure payloadLen isn't too long
     if (payloadLen > payloadMax)
         payloadLen = payloadMax;
@@ -56,6 +105,13 @@ void EtherSia::icmp6NSReply()
     packet.type = ICMP6_TYPE_NA;
     packet.code = 0;
     packet.na.flags = ICMP6_NA_FLAG_S; // Solicited flag.
+
+    if (packet.destination().isZero()) {
+        // Solicitation was for Duplicate Address Detection - reply to all nodes (RFC4861 7.2.4)
+        packet.destination().setLinkLocalAllNodes();
+        packet.etherDestination().setIPv6Multicast(packet.destination());
+        packet.na.flags = 0;
+    }
     memset(packet.na.reserved, 0, sizeof(packet.na.reserved));
 
     // Set the target link address option
@@ -70,12 +126,34 @@ void EtherSia::icmp6NSReply()
 void EtherSia::icmp6EchoReply()
 {
     ICMPv6Packet& packet = (ICMPv6Packet&)_ptr;
+
+    // A reassembled Echo Request may be too big to reply to in a single frame
+    if (IP6_HEADER_LEN + packet.payloadLength() > pathMtu(packet.source())) {
+        return;
+    }
+
+    if (!icmp6RateLimit(ICMP6_RATE_ECHO)) {
+        return;
+    }
+
+    // Keep a copy of the fields that change, so that the checksum
+    // can be updated without summing the whole payload again (RFC1624)
+    IPv6Address oldDestination = packet.destination();
+    uint8_t oldHeader[2] = {packet.type, packet.code};
+
     prepareReply();
 
     packet.type = ICMP6_TYPE_ECHO_REPLY;
     packet.code = 0;
 
-    icmp6PacketSend();
+    // The source and destination have swapped, which doesn't change the checksum,
+    // but the source may be a different address to the one the request was sent to
+    uint16_t checksum = ntohs(packet.checksum);
+    checksum = chksumAdjust(checksum, oldDestination, packet.source(), sizeof(IPv6Address));
+    checksum = chksumAdjust(checksum, oldHeader, &packet.type, sizeof(oldHeader));
+    packet.checksum = htons(checksum);
+
+    send();
 }
 
 void EtherSia::icmp6SendNS(IPv6Address &targetAddress, IPv6Address &sourceAddress)
@@ -97,6 +175,24 @@ void EtherSia::icmp6SendNS(IPv6Address &targetAddress, IPv6Address &sourceAddres
     icmp6PacketSend();
 }
 
+boolean EtherSia::icmp6SolicitNeighbour(IPv6Address &targetAddress, unsigned long &sentTime, uint8_t &solicitations)
+{
+    if (millis() - sentTime < NEIGHBOUR_SOLICITATION_TIMEOUT) {
+        // Still waiting for a Neighbour Advertisement
+        return true;
+    }
+
+    if (solicitations >= NEIGHBOUR_SOLICITATION_ATTEMPTS) {
+        // The host didn't answer
+        return false;
+    }
+
+    icmp6SendNS(targetAddress, targetAddress.isLinkLocal() ? _linkLocalAddress : _globalAddress);
+    sentTime = millis();
+    solicitations++;
+    return true;
+}
+
 void EtherSia::icmp6SendRS()
 {
     ICMPv6Packet& packet = (ICMPv6Packet&)_ptr;
@@ -130,64 +226,469 @@ void EtherSia::icmp6PacketSend()
     send();
 }
 
+uint16_t EtherSia::pathMtu(const IPv6Address &destination)
+{
+    uint16_t mtu = ETHERSIA_MAX_PACKET_SIZE - ETHER_HEADER_LEN;
+
+    for (uint8_t i = 0; i < ETHERSIA_PMTU_CACHE_SIZE; i++) {
+        if (_pmtuCache[i].lifetime && _pmtuCache[i].destination == destination) {
+            if (_pmtuCache[i].mtu < mtu) {
+                mtu = _pmtuCache[i].mtu;
+            }
+            break;
+        }
+    }
+
+    return mtu;
+}
+
+void EtherSia::icmp6ProcessPacketTooBig()
+{
+    ICMPv6Packet& packet = (ICMPv6Packet&)_ptr;
+    uint8_t *original = _buffer + ICMP6_ERROR_HEADER_OFFSET + ICMP6_ERROR_HEADER_LEN;
+    IPv6Address *source = (IPv6Address*)(original + 8);
+    IPv6Address *destination = (IPv6Address*)(original + 24);
+    struct pmtu_entry *entry = &_pmtuCache[0];
+
+    // The message must contain the header of a packet that we sent
+    if (packet.payloadLength() < ICMP6_HEADER_LEN + ICMP6_ERROR_HEADER_LEN + IP6_HEADER_LEN) {
+        return;
+    }
+
+    uint8_t type = isOurAddress(*source);
+    if (type != ADDRESS_TYPE_LINK_LOCAL && type != ADDRESS_TYPE_GLOBAL) {
+        return;
+    }
+
+    // RFC8201 4: never reduce the Path MTU below the IPv6 minimum link MTU
+    uint32_t mtu = ntohl(packet.err.mtu);
+    if (mtu < IP6_MIN_MTU) {
+        mtu = IP6_MIN_MTU;
+    }
+
+    // A Packet Too Big message must not increase the Path MTU
+    if (mtu >= pathMtu(*destination)) {
+        return;
+    }
+
+    // Use the entry for the destination, a free entry, or the one that expires soonest
+    for (uint8_t i = 0; i < ETHERSIA_PMTU_CACHE_SIZE; i++) {
+        if (_pmtuCache[i].lifetime && _pmtuCache[i].destination == *destination) {
+            entry = &_pmtuCache[i];
+            break;
+        } else if (_pmtuCache[i].lifetime < entry->lifetime) {
+            entry = &_pmtuCache[i];
+        }
+    }
+
+    entry->destination = *destination;
+    entry->mtu = mtu;
+    entry->lifetime = ETHERSIA_PMTU_TIMEOUT;
+}
+
 void EtherSia::icmp6ProcessPrefix(struct icmp6_prefix_information *pi)
 {
-    // Only use prefix if the On-link AND address-configuration flags are set
+    struct nd_prefix_entry *entry = NULL;
+
     // L = Bit 8 = On-link flag
     // A = Bit 7 = Autonomous address-configuration flag
-    // 0b11000000 = 0xC0
-    if ((pi->flags & 0xC0) != 0xC0) {
+    uint8_t flags = pi->flags & (ND_PREFIX_FLAG_ON_LINK | ND_PREFIX_FLAG_AUTONOMOUS);
+
+    // Addresses are made from a /64 prefix and an EUI-64 interface identifier,
+    // but on-link prefixes can be any length
+    if (pi->prefix_length != 64) {
+        flags &= ~ND_PREFIX_FLAG_AUTONOMOUS;
+    }
+
+    if (flags == 0 || pi->prefix_length == 0 || pi->prefix_length > 128) {
         return;
     }
 
-    // We only support a prefix length of 64
-    if (pi->prefix_length != 64) {
+    uint32_t validLifetime = ntohl(pi->valid_lifetime);
+    uint32_t preferredLifetime = ntohl(pi->preffered_lifetime);
+    if (preferredLifetime > validLifetime) {
+        // RFC4862 5.5.3 (c): ignore the prefix
+        return;
+    }
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_PREFIXES; i++) {
+        if (_prefixes[i].validLifetime && _prefixes[i].length == pi->prefix_length &&
+                _prefixes[i].prefix.inSameSubnet(pi->prefix, pi->prefix_length)) {
+            entry = &_prefixes[i];
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        if (validLifetime == 0) {
+            return;
+        }
+
+        // Find a free slot in the prefix list
+        for (uint8_t i = 0; i < ETHERSIA_MAX_PREFIXES; i++) {
+            if (_prefixes[i].validLifetime == 0) {
+                entry = &_prefixes[i];
+                break;
+            }
+        }
+
+        if (entry == NULL) {
+            // Prefix list is full
+            return;
+        }
+
+        entry->prefix = pi->prefix;
+        entry->prefix.maskPrefix(pi->prefix_length);
+        entry->length = pi->prefix_length;
+        entry->validLifetime = validLifetime;
+    } else if (validLifetime > ND_TWO_HOURS || validLifetime > entry->validLifetime) {
+        entry->validLifetime = validLifetime;
+    } else if (entry->validLifetime > ND_TWO_HOURS) {
+        // RFC4862 5.5.3 (e): don't let an unauthenticated RA
+        // reduce the valid lifetime below two hours
+        entry->validLifetime = ND_TWO_HOURS;
+    }
+
+    entry->flags = flags;
+    entry->preferredLifetime = preferredLifetime;
+
+    icmp6SelectGlobalAddress();
+}
+
+void EtherSia::icmp6ProcessRoute(const uint8_t *option, const MACAddress &routerMac)
+{
+    // Route Information Option, see RFC4191 2.3 for the format
+    //    0: Type
+    //    1: Length (in units of 8 octets)
+    //    2: Prefix Length
+    //    3: Flags (bits 3-4 are the Route Preference)
+    //  4-7: Route Lifetime (unsigned 32-bit integer in seconds)
+    //   8-: Prefix (0, 8 or 16 octets)
+    uint8_t prefixLength = option[2];
+    uint32_t lifetime = ntohl(*((uint32_t*)&option[4]));
+    int8_t preference = 0;
+    IPv6Address prefix;
+
+    // The option must be long enough to hold the significant part of the prefix
+    if (prefixLength > 128 || (option[1] - 1) * 64 < prefixLength || option[1] > 3) {
+        return;
+    }
+
+    switch ((option[3] >> 3) & 0x03) {
+    case 0x01:
+        preference = 1;
+        break;
+    case 0x02:
+        // Reserved value - ignore the option
         return;
+    case 0x03:
+        preference = -1;
+        break;
     }
 
+    memcpy(prefix, &option[8], (option[1] - 1) * 8);
+    routeUpdate(prefix, prefixLength, routerMac, lifetime, preference);
+}
+
+void EtherSia::icmp6SelectGlobalAddress()
+{
     // Only set global address if there isn't one already set
     if (_globalAddress.isZero()) {
-        _globalAddress = pi->prefix;
-        _globalAddress.setEui64(_localMac);
+        for (uint8_t i = 0; i < ETHERSIA_MAX_PREFIXES; i++) {
+            if (_prefixes[i].validLifetime && (_prefixes[i].flags & ND_PREFIX_FLAG_AUTONOMOUS)) {
+                _globalAddress = _prefixes[i].prefix;
+                _globalAddress.setEui64(_localMac);
+                _addressGeneration++;
+
+                // Prefer a prefix that hasn't been deprecated
+                if (_prefixes[i].preferredLifetime) {
+                    break;
+                }
+            }
+        }
+    }
+
+    // Wait for Duplicate Address Detection to finish before announcing the global address
+    if (_addressState == ADDRESS_STATE_TENTATIVE || _addressState == ADDRESS_STATE_DUPLICATE) {
+        return;
     }
 
+    if (_globalAddress.isZero()) {
+        if (_addressState == ADDRESS_STATE_GLOBAL) {
+            // Lost our global address - start looking for a router again
+            _solicitationCount = 0;
+            setAddressState(ADDRESS_STATE_LINK_LOCAL);
+        }
+    } else {
+        setAddressState(ADDRESS_STATE_GLOBAL);
+    }
+}
+
+void EtherSia::icmp6UpdateRouter(MACAddress &mac, uint16_t lifetime, int8_t preference)
+{
+    struct nd_router_entry *entry = NULL;
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_ROUTERS; i++) {
+        if (_routers[i].lifetime && _routers[i].mac == mac) {
+            entry = &_routers[i];
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        if (lifetime == 0) {
+            // Not a default router, and we don't know about it
+            return;
+        }
+
+        // Use a free slot, or replace the least preferred router that expires soonest
+        entry = &_routers[0];
+        for (uint8_t i = 0; i < ETHERSIA_MAX_ROUTERS; i++) {
+            if (_routers[i].lifetime == 0) {
+                entry = &_routers[i];
+                break;
+            } else if (_routers[i].preference < entry->preference ||
+                       (_routers[i].preference == entry->preference &&
+                        _routers[i].lifetime < entry->lifetime)) {
+                entry = &_routers[i];
+            }
+        }
+
+        if (entry->lifetime && entry->preference > preference) {
+            // All the routers we know about are better than this one
+            return;
+        }
+
+        if (entry->lifetime && _routerMac == entry->mac) {
+            _routerMac = MACAddress();
+        }
+
+        entry->mac = mac;
+    } else if (lifetime == 0 && _routerMac == mac) {
+        // Router is no longer a default router
+        _routerMac = MACAddress();
+    }
+
+    entry->preference = preference;
+    entry->lifetime = lifetime;
+
+    icmp6SelectRouter();
+}
+
+void EtherSia::icmp6SelectRouter()
+{
+    struct nd_router_entry *best = NULL;
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_ROUTERS; i++) {
+        if (_routers[i].lifetime) {
+            if (best == NULL || _routers[i].preference > best->preference) {
+                best = &_routers[i];
+            }
+        }
+    }
+
+    if (best) {
+        _routerMac = best->mac;
+    }
+}
+
+void EtherSia::icmp6CheckLifetimes()
+{
+    unsigned long elapsed = (millis() - _lifetimeLastCheck) / 1000;
+    boolean routerExpired = false;
+
+    if (elapsed == 0) {
+        return;
+    }
+
+    _lifetimeLastCheck += elapsed * 1000;
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_ROUTERS; i++) {
+        struct nd_router_entry &router = _routers[i];
+        if (router.lifetime == 0) {
+            continue;
+        } else if (router.lifetime <= elapsed) {
+            router.lifetime = 0;
+            if (_routerMac == router.mac) {
+                _routerMac = MACAddress();
+            }
+            routerExpired = true;
+        } else {
+            router.lifetime -= elapsed;
+        }
+    }
+
+    if (routerExpired) {
+        // Failover to a backup router
+        icmp6SelectRouter();
+    }
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_PREFIXES; i++) {
+        struct nd_prefix_entry &prefix = _prefixes[i];
+        if (prefix.validLifetime == 0) {
+            continue;
+        } else if (prefix.validLifetime != ND_INFINITE_LIFETIME && prefix.validLifetime <= elapsed) {
+            prefix.validLifetime = 0;
+
+            // Remove our global address, if it was auto-configured from this prefix
+            IPv6Address address = prefix.prefix;
+            address.setEui64(_localMac);
+            if (_globalAddress == address) {
+                _globalAddress.setZero();
+                _addressGeneration++;
+                icmp6SelectGlobalAddress();
+            }
+        } else {
+            // A prefix that never expires can still be deprecated
+            if (prefix.validLifetime != ND_INFINITE_LIFETIME) {
+                prefix.validLifetime -= elapsed;
+            }
+            if (prefix.preferredLifetime != ND_INFINITE_LIFETIME) {
+                prefix.preferredLifetime = (prefix.preferredLifetime > elapsed) ? prefix.preferredLifetime - elapsed : 0;
+            }
+        }
+    }
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_ROUTES && _routes[i].lifetime; ) {
+        struct nd_route_entry &route = _routes[i];
+        if (route.lifetime == ND_INFINITE_LIFETIME) {
+            i++;
+        } else if (route.lifetime <= elapsed) {
+            routeRemove(i);
+        } else {
+            route.lifetime -= elapsed;
+            i++;
+        }
+    }
+
+    // Forget reduced Path MTUs after a while, in case the path has changed (RFC8201 4)
+    for (uint8_t i = 0; i < ETHERSIA_PMTU_CACHE_SIZE; i++) {
+        struct pmtu_entry &pmtu = _pmtuCache[i];
+        pmtu.lifetime = (pmtu.lifetime > elapsed) ? pmtu.lifetime - elapsed : 0;
+    }
+
+    if (_dnsServerLifetime && _dnsServerLifetime != ND_INFINITE_LIFETIME) {
+        if (_dnsServerLifetime <= elapsed) {
+            resetDnsServerAddress();
+        } else {
+            _dnsServerLifetime -= elapsed;
+        }
+    }
+}
+
+uint32_t EtherSia::icmp6NextExpiry()
+{
+    uint32_t next = ND_INFINITE_LIFETIME;
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_ROUTERS; i++) {
+        if (_routers[i].lifetime && _routers[i].lifetime < next) {
+            next = _routers[i].lifetime;
+        }
+    }
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_PREFIXES; i++) {
+        if (_prefixes[i].validLifetime && _prefixes[i].validLifetime < next) {
+            next = _prefixes[i].validLifetime;
+        }
+    }
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_ROUTES && _routes[i].lifetime; i++) {
+        if (_routes[i].lifetime < next) {
+            next = _routes[i].lifetime;
+        }
+    }
+
+    for (uint8_t i = 0; i < ETHERSIA_PMTU_CACHE_SIZE; i++) {
+        if (_pmtuCache[i].lifetime && _pmtuCache[i].lifetime < next) {
+            next = _pmtuCache[i].lifetime;
+        }
+    }
+
+    if (_dnsServerLifetime && _dnsServerLifetime < next) {
+        next = _dnsServerLifetime;
+    }
+
+    return next;
 }
 
 void EtherSia::icmp6ProcessRA()
 {
-    IPv6Packet& packet = (IPv6Packet&)_ptr;
+    ICMPv6Packet& packet = (ICMPv6Packet&)_ptr;
     int16_t remaining = packet.payloadLength() - ICMP6_HEADER_LEN - ICMP6_RA_HEADER_LEN;
     uint8_t *ptr = _buffer + ICMP6_RA_HEADER_OFFSET + ICMP6_RA_HEADER_LEN;
+    MACAddress routerMac = packet.etherSource();
+    int8_t preference = 0;
 
     if (_autoConfigurationEnabled == false) {
         return;
     }
 
+    // RFC4861 6.1.2: Router Advertisements must come from a link-local address
+    // and must not have been forwarded by a router
+    if (!packet.source().isLinkLocal() || packet.hopLimit() != 255) {
+        return;
+    }
+
+    // Default Router Preference, see RFC4191
+    switch ((packet.ra.flags >> 3) & 0x03) {
+    case 0x01:
+        preference = 1;
+        break;
+    case 0x03:
+        preference = -1;
+        break;
+    }
+
     while(remaining > 0) {
+        if (ptr[1] == 0) {
+            // Invalid option length
+            return;
+        }
+
         switch(ptr[0]) {
         case ICMP6_OPTION_SOURCE_LINK_ADDRESS:
             // Store the MAC address of the router
-            _routerMac = *((MACAddress*)&ptr[2]);
+            routerMac = *((MACAddress*)&ptr[2]);
             break;
         case ICMP6_OPTION_PREFIX_INFORMATION:
             icmp6ProcessPrefix(
                 (struct icmp6_prefix_information*)&ptr[2]
             );
             break;
-        case ICMP6_OPTION_RECURSIVE_DNS:
+        case ICMP6_OPTION_ROUTE_INFORMATION:
+            icmp6ProcessRoute(ptr, packet.etherSource());
+            break;
+        case ICMP6_OPTION_RECURSIVE_DNS: {
             // Recursive DNS Server Option, see RFC6106 for the format
             //    0: Type
             //    1: Length (in units of 8 octets)
             //  2-3: Reserved
             //  4-7: Lifetime (unsigned 32-bit integer in seconds)
             // 8-24: First DNS Server Address
-            _dnsServerAddress = *((IPv6Address*)&ptr[8]);
+            uint32_t lifetime = ntohl(*((uint32_t*)&ptr[4]));
+            IPv6Address *address = (IPv6Address*)&ptr[8];
+            if (ptr[1] < 3) {
+                // Option is too short to contain an address
+            } else if (lifetime) {
+                _dnsServerAddress = *address;
+                _dnsServerLifetime = lifetime;
+            } else if (_dnsServerLifetime && _dnsServerAddress == *address) {
+                resetDnsServerAddress();
+            }
             break;
         }
+        }
 
         remaining -= (8 * ptr[1]);
         ptr += (8 * ptr[1]);
     }
+
+    icmp6UpdateRouter(routerMac, ntohs(packet.ra.router_lifetime), preference);
+
+    if (_addressState == ADDRESS_STATE_GLOBAL) {
+        // No need to send any more Router Solicitations
+        _solicitationCount = ROUTER_SOLICITATION_ATTEMPTS;
+    }
 }
 
 MACAddress* EtherSia::icmp6ProcessNA(IPv6Address &expected)
@@ -218,20 +719,54 @@ boolean EtherSia::icmp6ProcessPacket()
 {
     ICMPv6Packet& packet = (ICMPv6Packet&)_ptr;
 
-    if (isOurAddress(packet.destination()) == 0) {
+    if (_destinationType == 0) {
         // Packet isn't addressed to us
         return false;
     }
 
     switch(packet.type) {
     case ICMP6_TYPE_NS:
-        icmp6NSReply();
+        if (_addressState == ADDRESS_STATE_TENTATIVE && packet.ns.target == _linkLocalAddress) {
+            // Don't reply while our address is tentative, but if another
+            // node is performing DAD for the same address, it is a duplicate
+            if (packet.source().isZero()) {
+                setAddressState(ADDRESS_STATE_DUPLICATE);
+            }
+        } else {
+            icmp6NSReply();
+        }
         return true;
 
+    case ICMP6_TYPE_NA:
+        if (_addressState == ADDRESS_STATE_TENTATIVE && packet.na.target == _linkLocalAddress) {
+            // Another node is already using our link-local address
+            setAddressState(ADDRESS_STATE_DUPLICATE);
+            return true;
+        }
+
+        // Also leave the packet for discoverNeighbour(), in case it is waiting for the same host
+        pingProcessNA();
+        lookupProcessNA();
+        return false;
+
     case ICMP6_TYPE_ECHO:
         icmp6EchoReply();
         return true;
 
+    case ICMP6_TYPE_ECHO_REPLY:
+        return pingProcessReply();
+
+    case ICMP6_TYPE_PACKET_TOO_BIG:
+        icmp6ProcessPacketTooBig();
+        return true;
+
+    case ICMP6_TYPE_MLD_QUERY:
+    case ICMP6_TYPE_MLD_REPORT:
+    case ICMP6_TYPE_MLD_DONE:
+    case ICMP6_TYPE_MLD2_REPORT:
+        mldProcessPacket();
+        return true;
+
     case ICMP6_TYPE_RA:
         icmp6ProcessRA();
         return true;
@@ -242,26 +777,68 @@ boolean EtherSia::icmp6ProcessPacket()
     }
 }
 
-boolean EtherSia::icmp6AutoConfigure()
+void EtherSia::icmp6AutoConfigure()
 {
-    unsigned long nextRouterSolicitation = millis();
-    uint8_t count = 0;
-    while (_globalAddress.isZero()) {
-        if ((long)(millis() - nextRouterSolicitation) >= 0) {
-            icmp6SendRS();
-            nextRouterSolicitation = millis() + ROUTER_SOLICITATION_TIMEOUT;
-            count++;
-        }
+    if ((long)(millis() - _nextSolicitation) < 0) {
+        // Nothing to do yet
+        return;
+    }
 
-        receivePacket();
+    switch (_addressState) {
+    case ADDRESS_STATE_TENTATIVE:
+        if (_solicitationCount == 0) {
+            // Send link local Neighbour Solicitation for Duplicate Address Detection
+            IPv6Address zero;
+            icmp6SendNS(_linkLocalAddress, zero);
+            _nextSolicitation = millis() + DUPLICATE_ADDRESS_TIMEOUT;
+            _solicitationCount++;
+        } else {
+            // Nobody else replied, so the link-local address is ours
+            _solicitationCount = 0;
+            if (_globalAddress.isZero()) {
+                setAddressState(ADDRESS_STATE_LINK_LOCAL);
+            } else {
+                setAddressState(ADDRESS_STATE_GLOBAL);
+            }
+        }
+        break;
+
+    case ADDRESS_STATE_LINK_LOCAL:
+    case ADDRESS_STATE_GLOBAL:
+        // Solicit a Router Advertisement, even if we already have a global address,
+        // so that a static or restored configuration gets confirmed
+        if (!_autoConfigurationEnabled || _solicitationCount >= ROUTER_SOLICITATION_ATTEMPTS) {
+            if (_addressState == ADDRESS_STATE_LINK_LOCAL && _autoConfigurationEnabled) {
+                setAddressState(ADDRESS_STATE_NO_ROUTER);
+            }
+        } else {
+            icmp6SendRS();
 
-        if (count > ROUTER_SOLICITATION_ATTEMPTS) {
-            return false;
+            // Double the wait after each attempt, with up to 10% random variation (RFC7559 2)
+            unsigned long timeout = ROUTER_SOLICITATION_MAX_TIMEOUT;
+            if (_solicitationCount < 16 && (ROUTER_SOLICITATION_TIMEOUT << _solicitationCount) < timeout) {
+                timeout = ROUTER_SOLICITATION_TIMEOUT << _solicitationCount;
+            }
+            _nextSolicitation = millis() + timeout + random(-(long)(timeout / 10), timeout / 10);
+            _solicitationCount++;
         }
+        break;
     }
+}
 
-    // We have a global IPv6 address - success
-    return true;
+boolean EtherSia::icmp6AutoConfigurePending()
+{
+    // This must match the states where icmp6AutoConfigure() does something
+    switch (_addressState) {
+    case ADDRESS_STATE_TENTATIVE:
+        return true;
+    case ADDRESS_STATE_LINK_LOCAL:
+        return _autoConfigurationEnabled;
+    case ADDRESS_STATE_GLOBAL:
+        return _autoConfigurationEnabled && _solicitationCount < ROUTER_SOLICITATION_ATTEMPTS;
+    default:
+        return false;
+    }
 }
 
 MACAddress* EtherSia::discoverNeighbour(const char* addrstr)
@@ -0,0 +1,274 @@
+
+#include "EtherSia.h"
+#include "ICMPv6Packet.h"
+
+
+
+boolean EtherSia::joinGroup(const char *group)
+{
+    IPv6Address addr(group);
+    return joinGroup(addr);
+}
+
+boolean EtherSia::joinGroup(const IPv6Address &group)
+{
+    struct ethersia_multicast_group *entry = NULL;
+
+    if (!group.isMulticast()) {
+        return false;
+    }
+
+    if (group.isLinkLocalAllNodes()) {
+        // Always a member of the all-nodes group, which is never reported (RFC3810 6)
+        return true;
+    }
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_MULTICAST_GROUPS; i++) {
+        if (_multicastGroups[i].address == group) {
+            if (_multicastGroups[i].users) {
+                // Already a member: count the extra user, so that the group is only left by the last one
+                if (_multicastGroups[i].users < 0xFF) {
+                    _multicastGroups[i].users++;
+                }
+                return true;
+            }
+
+            // Rejoining a group that we are still reporting leaving
+            entry = &_multicastGroups[i];
+            break;
+        } else if (_multicastGroups[i].address.isZero()) {
+            if (entry == NULL || !entry->address.isZero()) {
+                entry = &_multicastGroups[i];
+            }
+        } else if (entry == NULL && _multicastGroups[i].users == 0) {
+            // If the table is full, give up reporting that we left a group
+            entry = &_multicastGroups[i];
+        }
+    }
+
+    if (entry == NULL) {
+        // Group table is full
+        return false;
+    }
+
+    entry->address = group;
+    entry->users = 1;
+    entry->reports = 0;
+
+    // Tell the routers and switches straight away, unless our link-local address isn't ready yet
+    if (_addressState != ADDRESS_STATE_TENTATIVE && _addressState != ADDRESS_STATE_DUPLICATE) {
+        entry->reports = MLD_ROBUSTNESS_VARIABLE;
+        mldSendReport(true);
+    }
+
+    return true;
+}
+
+boolean EtherSia::leaveGroup(const char *group)
+{
+    IPv6Address addr(group);
+    return leaveGroup(addr);
+}
+
+boolean EtherSia::leaveGroup(const IPv6Address &group)
+{
+    if (group.isLinkLocalAllNodes()) {
+        // The all-nodes group can't be left
+        return false;
+    }
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_MULTICAST_GROUPS; i++) {
+        if (_multicastGroups[i].users && _multicastGroups[i].address == group) {
+            if (--_multicastGroups[i].users) {
+                // Other users are still listening to the group
+                return true;
+            }
+
+            if (_addressState != ADDRESS_STATE_TENTATIVE && _addressState != ADDRESS_STATE_DUPLICATE) {
+                // The entry is freed once the change has been reported enough times
+                _multicastGroups[i].reports = MLD_ROBUSTNESS_VARIABLE;
+                mldSendReport(true);
+            } else {
+                _multicastGroups[i].address.setZero();
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+boolean EtherSia::isGroupMember(const IPv6Address &group)
+{
+    if (!group.isMulticast()) {
+        return false;
+    }
+
+    if (group.isLinkLocalAllNodes()) {
+        return true;
+    }
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_MULTICAST_GROUPS; i++) {
+        if (_multicastGroups[i].users && _multicastGroups[i].address == group) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void EtherSia::mldProcessPacket()
+{
+    ICMPv6Packet& packet = (ICMPv6Packet&)_ptr;
+
+    // Ignore reports from other listeners
+    if (packet.type != ICMP6_TYPE_MLD_QUERY) {
+        return;
+    }
+
+    // RFC3810 5.1.14: Queries must come from a link-local address
+    // We only support MLDv2 Queries, which are longer than MLDv1 Queries
+    if (!packet.source().isLinkLocal() || packet.payloadLength() < ICMP6_HEADER_LEN + MLD2_QUERY_HEADER_LEN) {
+        return;
+    }
+
+    // Reply to General Queries, and Queries for a group that we are a member of
+    if (packet.mld.group.isZero() ||
+            (!packet.mld.group.isLinkLocalAllNodes() && isOurAddress(packet.mld.group) == ADDRESS_TYPE_MULTICAST)) {
+        // Decode the Maximum Response Delay (RFC3810 5.1.3)
+        unsigned long maxDelay = ntohs(packet.mld.max_response_code);
+        if (maxDelay >= 0x8000) {
+            maxDelay = ((maxDelay & 0x0FFF) | 0x1000) << (((maxDelay >> 12) & 0x07) + 3);
+        }
+
+        mldScheduleReport(maxDelay, true);
+    }
+}
+
+void EtherSia::mldScheduleReport(unsigned long maxDelay, boolean stateReport)
+{
+    unsigned long reportTime = millis();
+    if (maxDelay) {
+        reportTime += random(0, maxDelay);
+    }
+
+    // Don't delay a Report that is already scheduled
+    if (!_mldReportPending || (long)(reportTime - _mldReportTime) < 0) {
+        _mldReportTime = reportTime;
+        _mldReportPending = true;
+    }
+
+    if (stateReport) {
+        _mldStateReport = true;
+    }
+}
+
+void EtherSia::mldCheckReport()
+{
+    boolean stateReport = _mldStateReport;
+
+    if (!_mldReportPending || (long)(millis() - _mldReportTime) < 0) {
+        // Nothing to do yet
+        return;
+    }
+
+    _mldReportPending = false;
+    _mldStateReport = false;
+    if (_addressState == ADDRESS_STATE_TENTATIVE || _addressState == ADDRESS_STATE_DUPLICATE) {
+        return;
+    }
+
+    if (stateReport) {
+        mldSendReport(false);
+    }
+
+    // Retransmit the changes to our groups that haven't been reported enough times yet
+    for (uint8_t i = 0; i < ETHERSIA_MAX_MULTICAST_GROUPS; i++) {
+        if (_multicastGroups[i].reports) {
+            mldSendReport(true);
+            break;
+        }
+    }
+}
+
+void EtherSia::mldSendReport(boolean stateChange)
+{
+    IPv6Packet& packet = (IPv6Packet&)_ptr;
+    struct ip6_router_alert_header *alert = (struct ip6_router_alert_header*)packet.payload();
+    struct mld2_report_header *report = (struct mld2_report_header*)(packet.payload() + IP6_ROUTER_ALERT_HEADER_LEN);
+    struct mld2_address_record *record = (struct mld2_address_record*)(report + 1);
+    uint16_t count = 0;
+    boolean retransmit = false;
+
+    packet.destination().setLinkLocalAllMLDv2Routers();
+    packet.etherDestination().setIPv6Multicast(packet.destination());
+    prepareSend();
+    packet.setSource(_linkLocalAddress);
+    packet.setHopLimit(1);
+    packet.setProtocol(IP6_PROTO_HOP_BY_HOP);
+
+    // Hop-by-Hop Options header containing a Router Alert option
+    alert->next_header = IP6_PROTO_ICMP6;
+    alert->length = 0;
+    alert->option_type = 0x05;
+    alert->option_len = 2;
+    alert->value = 0;  // 0 = Multicast Listener Discovery message
+    alert->padding[0] = 0x01;  // PadN option
+    alert->padding[1] = 0;
+
+    if (stateChange) {
+        // Every change to our groups that still needs to be reported (RFC3810 6.1)
+        for (uint8_t i = 0; i < ETHERSIA_MAX_MULTICAST_GROUPS; i++) {
+            struct ethersia_multicast_group &entry = _multicastGroups[i];
+            if (entry.reports == 0) {
+                continue;
+            }
+
+            record[count].group = entry.address;
+            record[count++].type = entry.users ? MLD2_CHANGE_TO_EXCLUDE : MLD2_CHANGE_TO_INCLUDE;
+
+            if (--entry.reports) {
+                retransmit = true;
+            } else if (entry.users == 0) {
+                entry.address.setZero();
+            }
+        }
+    } else {
+        // Current state of all our groups, including the Solicited-Node multicast groups
+        record[count].group.setSolicitedNodeMulticastAddress(_linkLocalAddress);
+        record[count++].type = MLD2_MODE_IS_EXCLUDE;
+
+        if (!_globalAddress.isZero() && !record[0].group.isSolicitedNodeMulticastAddress(_globalAddress)) {
+            record[count].group.setSolicitedNodeMulticastAddress(_globalAddress);
+            record[count++].type = MLD2_MODE_IS_EXCLUDE;
+        }
+
+        for (uint8_t i = 0; i < ETHERSIA_MAX_MULTICAST_GROUPS; i++) {
+            if (_multicastGroups[i].users) {
+                record[count].group = _multicastGroups[i].address;
+                record[count++].type = MLD2_MODE_IS_EXCLUDE;
+            }
+        }
+    }
+
+    for (uint16_t i = 0; i < count; i++) {
+        record[i].aux_len = 0;
+        record[i].source_count = 0;
+    }
+
+    report->type = ICMP6_TYPE_MLD2_REPORT;
+    report->code = 0;
+    report->reserved = 0;
+    report->record_count = htons(count);
+
+    packet.setPayloadLength(IP6_ROUTER_ALERT_HEADER_LEN + MLD2_REPORT_HEADER_LEN + (count * MLD2_ADDRESS_RECORD_LEN));
+    report->checksum = 0;
+    report->checksum = htons(packet.calculateChecksum());
+
+    send();
+
+    if (retransmit) {
+        // Send the changes again after a random delay, up to the Unsolicited Report Interval
+        mldScheduleReport(MLD_UNSOLICITED_REPORT_INTERVAL, false);
+    }
+}
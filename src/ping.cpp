@@ -0,0 +1,172 @@
+
+#include "EtherSia.h"
+#include "ICMPv6Packet.h"
+
+
+
+boolean EtherSia::ping(const char *address, uint8_t count, uint16_t size)
+{
+    IPv6Address addr(address);
+    return ping(addr, count, size);
+}
+
+boolean EtherSia::ping(const IPv6Address &address, uint8_t count, uint16_t size)
+{
+    uint16_t maxSize = pathMtu(address) - IP6_HEADER_LEN - ICMP6_HEADER_LEN - ICMP6_ECHO_HEADER_LEN;
+
+    // Stop any ping that is already in progress
+    _pingRemaining = 0;
+    _pingWaiting = false;
+    _pingResolving = false;
+    memset(&_pingStatistics, 0, sizeof(_pingStatistics));
+    _pingTotalTime = 0;
+    _pingTotalJitter = 0;
+
+    if (count == 0 || size > maxSize) {
+        return false;
+    }
+
+    // Work out the MAC address to use
+    _pingAddress = address;
+    if (_pingAddress.isMulticast()) {
+        _pingMac.setIPv6Multicast(_pingAddress);
+    } else {
+        MACAddress *mac = nextHopRouter(_pingAddress);
+        if (mac) {
+            _pingMac = *mac;
+        } else {
+            // The host is on-link: look up its MAC address from pingCheck(), without blocking
+            _pingResolving = true;
+            _pingSolicitations = 0;
+        }
+    }
+
+    // Use a new Identifier, so that late replies to the last ping are ignored
+    _pingIdentifier++;
+    _pingSequence = 0;
+    _pingSize = size;
+    _pingRemaining = count;
+
+    // Send the first Echo Request or Neighbour Solicitation straight away
+    if (_pingResolving) {
+        _pingSentTime = millis() - NEIGHBOUR_SOLICITATION_TIMEOUT;
+    } else {
+        _pingSentTime = millis() - ETHERSIA_PING_INTERVAL;
+    }
+
+    return true;
+}
+
+boolean EtherSia::pingInProgress()
+{
+    return _pingRemaining || _pingWaiting;
+}
+
+void EtherSia::pingCheck()
+{
+    ICMPv6Packet& packet = (ICMPv6Packet&)_ptr;
+
+    if (_pingResolving) {
+        if (!icmp6SolicitNeighbour(_pingAddress, _pingSentTime, _pingSolicitations)) {
+            // The host didn't answer, so there is nowhere to send the Echo Requests
+            _pingResolving = false;
+            _pingRemaining = 0;
+            _pingStatistics.loss = 100;
+        }
+        return;
+    }
+
+    if (!pingInProgress() || millis() - _pingSentTime < ETHERSIA_PING_INTERVAL) {
+        // Nothing to do yet
+        return;
+    }
+
+    if (_pingWaiting) {
+        // No reply to the last Echo Request
+        _pingWaiting = false;
+        _pingStatistics.loss = (uint16_t)(_pingStatistics.transmitted - _pingStatistics.received) * 100 / _pingStatistics.transmitted;
+    }
+
+    if (_pingRemaining == 0) {
+        return;
+    }
+
+    packet.setDestination(_pingAddress);
+    packet.setEtherDestination(_pingMac);
+    prepareSend();
+
+    packet.type = ICMP6_TYPE_ECHO;
+    packet.code = 0;
+    packet.echo.identifier = htons(_pingIdentifier);
+    _pingSequence++;
+    packet.echo.sequence = htons(_pingSequence);
+
+    uint8_t *data = (uint8_t*)&packet.echo + ICMP6_ECHO_HEADER_LEN;
+    for (uint16_t i = 0; i < _pingSize; i++) {
+        data[i] = i;
+    }
+
+    packet.setPayloadLength(ICMP6_HEADER_LEN + ICMP6_ECHO_HEADER_LEN + _pingSize);
+    icmp6PacketSend();
+
+    _pingSentTime = millis();
+    _pingStatistics.transmitted++;
+    _pingRemaining--;
+    _pingWaiting = true;
+}
+
+void EtherSia::pingProcessNA()
+{
+    if (!_pingResolving) {
+        return;
+    }
+
+    MACAddress *mac = icmp6ProcessNA(_pingAddress);
+    if (mac) {
+        _pingMac = *mac;
+        _pingResolving = false;
+
+        // Send the first Echo Request straight away
+        _pingSentTime = millis() - ETHERSIA_PING_INTERVAL;
+    }
+}
+
+boolean EtherSia::pingProcessReply()
+{
+    ICMPv6Packet& packet = (ICMPv6Packet&)_ptr;
+
+    if (!_pingWaiting || packet.payloadLength() < ICMP6_HEADER_LEN + ICMP6_ECHO_HEADER_LEN) {
+        return false;
+    }
+
+    // Any member of a multicast group may reply, otherwise it must be from the host we pinged
+    if ((!_pingAddress.isMulticast() && packet.source() != _pingAddress) ||
+            ntohs(packet.echo.identifier) != _pingIdentifier ||
+            ntohs(packet.echo.sequence) != _pingSequence) {
+        return false;
+    }
+
+    uint16_t rtt = millis() - _pingSentTime;
+    _pingWaiting = false;
+    _pingStatistics.received++;
+
+    if (_pingStatistics.received == 1 || rtt < _pingStatistics.minimum) {
+        _pingStatistics.minimum = rtt;
+    }
+    if (rtt > _pingStatistics.maximum) {
+        _pingStatistics.maximum = rtt;
+    }
+
+    _pingTotalTime += rtt;
+    _pingStatistics.average = _pingTotalTime / _pingStatistics.received;
+
+    if (_pingStatistics.received > 1) {
+        _pingTotalJitter += (rtt > _pingLastTime) ? (rtt - _pingLastTime) : (_pingLastTime - rtt);
+        _pingStatistics.jitter = _pingTotalJitter / (_pingStatistics.received - 1);
+    }
+    _pingLastTime = rtt;
+
+    _pingStatistics.loss = (uint16_t)(_pingStatistics.transmitted - _pingStatistics.received) * 100 / _pingStatistics.transmitted;
+
+    return true;
+}
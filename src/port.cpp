@@ -0,0 +1,77 @@
+
+#include "EtherSia.h"
+
+
+
+uint16_t EtherSia::allocatePort()
+{
+    // Try to avoid recently released ports first, then fall back to any free port
+    for (uint8_t pass = 0; pass < 2; pass++) {
+        // Search upwards from a random position in the range (RFC6056 Algorithm 1)
+        uint16_t offset = random(0, ETHERSIA_EPHEMERAL_PORT_COUNT);
+
+        for (uint16_t count = ETHERSIA_EPHEMERAL_PORT_COUNT; count > 0; count--) {
+            uint16_t port = ETHERSIA_EPHEMERAL_PORT_FIRST + offset;
+            boolean recent = false;
+
+            if (pass == 0) {
+                for (uint8_t i = 0; i < ETHERSIA_RECENT_PORTS; i++) {
+                    if (_recentPorts[i] == port) {
+                        recent = true;
+                        break;
+                    }
+                }
+            }
+
+            if (!recent && reservePort(port)) {
+                return port;
+            }
+
+            offset++;
+            if (offset == ETHERSIA_EPHEMERAL_PORT_COUNT) {
+                offset = 0;
+            }
+        }
+    }
+
+    // Every port is in use
+    return 0;
+}
+
+boolean EtherSia::reservePort(uint16_t port)
+{
+    uint16_t offset = port - ETHERSIA_EPHEMERAL_PORT_FIRST;
+
+    if (port < ETHERSIA_EPHEMERAL_PORT_FIRST || offset >= ETHERSIA_EPHEMERAL_PORT_COUNT) {
+        // Not an ephemeral port
+        return true;
+    }
+
+    if (_portsInUse[offset / 8] & (1 << (offset % 8))) {
+        return false;
+    }
+
+    _portsInUse[offset / 8] |= (1 << (offset % 8));
+    return true;
+}
+
+void EtherSia::releasePort(uint16_t port)
+{
+    uint16_t offset = port - ETHERSIA_EPHEMERAL_PORT_FIRST;
+
+    if (port < ETHERSIA_EPHEMERAL_PORT_FIRST || offset >= ETHERSIA_EPHEMERAL_PORT_COUNT) {
+        // Not an ephemeral port
+        return;
+    }
+
+    if ((_portsInUse[offset / 8] & (1 << (offset % 8))) == 0) {
+        // Not in use
+        return;
+    }
+
+    _portsInUse[offset / 8] &= ~(1 << (offset % 8));
+
+    // Remember it, so that the same port isn't used again straight away
+    _recentPorts[_recentPortNext] = port;
+    _recentPortNext = (_recentPortNext + 1) % ETHERSIA_RECENT_PORTS;
+}
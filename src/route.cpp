@@ -0,0 +1,158 @@
+
+#include "EtherSia.h"
+
+
+
+boolean EtherSia::addRoute(const char *prefix, uint8_t prefixLength, const char *router)
+{
+    IPv6Address prefixAddr(prefix);
+    IPv6Address routerAddr(router);
+
+    MACAddress *mac = discoverNeighbour(routerAddr);
+    if (mac == NULL) {
+        return false;
+    }
+
+    return addRoute(prefixAddr, prefixLength, *mac);
+}
+
+boolean EtherSia::addRoute(const IPv6Address &prefix, uint8_t prefixLength, const MACAddress &routerMac)
+{
+    // Static routes never expire
+    return routeUpdate(prefix, prefixLength, routerMac, ND_INFINITE_LIFETIME, 0);
+}
+
+boolean EtherSia::removeRoute(const IPv6Address &prefix, uint8_t prefixLength)
+{
+    IPv6Address masked = prefix;
+    boolean removed = false;
+
+    masked.maskPrefix(prefixLength);
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_ROUTES && _routes[i].lifetime; ) {
+        if (_routes[i].length == prefixLength && _routes[i].prefix == masked) {
+            routeRemove(i);
+            removed = true;
+        } else {
+            i++;
+        }
+    }
+
+    return removed;
+}
+
+int16_t EtherSia::onLinkPrefixLength(const IPv6Address &address)
+{
+    int16_t longest = -1;
+    boolean havePrefix = false;
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_PREFIXES; i++) {
+        struct nd_prefix_entry &entry = _prefixes[i];
+        if (entry.validLifetime && (entry.flags & ND_PREFIX_FLAG_ON_LINK)) {
+            havePrefix = true;
+            if (entry.length > longest && address.inSameSubnet(entry.prefix, entry.length)) {
+                longest = entry.length;
+            }
+        }
+    }
+
+    // Without any prefixes from a router, assume that our global address is in a /64
+    if (!havePrefix && !_globalAddress.isZero() && address.inSameSubnet(_globalAddress)) {
+        longest = 64;
+    }
+
+    return longest;
+}
+
+MACAddress* EtherSia::nextHop(IPv6Address &destination)
+{
+    MACAddress *router = nextHopRouter(destination);
+
+    if (router == NULL) {
+        return discoverNeighbour(destination);
+    } else {
+        return router;
+    }
+}
+
+MACAddress* EtherSia::nextHopRouter(const IPv6Address &destination)
+{
+    if (destination.isLinkLocal()) {
+        return NULL;
+    }
+
+    int16_t onLinkLength = onLinkPrefixLength(destination);
+
+    // The table is sorted, so the first match is the longest
+    for (uint8_t i = 0; i < ETHERSIA_MAX_ROUTES && _routes[i].lifetime; i++) {
+        if (_routes[i].length <= onLinkLength) {
+            // The on-link prefix is a better match
+            break;
+        } else if (destination.inSameSubnet(_routes[i].prefix, _routes[i].length)) {
+            return &_routes[i].mac;
+        }
+    }
+
+    if (onLinkLength >= 0) {
+        return NULL;
+    } else {
+        return &_routerMac;
+    }
+}
+
+boolean EtherSia::routeUpdate(const IPv6Address &prefix, uint8_t prefixLength, const MACAddress &mac, uint32_t lifetime, int8_t preference)
+{
+    IPv6Address masked = prefix;
+    uint8_t pos = 0;
+
+    if (prefixLength > 128) {
+        return false;
+    }
+
+    masked.maskPrefix(prefixLength);
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_ROUTES && _routes[i].lifetime; i++) {
+        struct nd_route_entry &entry = _routes[i];
+        if (entry.length == prefixLength && entry.prefix == masked && entry.mac == mac) {
+            if (lifetime == 0) {
+                routeRemove(i);
+            } else {
+                entry.lifetime = lifetime;
+                entry.preference = preference;
+            }
+            return true;
+        }
+
+        // Insert after routes to longer prefixes, and after better routes to the same prefix
+        if (entry.length > prefixLength ||
+                (entry.length == prefixLength && entry.preference >= preference)) {
+            pos = i + 1;
+        }
+    }
+
+    if (lifetime == 0 || pos >= ETHERSIA_MAX_ROUTES || _routes[ETHERSIA_MAX_ROUTES - 1].lifetime) {
+        // Nothing to remove, or the route table is full
+        return false;
+    }
+
+    // Move the shorter prefixes down to make space
+    for (uint8_t i = ETHERSIA_MAX_ROUTES - 1; i > pos; i--) {
+        _routes[i] = _routes[i - 1];
+    }
+
+    _routes[pos].prefix = masked;
+    _routes[pos].length = prefixLength;
+    _routes[pos].preference = preference;
+    _routes[pos].mac = mac;
+    _routes[pos].lifetime = lifetime;
+
+    return true;
+}
+
+void EtherSia::routeRemove(uint8_t index)
+{
+    for (uint8_t i = index; i < ETHERSIA_MAX_ROUTES - 1; i++) {
+        _routes[i] = _routes[i + 1];
+    }
+    _routes[ETHERSIA_MAX_ROUTES - 1].lifetime = 0;
+}
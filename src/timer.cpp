@@ -0,0 +1,100 @@
+
+#include "EtherSia.h"
+#include "dns.h"
+
+
+
+// Bring forward the next deadline, if this one is sooner
+static void earliestDeadline(unsigned long &next, unsigned long now, unsigned long deadline)
+{
+    long remaining = deadline - now;
+
+    if (remaining <= 0) {
+        next = 0;
+    } else if ((unsigned long)remaining < next) {
+        next = remaining;
+    }
+}
+
+boolean EtherSia::setTimer(EtherSiaTimerCallback callback, void *context, unsigned long delay)
+{
+    struct ethersia_timer *entry = NULL;
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_TIMERS; i++) {
+        if (_timers[i].callback == callback && _timers[i].context == context) {
+            entry = &_timers[i];
+            break;
+        } else if (entry == NULL && _timers[i].callback == NULL) {
+            entry = &_timers[i];
+        }
+    }
+
+    if (entry == NULL || callback == NULL) {
+        return false;
+    }
+
+    entry->callback = callback;
+    entry->context = context;
+    entry->deadline = millis() + delay;
+    return true;
+}
+
+void EtherSia::cancelTimer(EtherSiaTimerCallback callback, void *context)
+{
+    for (uint8_t i = 0; i < ETHERSIA_MAX_TIMERS; i++) {
+        if (_timers[i].callback == callback && _timers[i].context == context) {
+            _timers[i].callback = NULL;
+        }
+    }
+}
+
+void EtherSia::timerCheck()
+{
+    unsigned long now = millis();
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_TIMERS; i++) {
+        struct ethersia_timer &timer = _timers[i];
+        if (timer.callback && (long)(now - timer.deadline) >= 0) {
+            // Free the entry first, so that the function can set the timer again
+            EtherSiaTimerCallback callback = timer.callback;
+            void *context = timer.context;
+            timer.callback = NULL;
+            callback(context);
+        }
+    }
+}
+
+unsigned long EtherSia::nextDeadline()
+{
+    unsigned long now = millis();
+    unsigned long next = ETHERSIA_POLL_MAX_SLEEP;
+
+    for (uint8_t i = 0; i < ETHERSIA_MAX_TIMERS; i++) {
+        if (_timers[i].callback) {
+            earliestDeadline(next, now, _timers[i].deadline);
+        }
+    }
+
+    if (icmp6AutoConfigurePending()) {
+        earliestDeadline(next, now, _nextSolicitation);
+    }
+
+    if (_mldReportPending) {
+        earliestDeadline(next, now, _mldReportTime);
+    }
+
+    if (pingInProgress()) {
+        earliestDeadline(next, now, _pingSentTime + (_pingResolving ? NEIGHBOUR_SOLICITATION_TIMEOUT : ETHERSIA_PING_INTERVAL));
+    }
+
+    if (lookupInProgress()) {
+        earliestDeadline(next, now, _lookupSentTime + (_lookupResolving ? NEIGHBOUR_SOLICITATION_TIMEOUT : DNS_REQUEST_TIMEOUT));
+    }
+
+    uint32_t expiry = icmp6NextExpiry();
+    if (expiry <= ETHERSIA_POLL_MAX_SLEEP / 1000) {
+        earliestDeadline(next, now, _lifetimeLastCheck + expiry * 1000);
+    }
+
+    return next;
+}
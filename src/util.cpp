@@ -1,6 +1,10 @@
 #include "util.h"
 #include <ctype.h>
 
+static const char hexDigits[16] PROGMEM = {
+    '0', '1', '2', '3', '4', '5', '6', '7',
+    '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+};
 
 int8_t asciiToHex(char c)
 {
@@ -25,6 +29,26 @@ boolean containsColon(const char *str)
     return false;
 }
 
+char hexDigit(uint8_t nibble)
+{
+    return pgm_read_byte(&hexDigits[nibble & 0x0f]);
+}
+
+char* writeHex16(char *buf, uint16_t word)
+{
+    // Skip leading zeros, but always write the last digit
+    int8_t shift = 12;
+    while (shift > 0 && ((word >> shift) & 0x0f) == 0) {
+        shift -= 4;
+    }
+
+    for (; shift >= 0; shift -= 4) {
+        *buf++ = hexDigit(word >> shift);
+    }
+
+    return buf;
+}
+
 void printPaddedHex(uint8_t byte, Print &p)
 {
     char str[2];
@@ -129,3 +153,26 @@ uint16_t chksum(uint16_t sum, const uint8_t *data, uint16_t len)
     /* Return sum in host byte order. */
     return sum;
 }
+
+// See RFC1624 section 3: HC' = ~(~HC + ~m + m')
+uint16_t chksumAdjust(uint16_t checksum, const uint8_t *oldData, const uint8_t *newData, uint16_t len)
+{
+    uint16_t sum = ~checksum;
+    uint16_t t;
+
+    for (uint16_t i = 0; i < len; i += 2) {
+        t = ~((oldData[i] << 8) + oldData[i + 1]);
+        sum += t;
+        if (sum < t) {
+            sum++;      /* carry */
+        }
+
+        t = (newData[i] << 8) + newData[i + 1];
+        sum += t;
+        if (sum < t) {
+            sum++;      /* carry */
+        }
+    }
+
+    return ~sum;
+}
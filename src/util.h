@@ -24,6 +24,23 @@ int8_t asciiToHex(char c);
  */
 boolean containsColon(const char *str);
 
+/**
+ * Convert a 4-bit value to a lower-case ASCII hex character
+ *
+ * @param nibble The value to convert (in range 0x0 to 0xF)
+ * @return The ASCII character
+ */
+char hexDigit(uint8_t nibble);
+
+/**
+ * Write a 16-bit value as lower-case hex, without leading zeros
+ *
+ * @param buf The buffer to write to (at least 4 characters)
+ * @param word The value to write
+ * @return A pointer to the character after the last one written
+ */
+char* writeHex16(char *buf, uint16_t word);
+
 /**
  * Print a 2-byte human readable hex value for an 8-bit integer
  *
@@ -59,6 +76,19 @@ void printHexDump(const uint8_t bytes[], uint16_t len, Print &p=Serial);
  */
 uint16_t chksum(uint16_t sum, const uint8_t *data, uint16_t len);
 
+/**
+ * Update a IP type 16-bit checksum after some of the data it covers has changed
+ *
+ * Only the bytes that changed need to be summed, rather than the whole packet (RFC1624).
+ *
+ * @param checksum The checksum before the change (as stored in the packet, in host byte order)
+ * @param oldData A pointer to a copy of the data before it changed
+ * @param newData A pointer to the data after it changed
+ * @param len The length of the data that changed (in bytes, must be even)
+ * @return The updated checksum
+ */
+uint16_t chksumAdjust(uint16_t checksum, const uint8_t *oldData, const uint8_t *newData, uint16_t len);
+
 /**
  * Macro to make it easy to define AVR flash strings as static members of a class
  *
@@ -1,6 +1,9 @@
 #include "Arduino.h"
 
-uint32_t millis( void ) {return 0;}
+static uint32_t _millis = 0;
+
+uint32_t millis( void ) {return _millis;}
+void setMillis(uint32_t msec) {_millis = msec;}
 uint32_t micros( void ) {return 0;}
 void delay(uint32_t /* msec */) {}
 void delayMicroseconds(uint32_t /* us */) {}
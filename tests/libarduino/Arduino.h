@@ -30,6 +30,9 @@ uint32_t micros( void );
 void delay(uint32_t msec);
 void delayMicroseconds(uint32_t us);
 
+/* testing only: set the time returned by millis() */
+void setMillis(uint32_t msec);
+
 void pinMode(uint8_t, uint8_t);
 void digitalWrite(uint8_t, uint8_t);
 int digitalRead(uint8_t);
@@ -3,11 +3,7 @@
 
 size_t Print::print(const char str[])
 {
-    unsigned int len = strlen(str);
-    for(unsigned int i=0; i<len; i++) {
-        write(str[i]);
-    }
-    return len;
+    return write(str, strlen(str));
 }
 
 size_t Print::print(const __FlashStringHelper* ifsh)
@@ -72,3 +68,12 @@ size_t Print::println(void)
 {
     return print("\r\n");
 }
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+    size_t n = 0;
+    while (size--) {
+        n += write(*buffer++);
+    }
+    return n;
+}
@@ -28,6 +28,10 @@ public:
     size_t println(void);
 
     virtual size_t write(uint8_t chr) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *buffer, size_t size) {
+        return write((const uint8_t *)buffer, size);
+    }
 };
 
 #endif